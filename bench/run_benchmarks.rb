@@ -0,0 +1,335 @@
+# run_benchmarks.rb - runs Jet benchmark programs under a number of
+# configurations and summarizes what the GC did for each of them.
+#
+# usage: ruby run_benchmarks.rb [benchmark ...]
+#
+# Like the test runner, this uses JET_BENCH_EXE and JET_BENCH_STDLIB to
+# find the interpreter and its standard library. Benchmarks should be run
+# against a release build. The compressed benchmark also needs
+# JET_BENCH_COMPRESSED_EXE, a release build with -DCOMPRESSED_REFS=ON.
+
+BENCH_COMMAND_EXE = ENV["JET_BENCH_EXE"] || "jet"
+BENCH_COMPRESSED_EXE = ENV["JET_BENCH_COMPRESSED_EXE"]
+BENCH_STDLIB = ENV["JET_BENCH_STDLIB"] || "."
+BENCH_DIR = File.dirname(__FILE__)
+
+Result = Struct.new(:wall_ms, :stats)
+
+# Runs a benchmark file with the given flags, returning the wall clock
+# time and the statistics printed by --gc-stats. If input is given, it's
+# written to the benchmark's standard input. exe is the interpreter to run
+# it with.
+def run_benchmark(file, flags, input = nil, exe = BENCH_COMMAND_EXE)
+    command = "#{exe} -s #{BENCH_STDLIB} --gc-stats #{flags} #{File.join BENCH_DIR, file}"
+    command = "echo #{input} | #{command}" if input
+    start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    output = `#{command} 2>&1`
+    wall = (Process.clock_gettime(Process::CLOCK_MONOTONIC) - start) * 1000
+    abort "benchmark failed: #{command}\n#{output}" unless $?.success?
+
+    # every statistic is printed as "<number> <name>", separated by commas.
+    stats = {}
+    output.each_line do |line|
+        next unless line.start_with? "gc: "
+        line.sub("gc: ", "").split(",").each do |stat|
+            value, name = stat.strip.split(" ", 2)
+            stats[name] = value.to_f
+        end
+    end
+
+    return Result.new(wall, stats)
+end
+
+def print_table(header, rows)
+    widths = header.each_index.map do |i|
+        ([header[i]] + rows.map { |row| row[i] }).map(&:to_s).map(&:length).max
+    end
+
+    puts header.each_with_index.map { |h, i| h.to_s.rjust(widths[i]) }.join("  ")
+    rows.each do |row|
+        puts row.each_with_index.map { |c, i| c.to_s.rjust(widths[i]) }.join("  ")
+    end
+    puts
+end
+
+# GC count and total GC time for a fixed-size heap of varying sizes,
+# compared against a heap that sizes itself.
+def bench_heap_size
+    puts "== gc_heap_size.jet: collections and GC time against heap size"
+    rows = []
+    ["2m", "4m", "8m", "16m", "32m"].each do |size|
+        flags = "--heap-initial-size #{size} --heap-min-size #{size} --heap-max-size #{size}"
+        result = run_benchmark "gc_heap_size.jet", flags
+        rows << [size, result.stats["collections"].to_i,
+                 result.stats["ms total pause"].round(1), result.wall_ms.round(1)]
+    end
+
+    result = run_benchmark "gc_heap_size.jet", ""
+    rows << ["growable", result.stats["collections"].to_i,
+             result.stats["ms total pause"].round(1), result.wall_ms.round(1)]
+    print_table ["semispace", "collections", "gc ms", "wall ms"], rows
+end
+
+# Collection throughput, in objects copied per second, for a large live
+# set in a fixed-size heap.
+def bench_throughput
+    puts "== gc_throughput.jet: collection throughput"
+    flags = "--heap-initial-size 4m --heap-min-size 4m --heap-max-size 4m"
+    result = run_benchmark "gc_throughput.jet", flags
+    rows = [[result.stats["collections"].to_i,
+             result.stats["objects copied"].to_i,
+             result.stats["ms total pause"].round(1),
+             result.stats["objects copied per second"].to_i]]
+    print_table ["collections", "objects copied", "gc ms", "objects/s"], rows
+end
+
+# Objects copied and GC time for a program with a large, long-lived data
+# structure, with and without a nursery.
+def bench_generational
+    puts "== gc_heap_size.jet: semispace against generational"
+    rows = []
+    ["semispace", "generational"].each do |gc|
+        result = run_benchmark "gc_heap_size.jet", "--gc #{gc}"
+        rows << [gc, result.stats["collections"].to_i,
+                 result.stats["objects copied"].to_i,
+                 result.stats["ms total pause"].round(1),
+                 result.stats["ms max pause"].round(2), result.wall_ms.round(1)]
+    end
+
+    print_table ["gc", "collections", "objects copied", "gc ms", "max ms",
+                 "wall ms"], rows
+end
+
+# GC time, wall time and peak RSS for each collector, on a program with a
+# large, long-lived data structure.
+def bench_collectors
+    puts "== gc_heap_size.jet: collectors"
+    rows = []
+    ["semispace", "generational", "marksweep", "markregion"].each do |gc|
+        result = run_benchmark "gc_heap_size.jet", "--gc #{gc}"
+        rows << [gc, result.stats["collections"].to_i,
+                 result.stats["ms total pause"].round(1),
+                 result.stats["ms max pause"].round(2),
+                 result.stats["kb peak rss"].to_i, result.wall_ms.round(1)]
+    end
+
+    print_table ["gc", "collections", "gc ms", "max ms", "peak rss kb",
+                 "wall ms"], rows
+end
+
+# Collection throughput for the same program as bench_throughput, with
+# an increasing number of GC threads.
+def bench_parallel
+    puts "== gc_throughput.jet: collection throughput against GC threads"
+    flags = "--heap-initial-size 4m --heap-min-size 4m --heap-max-size 4m"
+    rows = []
+    [1, 2, 4, 8].each do |threads|
+        result = run_benchmark "gc_throughput.jet", "#{flags} --gc-threads #{threads}"
+        rows << [threads, result.stats["ms total pause"].round(1),
+                 result.stats["ms max pause"].round(2),
+                 result.stats["objects copied per second"].to_i]
+    end
+
+    print_table ["threads", "gc ms", "max ms", "objects/s"], rows
+end
+
+# Pause times for a program that keeps a large table live, with the
+# whole copy done at once and with incremental collection.
+def bench_latency
+    puts "== gc_latency.jet: pause times"
+    flags = "--heap-initial-size 16m --heap-min-size 16m"
+    rows = []
+    ["--gc semispace", "--gc incremental",
+     "--gc incremental --gc-max-pause-us 200"].each do |gc|
+        result = run_benchmark "gc_latency.jet", "#{flags} #{gc}"
+        rows << [gc, result.stats["us p50 pause"].round(1),
+                 result.stats["us p99 pause"].round(1),
+                 result.stats["us max pause"].round(1),
+                 result.stats["ms total pause"].round(1), result.wall_ms.round(1)]
+    end
+
+    print_table ["gc", "p50 us", "p99 us", "max us", "gc ms", "wall ms"], rows
+end
+
+# Collection throughput for a long list and a large graph of closures,
+# which exercise the tracing of every kind of object that holds pointers.
+def bench_trace
+    puts "== gc_trace.jet: tracing throughput"
+    flags = "--heap-initial-size 2m --heap-min-size 2m --heap-max-size 2m"
+    result = run_benchmark "gc_trace.jet", flags
+    rows = [[result.stats["collections"].to_i,
+             result.stats["objects copied"].to_i,
+             result.stats["ms total pause"].round(1),
+             result.stats["objects copied per second"].to_i]]
+    print_table ["collections", "objects copied", "gc ms", "objects/s"], rows
+end
+
+# Collections and GC time for a loop that only does arithmetic. Numbers
+# and booleans are immediates, so what's left is activations and the
+# argument lists of variadic functions.
+def bench_arith
+    puts "== gc_arith.jet: collections for arithmetic"
+    result = run_benchmark "gc_arith.jet", ""
+    rows = [[result.stats["collections"].to_i,
+             result.stats["objects copied"].to_i,
+             result.stats["ms total pause"].round(1), result.wall_ms.round(1)]]
+    print_table ["collections", "objects copied", "gc ms", "wall ms"], rows
+end
+
+# Peak RSS and code space for a loop that calls eval, with ten times as
+# many iterations the second time. Analyzed code that is dead gets freed,
+# so memory use shouldn't grow with the number of iterations.
+def bench_eval
+    puts "== gc_eval.jet: memory use against calls to eval"
+    rows = []
+    [100000, 1000000].each do |iterations|
+        result = run_benchmark "gc_eval.jet", "", iterations
+        rows << [iterations, result.stats["kb peak rss"].to_i,
+                 result.stats["kb code space"].to_i,
+                 result.stats["code units freed"].to_i, result.wall_ms.round(1)]
+    end
+
+    print_table ["evals", "peak rss kb", "code kb", "units freed", "wall ms"], rows
+    # CI runs this benchmark to guard against leaking analyzed code.
+    abort "peak RSS grew with the number of evals" if rows[1][1] > rows[0][1] * 1.5
+    abort "the code space grew with the number of evals" if rows[1][2] > rows[0][2] * 1.5
+end
+
+# Allocation rate for a program that does little but cons short-lived
+# lists, with each collector. The rate leaves out the time spent
+# collecting, so that it reflects the allocation path itself.
+def bench_alloc
+    puts "== gc_alloc.jet: allocation rate"
+    conses = 2000000
+    rows = []
+    ["semispace", "generational", "marksweep", "markregion"].each do |gc|
+        result = run_benchmark "gc_alloc.jet", "--gc #{gc}"
+        gc_ms = result.stats["ms total pause"]
+        rate = conses / ((result.wall_ms - gc_ms) / 1000.0)
+        rows << [gc, result.stats["collections"].to_i, gc_ms.round(1),
+                 result.wall_ms.round(1), (rate / 1e6).round(1)]
+    end
+
+    print_table ["gc", "collections", "gc ms", "wall ms", "M conses/s"], rows
+end
+
+# Wall time for naive recursive fibonacci, which barely allocates. Its
+# time is mostly the cost of calls, including pushing and popping the
+# frames that protect roots in native code.
+def bench_fib
+    puts "== fib.jet: call overhead"
+    result = run_benchmark "fib.jet", ""
+    rows = [[result.stats["collections"].to_i, result.wall_ms.round(1)]]
+    print_table ["collections", "wall ms"], rows
+end
+
+# Returns the fastest wall clock time, in milliseconds, out of the given
+# number of runs of a benchmark, which is less noisy than a single run.
+def best_wall_ms(runs, file, flags, input = nil)
+    (1..runs).map { run_benchmark(file, flags, input).wall_ms }.min
+end
+
+# Wall time for call-heavy fib and for a loop that calls eval, with each
+# way of running a program. fib is dominated by calls, and eval by
+# analyzing and compiling the forms that it's given. Each time is the
+# best of five runs.
+def bench_interpreters
+    puts "== fib.jet, gc_eval.jet: interpreters"
+    rows = []
+    ["tree", "closure", "bytecode"].each do |interpreter|
+        flags = "--interpreter #{interpreter}"
+        fib = best_wall_ms 5, "fib.jet", flags
+        eval = best_wall_ms 5, "gc_eval.jet", flags, 100000
+        rows << [interpreter, fib.round(1), eval.round(1)]
+    end
+
+    rows.each { |row| row << (rows[0][1] / row[1]).round(2) }
+    print_table ["interpreter", "fib ms", "eval ms", "fib speedup"], rows
+end
+
+# GC time and wall time for a program that keeps traversing a table of
+# lists, with each order that the collector can copy objects in.
+def bench_locality
+    puts "== gc_locality.jet: list traversal against copy order"
+    rows = []
+    ["depth-first", "list"].each do |order|
+        result = run_benchmark "gc_locality.jet", "--gc-copy-order #{order}"
+        rows << [order, result.stats["collections"].to_i,
+                 result.stats["ms total pause"].round(1),
+                 result.stats["objects copied per second"].to_i,
+                 result.wall_ms.round(1)]
+    end
+
+    print_table ["order", "collections", "gc ms", "objects/s", "wall ms"], rows
+end
+
+# Peak RSS, GC time and wall time for list-heavy programs, in a normal
+# build and in one with compressed references. gc_lists.jet has no numbers
+# in its lists, so every cell shrinks; gc_heap_size.jet has one in every
+# cell, which has to be boxed.
+def bench_compressed
+    puts "== gc_lists.jet, gc_heap_size.jet: compressed references"
+    unless BENCH_COMPRESSED_EXE
+        puts "skipped, since JET_BENCH_COMPRESSED_EXE isn't set"
+        puts
+        return
+    end
+
+    rows = []
+    ["gc_lists.jet", "gc_heap_size.jet"].each do |file|
+        [["normal", BENCH_COMMAND_EXE],
+         ["compressed", BENCH_COMPRESSED_EXE]].each do |build, exe|
+            result = run_benchmark file, "", nil, exe
+            rows << [file, build, result.stats["collections"].to_i,
+                     result.stats["ms total pause"].round(1),
+                     result.stats["kb peak rss"].to_i, result.wall_ms.round(1)]
+        end
+    end
+
+    print_table ["benchmark", "build", "collections", "gc ms", "peak rss kb",
+                 "wall ms"], rows
+end
+
+# Resident memory at exit for a program that drops a large data structure
+# and then keeps allocating, with and without an RSS target.
+def bench_footprint
+    puts "== gc_footprint.jet: footprint after a burst of allocation"
+    rows = []
+    ["semispace", "generational", "marksweep", "markregion"].each do |gc|
+        ["", "--gc-rss-target 2m"].each do |target|
+            result = run_benchmark "gc_footprint.jet", "--gc #{gc} #{target}"
+            rows << ["#{gc} #{target}".strip, result.stats["collections"].to_i,
+                     result.stats["ms total pause"].round(1),
+                     result.stats["kb rss"].to_i,
+                     result.stats["kb peak rss"].to_i,
+                     result.stats["kb returned to the os"].to_i]
+        end
+    end
+
+    print_table ["gc", "collections", "gc ms", "rss kb", "peak rss kb",
+                 "returned kb"], rows
+end
+
+BENCHMARKS = {
+    "heap_size" => method(:bench_heap_size),
+    "throughput" => method(:bench_throughput),
+    "trace" => method(:bench_trace),
+    "generational" => method(:bench_generational),
+    "collectors" => method(:bench_collectors),
+    "parallel" => method(:bench_parallel),
+    "latency" => method(:bench_latency),
+    "arith" => method(:bench_arith),
+    "alloc" => method(:bench_alloc),
+    "eval" => method(:bench_eval),
+    "fib" => method(:bench_fib),
+    "interpreters" => method(:bench_interpreters),
+    "locality" => method(:bench_locality),
+    "footprint" => method(:bench_footprint),
+    "compressed" => method(:bench_compressed),
+}
+
+selected = ARGV.empty? ? BENCHMARKS.keys : ARGV
+selected.each do |name|
+    abort "unknown benchmark: #{name}" unless BENCHMARKS.key? name
+    BENCHMARKS[name].call
+end
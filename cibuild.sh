@@ -4,15 +4,93 @@ set -e
 mkdir ci && cd ci
 mkdir debug
 mkdir release
+mkdir conservative
+mkdir compressed
 cd debug
 cmake ../..
 make -j4
 cd ../release
 cmake ../.. -DCMAKE_BUILD_TYPE=Release
 make -j4
+cd ../conservative
+cmake ../.. -DCONSERVATIVE_GC=ON
+make -j4
+cd ../compressed
+cmake ../.. -DCOMPRESSED_REFS=ON
+make -j4
 cd ../..
 
 export JET_TEST_EXE=$(pwd)/ci/debug/src/jet
 export JET_TEST_STDLIB=$(pwd)/src/jet/
 cd test
-ruby run_tests.rb -v
\ No newline at end of file
+ruby run_tests.rb -v
+
+# the tree-walking interpreter and the closure compiler are still
+# selectable, so they have to keep passing as well. Both allocate an
+# activation for every call, so under --gc-stress the long loops and deep
+# recursion in tail_calls collect hundreds of thousands of times, and it
+# is skipped there.
+JET_TEST_FLAGS="--interpreter tree" ruby run_tests.rb -v
+JET_TEST_FLAGS="--interpreter closure" ruby run_tests.rb -v
+JET_TEST_FLAGS="--interpreter closure --gc generational" ruby run_tests.rb -v
+JET_TEST_SKIP="tail_calls" JET_TEST_FLAGS="--interpreter tree --gc-stress --heap-verify" ruby run_tests.rb -v
+JET_TEST_SKIP="tail_calls" JET_TEST_FLAGS="--interpreter closure --gc-stress --heap-verify" ruby run_tests.rb -v
+JET_TEST_SKIP="tail_calls" JET_TEST_FLAGS="--interpreter closure --gc generational --gc-stress --heap-verify" ruby run_tests.rb -v
+
+# run everything again with the generational collector, which
+# is the only thing that exercises the write barriers.
+JET_TEST_FLAGS="--gc generational" ruby run_tests.rb -v
+JET_TEST_FLAGS="--gc generational --gc-stress --heap-verify" ruby run_tests.rb -v
+JET_TEST_FLAGS="--gc-threads 4 --gc-stress --heap-verify" ruby run_tests.rb -v
+JET_TEST_FLAGS="--gc incremental --gc-stress --heap-verify" ruby run_tests.rb -v
+JET_TEST_FLAGS="--gc-copy-order list --gc-stress --heap-verify" ruby run_tests.rb -v
+JET_TEST_FLAGS="--gc marksweep" ruby run_tests.rb -v
+JET_TEST_FLAGS="--gc marksweep --gc-stress --heap-verify" ruby run_tests.rb -v
+JET_TEST_FLAGS="--gc markregion" ruby run_tests.rb -v
+JET_TEST_FLAGS="--gc markregion --gc-stress --heap-verify" ruby run_tests.rb -v
+JET_TEST_FLAGS="--gc-rss-target 64k --gc-huge-pages" ruby run_tests.rb -v
+JET_TEST_FLAGS="--gc markregion --gc-rss-target 64k" ruby run_tests.rb -v
+JET_TEST_FLAGS="--gc-no-helper-thread --gc-stress" ruby run_tests.rb -v
+JET_TEST_FLAGS="--heap-soft-limit 64k --gc-stress" ruby run_tests.rb -v
+JET_TEST_FLAGS="--gc marksweep --heap-soft-limit 64k" ruby run_tests.rb -v
+
+# running out of the heap, or of the code space, has to be a runtime error
+# that the program can recover from, whichever collector is in use.
+JET_TEST_LIMITS=1 JET_TEST_FLAGS="--heap-max-size 1m" ruby run_tests.rb -v
+JET_TEST_LIMITS=1 JET_TEST_FLAGS="--gc generational --heap-max-size 1m" ruby run_tests.rb -v
+JET_TEST_LIMITS=1 JET_TEST_FLAGS="--gc incremental --heap-max-size 1m" ruby run_tests.rb -v
+JET_TEST_LIMITS=1 JET_TEST_FLAGS="--gc marksweep --heap-max-size 1m" ruby run_tests.rb -v
+JET_TEST_LIMITS=1 JET_TEST_FLAGS="--gc markregion --heap-max-size 1m" ruby run_tests.rb -v
+JET_TEST_LIMITS=1 JET_TEST_FLAGS="--gc-threads 4 --heap-max-size 1m" ruby run_tests.rb -v
+
+# the conservative build doesn't protect roots by hand, so the whole suite
+# is run against it as well.
+export JET_TEST_EXE=$(pwd)/../ci/conservative/src/jet
+ruby run_tests.rb -v
+JET_TEST_FLAGS="--gc-stress --heap-verify" ruby run_tests.rb -v
+JET_TEST_FLAGS="--gc-stress --gc-rss-target 64k" ruby run_tests.rb -v
+JET_TEST_LIMITS=1 JET_TEST_FLAGS="--heap-max-size 1m" ruby run_tests.rb -v
+
+# the compressed build stores heap references and cons fields as 32-bit
+# offsets, which every collector has to decode and re-encode, and boxes
+# the numbers in conses.
+export JET_TEST_EXE=$(pwd)/../ci/compressed/src/jet
+ruby run_tests.rb -v
+JET_TEST_FLAGS="--gc-stress --heap-verify" ruby run_tests.rb -v
+JET_TEST_FLAGS="--gc generational --gc-stress --heap-verify" ruby run_tests.rb -v
+JET_TEST_FLAGS="--gc-threads 4 --gc-stress --heap-verify" ruby run_tests.rb -v
+JET_TEST_FLAGS="--gc marksweep --gc-stress --heap-verify" ruby run_tests.rb -v
+JET_TEST_FLAGS="--gc markregion --gc-stress --heap-verify" ruby run_tests.rb -v
+# the incremental collector's read barrier decodes compressed fields while
+# the program runs.
+JET_TEST_FLAGS="--gc incremental --gc-stress --heap-verify" ruby run_tests.rb -v
+JET_TEST_FLAGS="--gc incremental --interpreter tree" ruby run_tests.rb -v
+JET_TEST_LIMITS=1 JET_TEST_FLAGS="--heap-max-size 1m" ruby run_tests.rb -v
+JET_TEST_LIMITS=1 JET_TEST_FLAGS="--gc marksweep --heap-max-size 1m" ruby run_tests.rb -v
+
+# analyzed code that is dead has to be freed, so memory use mustn't grow
+# with the number of calls to eval. bench_eval fails if it does.
+cd ../bench
+export JET_BENCH_EXE=$(pwd)/../ci/release/src/jet
+export JET_BENCH_STDLIB=$(pwd)/../src/jet/
+ruby run_benchmarks.rb eval
@@ -22,21 +22,29 @@
 #include "contract.h"
 #include "gc.h"
 
+#include <algorithm>
 #include <iostream>
 
-Sexp *g_global_activation;
+Value g_global_activation;
 
-Sexp *Activation::Get(size_t up_index, size_t right_index) {
+Value Activation::Get(size_t up_index, size_t right_index) {
   CONTRACT { FORBID_GC; }
 
   Activation *cursor = this;
   for (size_t i = 0; i < up_index; i++) {
     assert(cursor != nullptr);
-    assert(cursor->parent->IsActivation());
-    cursor = cursor->parent->activation;
+    assert(GC_READ_BARRIER(cursor->parent)->IsActivation());
+    cursor = &GC_READ_BARRIER(cursor->parent)->AsObject()->activation;
   }
 
   assert(cursor != nullptr);
+  Value *slots = cursor->Slots();
+  size_t count = cursor->count;
+  if (cursor->parent == nullptr) {
+    Value globals = GC_READ_BARRIER(slots[0]);
+    slots = globals->AsObject()->slots.values;
+    count = globals->AsObject()->slots.count;
+  }
 
   // at this point, if the right_index isn't valid (it's out of bounds
   // or it refers to a null slot), then it's an uninitialized read.
@@ -44,12 +52,12 @@ Sexp *Activation::Get(size_t up_index, size_t right_index) {
   // unfortunately, at this point we've eliminated variable names,
   // so we can't give a very good error message. The analysis phase
   // should have emitted a warning when it saw that this could happen.
-  if (right_index >= cursor->slots.size()) {
+  if (right_index >= count) {
     throw JetRuntimeException("invalid read of uninitialized variable. Run "
                               "with --warnings for more details.");
   }
 
-  Sexp *result = cursor->slots[right_index];
+  Value result = GC_READ_BARRIER(slots[right_index]);
   if (result == nullptr) {
     throw JetRuntimeException("invalid read of uninitialized variable. Run "
                               "with --warnings for more details.");
@@ -58,43 +66,63 @@ Sexp *Activation::Get(size_t up_index, size_t right_index) {
   return result;
 }
 
-void Activation::Set(size_t up_index, size_t right_index, Sexp *value) {
-  CONTRACT { FORBID_GC; }
+void Activation::Set(Value act, size_t up_index, size_t right_index,
+                     Value value) {
+  CONTRACT { PRECONDITION(act->IsActivation()); }
 
   // we should never (barring call/cc, not implemented) be putting
   // activations in another activation.
   assert(!value->IsActivation());
 
-  Activation *cursor = this;
   for (size_t i = 0; i < up_index; i++) {
-    assert(cursor != nullptr);
-    assert(cursor->parent->IsActivation());
-    cursor = cursor->parent->activation;
+    act = GC_READ_BARRIER(act->AsObject()->activation.parent);
+    assert(act->IsActivation());
   }
 
-  assert(cursor != nullptr);
-  if (right_index >= cursor->slots.size()) {
+  Activation *target = &act->AsObject()->activation;
+  if (target->parent != nullptr) {
+    // the analysis phase gave this activation a slot for every variable
+    // in its scope.
+    assert(right_index < target->count);
+    GC_WRITE_BARRIER(act, value);
+    target->Slots()[right_index] = value;
+    return;
+  }
+
+  Value globals = GC_READ_BARRIER(target->Slots()[0]);
+  if (right_index >= globals->AsObject()->slots.count) {
     // we're defining something and need to
     // expand our slots.
-    size_t diff = right_index - cursor->slots.size();
-    for (size_t i = 0; i <= diff; i++) {
-      cursor->slots.push_back(nullptr);
-    }
+    GC_HELPER_FRAME;
+    GC_PROTECT(act);
+    GC_PROTECT(value);
+    Grow(act, right_index + 1);
+    globals = GC_READ_BARRIER(act->AsObject()->activation.Slots()[0]);
   }
 
-  assert(right_index < cursor->slots.size());
-  cursor->slots[right_index] = value;
+  GC_WRITE_BARRIER(globals, value);
+  globals->AsObject()->slots.values[right_index] = value;
 }
 
-void Activation::TracePointers(std::function<void(Sexp **)> func) {
-  Sexp **data = slots.data();
-  for (size_t i = 0; i < slots.size(); i++) {
-    if (data[i] != nullptr) {
-      func(&data[i]);
-    }
-  }
+void Activation::Grow(Value act, size_t min_count) {
+  GC_HELPER_FRAME;
+  GC_PROTECT(act);
+  GC_PROTECTED_LOCAL(grown);
 
-  if (parent != nullptr) {
-    func(&parent);
+  // the slot array doubles every time, so that defining n globals is
+  // linear in n.
+  Value globals = GC_READ_BARRIER(act->AsObject()->activation.Slots()[0]);
+  size_t count = globals->AsObject()->slots.count;
+  grown = GcHeap::AllocateSlots(std::max(min_count, 2 * count));
+
+  // the allocation might have moved the old slot array.
+  globals = GC_READ_BARRIER(act->AsObject()->activation.Slots()[0]);
+  for (size_t i = 0; i < count; i++) {
+    Value slot = GC_READ_BARRIER(globals->AsObject()->slots.values[i]);
+    GC_WRITE_BARRIER(grown, slot);
+    grown->AsObject()->slots.values[i] = slot;
   }
+
+  GC_WRITE_BARRIER(act, grown);
+  act->AsObject()->activation.Slots()[0] = grown;
 }
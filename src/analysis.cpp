@@ -19,6 +19,8 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 #include "analysis.h"
+#include "bytecode.h"
+#include "closure.h"
 #include "contract.h"
 #include "gc.h"
 #include "interner.h"
@@ -30,6 +32,8 @@ using namespace std::literals;
 
 Environment *g_the_environment;
 
+static Value AnalyzeForm(Value form);
+
 std::tuple<size_t, size_t> Environment::Get(size_t symbol) {
   // starting at the most recent lexical environment, search upwards
   // until we find what we're looking for.
@@ -54,7 +58,7 @@ std::tuple<size_t, size_t> Environment::Get(size_t symbol) {
 
 void Environment::Define(size_t symbol) {
   std::unordered_map<size_t, std::tuple<bool, size_t>> &env = slot_map.back();
-  size_t idx = env.size();
+  size_t idx = slot_counts.back()++;
   env[symbol] = std::make_tuple(false, idx);
 }
 
@@ -97,9 +101,18 @@ void Environment::SetMacro(size_t symbol) {
   UNREACHABLE();
 }
 
-void Environment::EnterScope() { slot_map.emplace_back(); }
+void Environment::EnterScope() {
+  slot_map.emplace_back();
+  slot_counts.push_back(0);
+  inner_scopes.back() = true;
+  inner_scopes.push_back(false);
+}
 
-void Environment::ExitScope() { slot_map.pop_back(); }
+void Environment::ExitScope() {
+  slot_map.pop_back();
+  slot_counts.pop_back();
+  inner_scopes.pop_back();
+}
 
 void Environment::Dump() {
   size_t index = 0;
@@ -113,7 +126,7 @@ void Environment::Dump() {
   std::cout << std::endl;
 }
 
-static Sexp *AnalyzeAtom(Sexp *form) {
+static Value AnalyzeAtom(Value form) {
   CONTRACT { PRECONDITION(!form->IsCons()); }
 
   GC_HELPER_FRAME;
@@ -140,7 +153,12 @@ static Sexp *AnalyzeAtom(Sexp *form) {
     // Note that we only have to do this if the meaning we are creating
     // contains managed pointers. If it doesn't, we don't care - we can
     // do whatever we want.
-    QuotedMeaning *meaning = new QuotedMeaning(form);
+    //
+    // AllocateMeaning doesn't trigger GCs anymore since meanings live in the
+    // code space, but the pattern is kept so that this stays correct if
+    // that ever changes.
+    QuotedMeaning *meaning =
+        new QuotedMeaning(GcHeap::AllocateConstant(form));
     GC_PROTECT(meaning->Quoted());
     return GcHeap::AllocateMeaning(meaning);
   }
@@ -149,14 +167,14 @@ static Sexp *AnalyzeAtom(Sexp *form) {
     size_t up_index;
     size_t right_index;
     std::tie(up_index, right_index) =
-        g_the_environment->Get(form->symbol_value);
+        g_the_environment->Get(form->AsSymbol());
     return GcHeap::AllocateMeaning(new ReferenceMeaning(up_index, right_index));
   }
 
   PANIC("unknown s-expression being analyzed");
 }
 
-static Sexp *AnalyzeQuote(Sexp *form) {
+static Value AnalyzeQuote(Value form) {
   GC_HELPER_FRAME;
   GC_PROTECT(form);
 
@@ -167,12 +185,13 @@ static Sexp *AnalyzeQuote(Sexp *form) {
     throw JetRuntimeException("invalid quote form");
   }
 
-  QuotedMeaning *meaning = new QuotedMeaning(form->Car());
+  QuotedMeaning *meaning =
+      new QuotedMeaning(GcHeap::AllocateConstant(form->Car()));
   GC_PROTECT(meaning->Quoted());
   return GcHeap::AllocateMeaning(meaning);
 }
 
-static Sexp *AnalyzeBegin(Sexp *form) {
+static Value AnalyzeBegin(Value form) {
   GC_HELPER_FRAME;
   GC_PROTECT(form);
   GC_PROTECTED_LOCAL(last);
@@ -182,11 +201,11 @@ static Sexp *AnalyzeBegin(Sexp *form) {
     throw JetRuntimeException("invalid begin form");
   }
 
-  form->ForEach([&](Sexp *form) {
+  form->ForEach([&](Value form) {
     GC_HELPER_FRAME;
     GC_PROTECT(form);
     GC_PROTECTED_LOCAL(analysis_result);
-    analysis_result = Analyze(form);
+    analysis_result = AnalyzeForm(form);
 
     body.push_back(analysis_result);
   });
@@ -199,7 +218,7 @@ static Sexp *AnalyzeBegin(Sexp *form) {
   return GcHeap::AllocateMeaning(meaning);
 }
 
-static Sexp *AnalyzeDefineFunction(Sexp *form) {
+static Value AnalyzeDefineFunction(Value form) {
   GC_HELPER_FRAME;
   GC_PROTECT(form);
   GC_PROTECTED_LOCAL(args);
@@ -221,25 +240,23 @@ static Sexp *AnalyzeDefineFunction(Sexp *form) {
 
   name = args->Car();
 
-  GC_PROTECTED_LOCAL(define_sym);
   GC_PROTECTED_LOCAL(define_form);
-  GC_PROTECTED_LOCAL(define_args);
-  GC_PROTECTED_LOCAL(lambda);
-  GC_PROTECTED_LOCAL(lambda_sym);
-  GC_PROTECTED_LOCAL(lambda_args);
-  lambda_sym = GcHeap::AllocateSymbol(SymbolInterner::Lambda);
-  lambda_args = GcHeap::AllocateCons(form->Cadr(), GcHeap::AllocateEmpty());
-  lambda_args = GcHeap::AllocateCons(args->Cdr(), lambda_args);
-  lambda = GcHeap::AllocateCons(lambda_sym, lambda_args);
-  define_sym = GcHeap::AllocateSymbol(SymbolInterner::Define);
-  define_args = GcHeap::AllocateCons(lambda, GcHeap::AllocateEmpty());
-  define_args = GcHeap::AllocateCons(name, define_args);
-  define_form = GcHeap::AllocateCons(define_sym, define_args);
-
-  return Analyze(define_form);
+  GC_PROTECTED_LOCAL_VECTOR(elements);
+  elements.push_back(GcHeap::AllocateSymbol(SymbolInterner::Lambda));
+  elements.push_back(args->Cdr());
+  elements.push_back(form->Cadr());
+  define_form = GcHeap::AllocateList(elements);
+
+  elements.clear();
+  elements.push_back(GcHeap::AllocateSymbol(SymbolInterner::Define));
+  elements.push_back(name);
+  elements.push_back(define_form);
+  define_form = GcHeap::AllocateList(elements);
+
+  return AnalyzeForm(define_form);
 }
 
-static Sexp *AnalyzeDefine(Sexp *form, bool is_macro) {
+static Value AnalyzeDefine(Value form, bool is_macro) {
   GC_HELPER_FRAME;
   GC_PROTECT(form);
   GC_PROTECTED_LOCAL(binding);
@@ -262,21 +279,21 @@ static Sexp *AnalyzeDefine(Sexp *form, bool is_macro) {
     throw JetRuntimeException("invalid define form");
   }
 
-  size_t sym_name = form->Car()->symbol_value;
+  size_t sym_name = form->Car()->AsSymbol();
   size_t up_index;
   size_t right_index;
   std::tie(up_index, right_index) = g_the_environment->DefineGlobal(sym_name);
   if (is_macro) {
     g_the_environment->SetMacro(sym_name);
   }
-  binding = Analyze(form->Cadr());
+  binding = AnalyzeForm(form->Cadr());
   DefinitionMeaning *meaning =
       new DefinitionMeaning(up_index, right_index, binding);
   GC_PROTECT(meaning->BindingValue());
   return GcHeap::AllocateMeaning(meaning);
 }
 
-static Sexp *AnalyzeIf(Sexp *form) {
+static Value AnalyzeIf(Value form) {
   GC_HELPER_FRAME;
   GC_PROTECT(form);
   GC_PROTECTED_LOCAL(cond);
@@ -290,11 +307,11 @@ static Sexp *AnalyzeIf(Sexp *form) {
     throw JetRuntimeException("invalid if form");
   }
 
-  cond = Analyze(form->Car());
-  true_branch = Analyze(form->Cadr());
+  cond = AnalyzeForm(form->Car());
+  true_branch = AnalyzeForm(form->Cadr());
 
   if (len == 3) {
-    false_branch = Analyze(form->Caddr());
+    false_branch = AnalyzeForm(form->Caddr());
   } else if (len == 2) {
     // this is questionable and goes against
     // the guidance earlier in the file about protecting
@@ -312,7 +329,7 @@ static Sexp *AnalyzeIf(Sexp *form) {
   return GcHeap::AllocateMeaning(meaning);
 }
 
-static Sexp *AnalyzeLambda(Sexp *form) {
+static Value AnalyzeLambda(Value form) {
   GC_HELPER_FRAME;
   GC_PROTECT(form);
   GC_PROTECTED_LOCAL(params);
@@ -357,12 +374,12 @@ static Sexp *AnalyzeLambda(Sexp *form) {
       throw JetRuntimeException("invalid lambda form: parameter not a symbol");
     }
 
-    g_the_environment->Define(cursor->Car()->symbol_value);
+    g_the_environment->Define(cursor->Car()->AsSymbol());
     cursor = cursor->Cdr();
   }
 
   if (cursor->IsCons()) {
-    g_the_environment->Define(cursor->Car()->symbol_value);
+    g_the_environment->Define(cursor->Car()->AsSymbol());
   } else if (!cursor->IsCons() && !cursor->IsEmpty()) {
     // this means that the parameter list was improper, and the cdr
     // of the cursor is the "rest" parameter.
@@ -370,16 +387,22 @@ static Sexp *AnalyzeLambda(Sexp *form) {
       throw JetRuntimeException("invalid lambda form: parameter not a sybmol");
     }
 
-    g_the_environment->Define(cursor->symbol_value);
+    g_the_environment->Define(cursor->AsSymbol());
   }
 
-  form->Cdr()->ForEach([&](Sexp *body_form) {
+  size_t slot_count = g_the_environment->SlotCount();
+  if (slot_count > max_activation_slots) {
+    throw JetRuntimeException("invalid lambda form: too many parameters");
+  }
+
+  form->Cdr()->ForEach([&](Value body_form) {
     GC_HELPER_FRAME;
     GC_PROTECT(body_form);
 
-    body.push_back(Analyze(body_form));
+    body.push_back(AnalyzeForm(body_form));
   });
 
+  bool has_inner_scopes = g_the_environment->HasInnerScopes();
   g_the_environment->ExitScope();
 
   GC_PROTECTED_LOCAL(last);
@@ -392,12 +415,16 @@ static Sexp *AnalyzeLambda(Sexp *form) {
   GC_PROTECTED_LOCAL(seq_meaning);
   seq_meaning = GcHeap::AllocateMeaning(seq);
   LambdaMeaning *meaning =
-      new LambdaMeaning(required_params, is_variadic, seq_meaning);
+      new LambdaMeaning(required_params, is_variadic, slot_count,
+                        has_inner_scopes, seq_meaning);
   GC_PROTECT(meaning->Body());
-  return GcHeap::AllocateMeaning(meaning);
+  GC_PROTECTED_LOCAL(lambda_meaning);
+  lambda_meaning = GcHeap::AllocateMeaning(meaning);
+  meaning->SetCell(lambda_meaning);
+  return lambda_meaning;
 }
 
-static Sexp *AnalyzeSet(Sexp *form) {
+static Value AnalyzeSet(Value form) {
   GC_HELPER_FRAME;
   GC_PROTECT(form);
   GC_PROTECTED_LOCAL(binding);
@@ -415,15 +442,15 @@ static Sexp *AnalyzeSet(Sexp *form) {
 
   size_t up_index;
   size_t right_index;
-  size_t sym_name = form->Car()->symbol_value;
+  size_t sym_name = form->Car()->AsSymbol();
   std::tie(up_index, right_index) = g_the_environment->Get(sym_name);
-  binding = Analyze(form->Cadr());
+  binding = AnalyzeForm(form->Cadr());
   SetMeaning *meaning = new SetMeaning(up_index, right_index, binding);
   GC_PROTECT(meaning->BindingValue());
   return GcHeap::AllocateMeaning(meaning);
 }
 
-static Sexp *AnalyzeInvocation(Sexp *form) {
+static Value AnalyzeInvocation(Value form) {
   GC_HELPER_FRAME;
   GC_PROTECT(form);
   GC_PROTECTED_LOCAL(base);
@@ -436,22 +463,22 @@ static Sexp *AnalyzeInvocation(Sexp *form) {
   }
 
   if (form->Car()->IsSymbol()) {
-    if (g_the_environment->IsMacro(form->Car()->symbol_value)) {
+    if (g_the_environment->IsMacro(form->Car()->AsSymbol())) {
       // this is a macro that needs to be expanded and evaluated
       // right now, before we analyze the arguments.
       GC_PROTECTED_LOCAL(macro_expansion);
       NYI();
-      return Analyze(macro_expansion);
+      return AnalyzeForm(macro_expansion);
     }
   }
 
-  base = Analyze(form->Car());
-  form->Cdr()->ForEach([&](Sexp *arg) {
+  base = AnalyzeForm(form->Car());
+  form->Cdr()->ForEach([&](Value arg) {
     GC_HELPER_FRAME;
     GC_PROTECT(arg);
     GC_PROTECTED_LOCAL(analyze_result);
 
-    analyze_result = Analyze(arg);
+    analyze_result = AnalyzeForm(arg);
     arguments.push_back(analyze_result);
   });
 
@@ -462,7 +489,7 @@ static Sexp *AnalyzeInvocation(Sexp *form) {
   return GcHeap::AllocateMeaning(meaning);
 }
 
-static Sexp *Quasiquote(Sexp *form) {
+static Value Quasiquote(Value form) {
   // a quasiquote form such as
   //   `(a ,b ,@c)
   // reads like
@@ -480,7 +507,7 @@ static Sexp *Quasiquote(Sexp *form) {
   NYI();
 }
 
-static Sexp *AnalyzeQuasiquote(Sexp *form) {
+static Value AnalyzeQuasiquote(Value form) {
   GC_HELPER_FRAME;
   GC_PROTECT(form);
   GC_PROTECTED_LOCAL(arg);
@@ -502,7 +529,7 @@ static Sexp *AnalyzeQuasiquote(Sexp *form) {
   }
 
   transformed = Quasiquote(arg);
-  return Analyze(transformed);
+  return AnalyzeForm(transformed);
 }
 
 // The `let` form is not a fundamental form
@@ -512,7 +539,7 @@ static Sexp *AnalyzeQuasiquote(Sexp *form) {
 // As such, the `let` form doesn't translate into a LetMeaning,
 // since those don't exist - instead we rewrite the let as
 // a lambda, like the macro will do.
-static Sexp *AnalyzeLet(Sexp *form) {
+static Value AnalyzeLet(Value form) {
   GC_HELPER_FRAME;
   GC_PROTECT(form);
   GC_PROTECTED_LOCAL(bindings);
@@ -538,7 +565,7 @@ static Sexp *AnalyzeLet(Sexp *form) {
   }
 
   g_the_environment->EnterScope();
-  bindings->ForEach([&](Sexp *binding) {
+  bindings->ForEach([&](Value binding) {
     GC_HELPER_FRAME;
     GC_PROTECT(binding);
 
@@ -557,25 +584,31 @@ static Sexp *AnalyzeLet(Sexp *form) {
     }
 
     variables.push_back(binding->Car());
-    g_the_environment->Define(binding->Car()->symbol_value);
+    g_the_environment->Define(binding->Car()->AsSymbol());
   });
 
+  size_t slot_count = g_the_environment->SlotCount();
+  if (slot_count > max_activation_slots) {
+    throw JetRuntimeException("invalid let form: too many bindings");
+  }
+
   assert(form->Cdr()->IsCons());
-  form->Cdr()->ForEach([&](Sexp *body) {
+  form->Cdr()->ForEach([&](Value body) {
     GC_HELPER_FRAME;
     GC_PROTECT(body);
 
-    body_values.push_back(Analyze(body));
+    body_values.push_back(AnalyzeForm(body));
   });
 
+  bool has_inner_scopes = g_the_environment->HasInnerScopes();
   g_the_environment->ExitScope();
 
   // once we've exited the scope, we visit binding values.
-  bindings->ForEach([&](Sexp *binding) {
+  bindings->ForEach([&](Value binding) {
     GC_HELPER_FRAME;
     GC_PROTECT(binding);
 
-    binding_values.push_back(Analyze(binding->Cadr()));
+    binding_values.push_back(AnalyzeForm(binding->Cadr()));
   });
 
   GC_PROTECTED_LOCAL(last);
@@ -589,10 +622,12 @@ static Sexp *AnalyzeLet(Sexp *form) {
   GC_PROTECTED_LOCAL(body_meaning);
   body_meaning = GcHeap::AllocateMeaning(body_meaning_value);
   LambdaMeaning *base_value =
-      new LambdaMeaning(variables.size(), false, body_meaning);
+      new LambdaMeaning(variables.size(), false, slot_count,
+                        has_inner_scopes, body_meaning);
   GC_PROTECT(base_value->Body());
   GC_PROTECTED_LOCAL(lambda_meaning);
   lambda_meaning = GcHeap::AllocateMeaning(base_value);
+  base_value->SetCell(lambda_meaning);
   InvocationMeaning *call_meaning =
       new InvocationMeaning(lambda_meaning, std::move(binding_values));
   GC_PROTECT(call_meaning->Base());
@@ -600,12 +635,12 @@ static Sexp *AnalyzeLet(Sexp *form) {
   return GcHeap::AllocateMeaning(call_meaning);
 }
 
-Sexp *AnalyzeShortCircuit(Sexp *form) {
+Value AnalyzeShortCircuit(Value form) {
   CONTRACT {
     PRECONDITION(form->IsCons());
     PRECONDITION(form->Car()->IsSymbol());
-    PRECONDITION(form->Car()->symbol_value == SymbolInterner::And ||
-                 form->Car()->symbol_value == SymbolInterner::Or);
+    PRECONDITION(form->Car()->AsSymbol() == SymbolInterner::And ||
+                 form->Car()->AsSymbol() == SymbolInterner::Or);
   }
 
   GC_HELPER_FRAME;
@@ -620,21 +655,21 @@ Sexp *AnalyzeShortCircuit(Sexp *form) {
   }
 
   form->Cdr()->ForEach(
-      [&](Sexp *argument) { args.push_back(Analyze(argument)); });
+      [&](Value argument) { args.push_back(AnalyzeForm(argument)); });
 
-  if (form->Car()->symbol_value == SymbolInterner::And) {
+  if (form->Car()->AsSymbol() == SymbolInterner::And) {
     AndMeaning *meaning = new AndMeaning(args);
     GC_PROTECT_VECTOR(meaning->Arguments());
     return GcHeap::AllocateMeaning(meaning);
   } else {
-    assert(form->Car()->symbol_value == SymbolInterner::Or);
+    assert(form->Car()->AsSymbol() == SymbolInterner::Or);
     OrMeaning *meaning = new OrMeaning(args);
     GC_PROTECT_VECTOR(meaning->Arguments());
     return GcHeap::AllocateMeaning(meaning);
   }
 }
 
-Sexp *Analyze(Sexp *form) {
+static Value AnalyzeForm(Value form) {
   CONTRACT {
     PRECONDITION(form != nullptr);
     PRECONDITION(g_the_environment != nullptr);
@@ -648,7 +683,7 @@ Sexp *Analyze(Sexp *form) {
   }
 
   if (form->Car()->IsSymbol()) {
-    switch (form->Car()->symbol_value) {
+    switch (form->Car()->AsSymbol()) {
     case SymbolInterner::Quote:
       return AnalyzeQuote(form->Cdr());
     case SymbolInterner::Begin:
@@ -679,3 +714,23 @@ Sexp *Analyze(Sexp *form) {
   // ((lambda (x) (+ x 1)) 1)
   return AnalyzeInvocation(form);
 }
+
+Value Analyze(Value form) {
+  // everything that this form analyzes and compiles to belongs to one
+  // compilation unit.
+  CodeUnitScope unit_scope;
+  GC_HELPER_FRAME;
+  GC_PROTECTED_LOCAL(meaning);
+
+  meaning = AnalyzeForm(form);
+  switch (g_options.interpreter) {
+  case Interpreter::Bytecode:
+    return Compile(meaning, g_the_environment->Depth());
+  case Interpreter::Closure:
+    return CompileClosures(meaning, g_the_environment->Depth());
+  case Interpreter::Tree:
+    return meaning;
+  }
+
+  UNREACHABLE();
+}
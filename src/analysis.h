@@ -36,9 +36,19 @@ private:
   // The slot map maps symbols to the slot that they have been
   // assigned in this environment.
   std::vector<std::unordered_map<size_t, std::tuple<bool, size_t>>> slot_map;
+  // The number of slots that have been assigned in each scope. A symbol
+  // that is defined twice in the same scope gets a new slot each time.
+  std::vector<size_t> slot_counts;
+  // Whether another scope has been entered inside of each scope. Closures
+  // created in an inner scope can capture the activation of an outer one.
+  std::vector<bool> inner_scopes;
 
 public:
-  Environment() { slot_map.emplace_back(); }
+  Environment() {
+    slot_map.emplace_back();
+    slot_counts.push_back(0);
+    inner_scopes.push_back(false);
+  }
 
   ~Environment() {}
 
@@ -69,6 +79,17 @@ public:
   // Pops a lexical scope from the stack.
   void ExitScope();
 
+  // Returns the number of slots that the activation for the current
+  // scope needs.
+  size_t SlotCount() const { return slot_counts.back(); }
+
+  // Returns whether or not a scope has been entered inside of the current
+  // scope since it was entered.
+  bool HasInnerScopes() const { return inner_scopes.back(); }
+
+  // Returns the number of scopes that are open, beyond the global scope.
+  size_t Depth() const { return slot_counts.size() - 1; }
+
   // Dumps this environment to standard out.
   void Dump();
 };
@@ -77,5 +98,8 @@ extern Environment *g_the_environment;
 
 // Analyzes an s-expression and creates a Meaning from it,
 // suitable to be executed. This method throws a JetRuntimeException
-// if it encounters an ill-formed program.
-Sexp *Analyze(Sexp *form);
+// if it encounters an ill-formed program. The meanings that are created
+// make up a new compilation unit, which is freed by the GC once none of
+// them are reachable. Unless the tree-walking interpreter is in use, the
+// result is compiled to bytecode or to closures as part of the same unit.
+Value Analyze(Value form);
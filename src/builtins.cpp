@@ -42,7 +42,7 @@ static typename FunctionTrait<L>::f_type MakeFunction(L l) {
 
 // Loads a single builtin function into the given activation.
 template <typename F>
-void LoadSingleBuiltin(Sexp *activation, const char *name, F func) {
+void LoadSingleBuiltin(Value activation, const char *name, F func) {
   CONTRACT { PRECONDITION(activation->IsActivation()); }
 
   GC_HELPER_FRAME;
@@ -54,10 +54,10 @@ void LoadSingleBuiltin(Sexp *activation, const char *name, F func) {
   size_t up, right;
   std::tie(up, right) =
       g_the_environment->DefineGlobal(SymbolInterner::InternSymbol(name));
-  activation->activation->Set(up, right, alloced_func);
+  Activation::Set(activation, up, right, alloced_func);
 }
 
-Sexp *Builtin_Add(Sexp *fst, Sexp *snd) {
+Value Builtin_Add(Value fst, Value snd) {
   GC_HELPER_FRAME;
   GC_PROTECT(fst);
   GC_PROTECT(snd);
@@ -70,10 +70,10 @@ Sexp *Builtin_Add(Sexp *fst, Sexp *snd) {
     throw JetRuntimeException("type error: not a fixnum");
   }
 
-  return GcHeap::AllocateFixnum(fst->fixnum_value + snd->fixnum_value);
+  return GcHeap::AllocateFixnum(fst->AsFixnum() + snd->AsFixnum());
 }
 
-Sexp *Builtin_Sub(Sexp *fst, Sexp *snd) {
+Value Builtin_Sub(Value fst, Value snd) {
   GC_HELPER_FRAME;
   GC_PROTECT(fst);
   GC_PROTECT(snd);
@@ -86,10 +86,10 @@ Sexp *Builtin_Sub(Sexp *fst, Sexp *snd) {
     throw JetRuntimeException("type error: not a fixnum");
   }
 
-  return GcHeap::AllocateFixnum(fst->fixnum_value - snd->fixnum_value);
+  return GcHeap::AllocateFixnum(fst->AsFixnum() - snd->AsFixnum());
 }
 
-Sexp *Builtin_Mul(Sexp *fst, Sexp *snd) {
+Value Builtin_Mul(Value fst, Value snd) {
   GC_HELPER_FRAME;
   GC_PROTECT(fst);
   GC_PROTECT(snd);
@@ -102,10 +102,10 @@ Sexp *Builtin_Mul(Sexp *fst, Sexp *snd) {
     throw JetRuntimeException("type error: not a fixnum");
   }
 
-  return GcHeap::AllocateFixnum(fst->fixnum_value * snd->fixnum_value);
+  return GcHeap::AllocateFixnum(fst->AsFixnum() * snd->AsFixnum());
 }
 
-Sexp *Builtin_Div(Sexp *fst, Sexp *snd) {
+Value Builtin_Div(Value fst, Value snd) {
   GC_HELPER_FRAME;
   GC_PROTECT(fst);
   GC_PROTECT(snd);
@@ -118,14 +118,14 @@ Sexp *Builtin_Div(Sexp *fst, Sexp *snd) {
     throw JetRuntimeException("type error: not a fixnum");
   }
 
-  if (snd->fixnum_value == 0) {
+  if (snd->AsFixnum() == 0) {
     throw JetRuntimeException("divided by zero");
   }
 
-  return GcHeap::AllocateFixnum(fst->fixnum_value / snd->fixnum_value);
+  return GcHeap::AllocateFixnum(fst->AsFixnum() / snd->AsFixnum());
 }
 
-Sexp *Builtin_Car(Sexp *cons) {
+Value Builtin_Car(Value cons) {
   GC_HELPER_FRAME;
   GC_PROTECT(cons);
 
@@ -136,7 +136,7 @@ Sexp *Builtin_Car(Sexp *cons) {
   return cons->Car();
 }
 
-Sexp *Builtin_Cdr(Sexp *cons) {
+Value Builtin_Cdr(Value cons) {
   GC_HELPER_FRAME;
   GC_PROTECT(cons);
 
@@ -147,7 +147,7 @@ Sexp *Builtin_Cdr(Sexp *cons) {
   return cons->Cdr();
 }
 
-Sexp *Builtin_Cons(Sexp *fst, Sexp *snd) {
+Value Builtin_Cons(Value fst, Value snd) {
   GC_HELPER_FRAME;
   GC_PROTECT(fst);
   GC_PROTECT(snd);
@@ -155,9 +155,9 @@ Sexp *Builtin_Cons(Sexp *fst, Sexp *snd) {
   return GcHeap::AllocateCons(fst, snd);
 }
 
-Sexp *Builtin_Read() { return Read(std::cin); }
+Value Builtin_Read() { return Read(std::cin); }
 
-Sexp *Builtin_Eval(Sexp *form) {
+Value Builtin_Eval(Value form) {
   GC_HELPER_FRAME;
   GC_PROTECT(form);
   GC_PROTECTED_LOCAL(analyzed);
@@ -172,16 +172,16 @@ Sexp *Builtin_Eval(Sexp *form) {
 
   // this creates a new child activation. Not sure if that's
   // right, but it works.
-  act = GcHeap::AllocateActivation(g_global_activation);
+  act = GcHeap::AllocateActivation(g_global_activation, 0);
   return Evaluate(analyzed, act);
 }
 
-Sexp *Builtin_Print(Sexp *form) {
+Value Builtin_Print(Value form) {
   CONTRACT { FORBID_GC; }
 
   // print strings without quotes.
   if (form->IsString()) {
-    std::cout << form->string_value;
+    std::cout << form->AsObject()->string.chars;
   } else {
     form->Dump(std::cout);
   }
@@ -190,12 +190,12 @@ Sexp *Builtin_Print(Sexp *form) {
   return GcHeap::AllocateEmpty();
 }
 
-Sexp *Builtin_Println(Sexp *form) {
+Value Builtin_Println(Value form) {
   CONTRACT { FORBID_GC; }
 
   // print strings without quotes.
   if (form->IsString()) {
-    std::cout << form->string_value;
+    std::cout << form->AsObject()->string.chars;
   } else {
     form->Dump(std::cout);
   }
@@ -204,45 +204,45 @@ Sexp *Builtin_Println(Sexp *form) {
   return GcHeap::AllocateEmpty();
 }
 
-Sexp *Builtin_Error(Sexp *form) {
+Value Builtin_Error(Value form) {
   CONTRACT { FORBID_GC; }
 
   if (!form->IsString()) {
     throw JetRuntimeException("error called with non-string value");
   }
 
-  throw JetRuntimeException(form->string_value);
+  throw JetRuntimeException(form->AsObject()->string.chars);
 }
 
-Sexp *Builtin_EofObject_P(Sexp *form) {
+Value Builtin_EofObject_P(Value form) {
   GC_HELPER_FRAME;
   GC_PROTECT(form);
 
   return GcHeap::AllocateBool(form->IsEof());
 }
 
-Sexp *Builtin_EmptyP(Sexp *form) {
+Value Builtin_EmptyP(Value form) {
   GC_HELPER_FRAME;
   GC_PROTECT(form);
 
   return GcHeap::AllocateBool(form->IsEmpty());
 }
 
-Sexp *Builtin_Not(Sexp *form) {
+Value Builtin_Not(Value form) {
   GC_HELPER_FRAME;
   GC_PROTECT(form);
 
   return GcHeap::AllocateBool(!form->IsTruthy());
 }
 
-Sexp *Builtin_PairP(Sexp *form) {
+Value Builtin_PairP(Value form) {
   GC_HELPER_FRAME;
   GC_PROTECT(form);
 
   return GcHeap::AllocateBool(form->IsCons());
 }
 
-Sexp *Builtin_EqP(Sexp *first, Sexp *second) {
+Value Builtin_EqP(Value first, Value second) {
   GC_HELPER_FRAME;
   GC_PROTECT(first);
   GC_PROTECT(second);
@@ -250,7 +250,7 @@ Sexp *Builtin_EqP(Sexp *first, Sexp *second) {
   return GcHeap::AllocateBool(first == second);
 }
 
-bool EqualityHelper(Sexp *first, Sexp *second) {
+bool EqualityHelper(Value first, Value second) {
   CONTRACT { FORBID_GC; }
 
   if (first->IsCons() && second->IsCons()) {
@@ -260,19 +260,20 @@ bool EqualityHelper(Sexp *first, Sexp *second) {
 
   if (!first->IsCons() && !second->IsCons()) {
     if (first->IsFixnum() && second->IsFixnum()) {
-      return first->fixnum_value == second->fixnum_value;
+      return first->AsFixnum() == second->AsFixnum();
     }
 
     if (first->IsSymbol() && second->IsSymbol()) {
-      return first->symbol_value == second->symbol_value;
+      return first->AsSymbol() == second->AsSymbol();
     }
 
     if (first->IsString() && second->IsString()) {
-      return strcmp(first->string_value, second->string_value) == 0;
+      return strcmp(first->AsObject()->string.chars,
+                    second->AsObject()->string.chars) == 0;
     }
 
     if (first->IsBool() && second->IsBool()) {
-      return first->bool_value == second->bool_value;
+      return first->AsBool() == second->AsBool();
     }
 
     // (eq? first second) implies (equal? first second)
@@ -284,7 +285,7 @@ bool EqualityHelper(Sexp *first, Sexp *second) {
   return false;
 }
 
-Sexp *Builtin_EqualP(Sexp *first, Sexp *second) {
+Value Builtin_EqualP(Value first, Value second) {
   GC_HELPER_FRAME;
   GC_PROTECT(first);
   GC_PROTECT(second);
@@ -292,33 +293,37 @@ Sexp *Builtin_EqualP(Sexp *first, Sexp *second) {
   return GcHeap::AllocateBool(EqualityHelper(first, second));
 }
 
-Sexp *Builtin_SetCar(Sexp *cons, Sexp *car) {
-  CONTRACT { FORBID_GC; }
+Value Builtin_SetCar(Value cons, Value car) {
+  GC_HELPER_FRAME;
+  GC_PROTECT(cons);
 
   if (!cons->IsCons()) {
     throw JetRuntimeException("type error: not a cons");
   }
 
+  car = GcHeap::BoxNumber(car);
   GC_WRITE_BARRIER(cons, car);
-  cons->cons.car = car;
+  cons->AsCons()->car = car;
 
   return GcHeap::AllocateEmpty();
 }
 
-Sexp *Builtin_SetCdr(Sexp *cons, Sexp *cdr) {
-  CONTRACT { FORBID_GC; }
+Value Builtin_SetCdr(Value cons, Value cdr) {
+  GC_HELPER_FRAME;
+  GC_PROTECT(cons);
 
   if (!cons->IsCons()) {
     throw JetRuntimeException("type error: not a cons");
   }
 
+  cdr = GcHeap::BoxNumber(cdr);
   GC_WRITE_BARRIER(cons, cdr);
-  cons->cons.cdr = cdr;
+  cons->AsCons()->cdr = cdr;
 
   return GcHeap::AllocateEmpty();
 }
 
-void LoadBuiltins(Sexp *activation) {
+void LoadBuiltins(Value activation) {
   CONTRACT { PRECONDITION(activation->IsActivation()); }
 
   GC_HELPER_FRAME;
@@ -0,0 +1,315 @@
+// Copyright (c) 2016 Sean Gillespie
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// afurnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#include "bytecode.h"
+#include "contract.h"
+#include "gc.h"
+#include "vm.h"
+
+// The names of the instructions and the number of operands that they take,
+// by opcode.
+static const char *opcode_names[] = {
+#define OPCODE_NAME(name, operands) #name,
+    OPCODES(OPCODE_NAME)
+#undef OPCODE_NAME
+};
+
+static const size_t opcode_operands[] = {
+#define OPCODE_OPERANDS(name, operands) operands,
+    OPCODES(OPCODE_OPERANDS)
+#undef OPCODE_OPERANDS
+};
+
+void Compiler::Push(size_t count) {
+  stack_depth += count;
+  max_stack = std::max(max_stack, stack_depth);
+}
+
+void Compiler::Pop(size_t count) {
+  assert(stack_depth >= count);
+  stack_depth -= count;
+}
+
+void Compiler::Compile(Value meaning, bool tail) {
+  assert(meaning->IsMeaning());
+  meaning->AsObject()->meaning->Compile(*this, tail);
+}
+
+void Compiler::Emit(Opcode op) {
+  switch (op) {
+  case Opcode::Pop:
+  case Opcode::Return:
+    Pop(1);
+    break;
+  default:
+    UNREACHABLE();
+  }
+
+  Emit(static_cast<uint32_t>(op));
+}
+
+void Compiler::Emit(Opcode op, uint32_t operand) {
+  switch (op) {
+  case Opcode::Constant:
+  case Opcode::LoadLocal:
+  case Opcode::LoadArgument:
+  case Opcode::LoadGlobal:
+  case Opcode::Closure:
+    Push(1);
+    break;
+  case Opcode::StoreLocal:
+  case Opcode::StoreArgument:
+  case Opcode::StoreGlobal:
+  case Opcode::Jump:
+    break;
+  case Opcode::JumpIfFalse:
+  case Opcode::JumpIfTrue:
+    Pop(1);
+    break;
+  case Opcode::Call:
+    // the function and its arguments are replaced by the result.
+    Pop(operand);
+    break;
+  case Opcode::TailCall:
+    Pop(operand + 1);
+    break;
+  default:
+    UNREACHABLE();
+  }
+
+  Emit(static_cast<uint32_t>(op));
+  Emit(operand);
+}
+
+void Compiler::Emit(Opcode op, uint32_t first, uint32_t second) {
+  switch (op) {
+  case Opcode::LoadFree:
+  case Opcode::LoadCaptured:
+    Push(1);
+    break;
+  case Opcode::StoreFree:
+  case Opcode::StoreCaptured:
+    break;
+  default:
+    UNREACHABLE();
+  }
+
+  Emit(static_cast<uint32_t>(op));
+  Emit(first);
+  Emit(second);
+}
+
+// Without an activation of its own, the activation that a function
+// closes over is the first one up.
+void Compiler::EmitLoad(size_t up_index, size_t right_index) {
+  if (up_index == depth) {
+    Emit(Opcode::LoadGlobal, (uint32_t)right_index);
+  } else if (arguments_on_stack && up_index == 0) {
+    Emit(Opcode::LoadArgument, (uint32_t)right_index);
+  } else if (arguments_on_stack) {
+    Emit(Opcode::LoadCaptured, (uint32_t)(up_index - 1),
+         (uint32_t)right_index);
+  } else if (up_index == 0) {
+    Emit(Opcode::LoadLocal, (uint32_t)right_index);
+  } else {
+    Emit(Opcode::LoadFree, (uint32_t)up_index, (uint32_t)right_index);
+  }
+}
+
+void Compiler::EmitStore(size_t up_index, size_t right_index) {
+  if (up_index == depth) {
+    Emit(Opcode::StoreGlobal, (uint32_t)right_index);
+  } else if (arguments_on_stack && up_index == 0) {
+    Emit(Opcode::StoreArgument, (uint32_t)right_index);
+  } else if (arguments_on_stack) {
+    Emit(Opcode::StoreCaptured, (uint32_t)(up_index - 1),
+         (uint32_t)right_index);
+  } else if (up_index == 0) {
+    Emit(Opcode::StoreLocal, (uint32_t)right_index);
+  } else {
+    Emit(Opcode::StoreFree, (uint32_t)up_index, (uint32_t)right_index);
+  }
+}
+
+size_t Compiler::EmitJump(Opcode op) {
+  Emit(op, 0);
+  return code.size() - 1;
+}
+
+void Compiler::PatchJump(size_t operand) {
+  // jumps are relative to the end of the jump instruction.
+  code[operand] = (uint32_t)(code.size() - (operand + 1));
+}
+
+uint32_t Compiler::AddConstant(Value value) {
+  constants.push_back(value);
+  return (uint32_t)(constants.size() - 1);
+}
+
+Value Compiler::Finish() {
+  GC_HELPER_FRAME;
+
+  // see AnalyzeAtom for why the constants are protected, even though
+  // allocating a meaning can't trigger a GC.
+  BytecodeMeaning *meaning = new BytecodeMeaning(
+      std::move(code), std::move(constants), max_stack, arguments_on_stack);
+  GC_PROTECT_VECTOR(meaning->ConstantVector());
+  Value cell = GcHeap::AllocateMeaning(meaning);
+  meaning->SetCell(cell);
+  return cell;
+}
+
+Value Compile(Value meaning, size_t depth) {
+  CONTRACT { FORBID_GC; }
+
+  // top-level forms are always run with an activation.
+  Compiler compiler(depth, false, 2);
+  compiler.Compile(meaning, true);
+  return compiler.Finish();
+}
+
+void QuotedMeaning::Compile(Compiler &compiler, bool tail) {
+  compiler.Emit(Opcode::Constant, compiler.AddConstant(quoted));
+  compiler.EmitReturnIfTail(tail);
+}
+
+void ReferenceMeaning::Compile(Compiler &compiler, bool tail) {
+  compiler.EmitLoad(up_index, right_index);
+  compiler.EmitReturnIfTail(tail);
+}
+
+void DefinitionMeaning::Compile(Compiler &compiler, bool tail) {
+  compiler.Compile(binding_value, false);
+  compiler.EmitStore(up_index, right_index);
+  compiler.EmitReturnIfTail(tail);
+}
+
+void SetMeaning::Compile(Compiler &compiler, bool tail) {
+  compiler.Compile(binding_value, false);
+  compiler.EmitStore(up_index, right_index);
+  compiler.EmitReturnIfTail(tail);
+}
+
+void ConditionalMeaning::Compile(Compiler &compiler, bool tail) {
+  compiler.Compile(condition, false);
+  size_t to_false = compiler.EmitJump(Opcode::JumpIfFalse);
+  size_t depth = compiler.StackDepth();
+  compiler.Compile(true_branch, tail);
+  size_t to_end = 0;
+  if (!tail) {
+    // a branch in tail position has returned by the time it's done.
+    to_end = compiler.EmitJump(Opcode::Jump);
+  }
+
+  compiler.PatchJump(to_false);
+  compiler.SetStackDepth(depth);
+  compiler.Compile(false_branch, tail);
+  if (!tail) {
+    compiler.PatchJump(to_end);
+  }
+}
+
+void SequenceMeaning::Compile(Compiler &compiler, bool tail) {
+  for (Value entry : body) {
+    compiler.Compile(entry, false);
+    compiler.Emit(Opcode::Pop);
+  }
+
+  compiler.Compile(final_form, tail);
+}
+
+void LambdaMeaning::Compile(Compiler &compiler, bool tail) {
+  // the body runs in a scope of its own, so its globals are one level
+  // further up. If there are no scopes inside of it, its arguments are
+  // left on the stack, after the function.
+  bool on_stack = !has_inner_scopes;
+  Compiler body_compiler(compiler.Depth() + 1, on_stack,
+                         on_stack ? slot_count + 1 : 2);
+  body_compiler.Compile(body, true);
+  code = body_compiler.Finish();
+
+  compiler.Emit(Opcode::Closure, compiler.AddConstant(cell));
+  compiler.EmitReturnIfTail(tail);
+}
+
+void InvocationMeaning::Compile(Compiler &compiler, bool tail) {
+  compiler.Compile(base, false);
+  for (Value argument : arguments) {
+    compiler.Compile(argument, false);
+  }
+
+  uint32_t count = (uint32_t)arguments.size();
+  compiler.Emit(tail ? Opcode::TailCall : Opcode::Call, count);
+}
+
+// Compiles an `and` or an `or`, which stop at the first argument that is
+// false or true, respectively. Their value is always a bool.
+static void CompileShortCircuit(Compiler &compiler,
+                                const std::vector<Value> &arguments,
+                                bool stop_on, bool tail) {
+  Opcode jump = stop_on ? Opcode::JumpIfTrue : Opcode::JumpIfFalse;
+  std::vector<size_t> to_stop;
+  for (Value argument : arguments) {
+    compiler.Compile(argument, false);
+    to_stop.push_back(compiler.EmitJump(jump));
+  }
+
+  size_t depth = compiler.StackDepth();
+  compiler.Emit(Opcode::Constant,
+                compiler.AddConstant(GcHeap::AllocateBool(!stop_on)));
+  size_t to_end = compiler.EmitJump(Opcode::Jump);
+  for (size_t operand : to_stop) {
+    compiler.PatchJump(operand);
+  }
+
+  compiler.SetStackDepth(depth);
+  compiler.Emit(Opcode::Constant,
+                compiler.AddConstant(GcHeap::AllocateBool(stop_on)));
+  compiler.PatchJump(to_end);
+  compiler.EmitReturnIfTail(tail);
+}
+
+void AndMeaning::Compile(Compiler &compiler, bool tail) {
+  CompileShortCircuit(compiler, arguments, false, tail);
+}
+
+void OrMeaning::Compile(Compiler &compiler, bool tail) {
+  CompileShortCircuit(compiler, arguments, true, tail);
+}
+
+Trampoline BytecodeMeaning::Eval(Value act) {
+  return Trampoline(Execute(cell, act));
+}
+
+void BytecodeMeaning::Dump(std::ostream &out) {
+  out << "(meaning-bytecode";
+  size_t pc = 0;
+  while (pc < code.size()) {
+    uint32_t op = code[pc++];
+    out << " (" << opcode_names[op];
+    for (size_t i = 0; i < opcode_operands[op]; i++) {
+      out << " " << code[pc++];
+    }
+
+    out << ")";
+  }
+
+  out << ")";
+}
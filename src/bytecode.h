@@ -0,0 +1,205 @@
+// Copyright (c) 2016 Sean Gillespie
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// afurnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Meanings are compiled to a compact bytecode, which is run by the VM in
+// vm.h instead of walking the meanings themselves. Every top-level form,
+// and the body of every lambda, is compiled on its own, right after it's
+// analyzed, and its bytecode belongs to the same compilation unit as its
+// meanings.
+#pragma once
+
+#include "meaning.h"
+#include <cstdint>
+#include <vector>
+
+// The instructions of the bytecode, along with the number of operands
+// that each one takes. Every instruction and operand is one word.
+//
+//   Constant k          pushes constant k.
+//   LoadLocal i         pushes slot i of the current activation.
+//   LoadFree up i       pushes slot i of the activation up levels above
+//                       the current one.
+//   LoadArgument i      pushes argument i of a function whose frame keeps
+//                       its arguments on the stack.
+//   LoadCaptured up i   pushes slot i of the activation up levels above
+//                       the one that such a function closes over.
+//   LoadGlobal i        pushes global i.
+//   StoreLocal i,       stores the value on top of the stack into the
+//   StoreFree up i,     given variable, and replaces it with the empty
+//   StoreArgument i,    list, which is the value of a set! or a define.
+//   StoreCaptured up i,
+//   StoreGlobal i
+//   Pop                 pops the top of the stack.
+//   Jump n              skips the next n words.
+//   JumpIfFalse n,      pops the top of the stack, and skips the next n
+//   JumpIfTrue n        words if it's false (or true).
+//   Closure k           pushes a function made from the lambda in
+//                       constant k and the current activation.
+//   Call n              calls the function below the top n values, with
+//                       those as its arguments, and replaces all of them
+//                       with the result.
+//   TailCall n          does the same, but the called function returns
+//                       to the caller of the current one.
+//   Return              returns the value on top of the stack.
+#define OPCODES(V)                                                             \
+  V(Constant, 1)                                                               \
+  V(LoadLocal, 1)                                                              \
+  V(LoadFree, 2)                                                               \
+  V(LoadArgument, 1)                                                           \
+  V(LoadCaptured, 2)                                                           \
+  V(LoadGlobal, 1)                                                             \
+  V(StoreLocal, 1)                                                             \
+  V(StoreFree, 2)                                                              \
+  V(StoreArgument, 1)                                                          \
+  V(StoreCaptured, 2)                                                          \
+  V(StoreGlobal, 1)                                                            \
+  V(Pop, 0)                                                                    \
+  V(Jump, 1)                                                                   \
+  V(JumpIfFalse, 1)                                                            \
+  V(JumpIfTrue, 1)                                                             \
+  V(Closure, 1)                                                                \
+  V(Call, 1)                                                                   \
+  V(TailCall, 1)                                                               \
+  V(Return, 0)
+
+enum class Opcode : uint32_t {
+#define DEFINE_OPCODE(name, operands) name,
+  OPCODES(DEFINE_OPCODE)
+#undef DEFINE_OPCODE
+};
+
+// A BytecodeMeaning is the compiled form of a top-level form or of the
+// body of a lambda. Evaluating it runs its bytecode on the VM.
+//
+// Every frame starts with the function that is running (or, for a top-level
+// form, the MEANING cell of its bytecode), followed by its activation. Nothing
+// can capture the activation of a lambda that has no scopes nested inside of
+// it, though, so the frames of those keep their arguments on the stack in
+// place of one, right where the caller pushed them.
+class BytecodeMeaning : public Meaning {
+private:
+  std::vector<uint32_t> code;
+  // The values that Constant and Closure instructions refer to.
+  std::vector<Value> constants;
+  // The most values that a frame running the bytecode has on the stack at
+  // once, including the ones that it starts with.
+  size_t max_stack;
+  // Whether the frames that run the bytecode keep their arguments on the
+  // stack, instead of in an activation.
+  bool arguments_on_stack;
+  // The MEANING cell that holds this meaning.
+  Value cell;
+
+public:
+  BytecodeMeaning(std::vector<uint32_t> code, std::vector<Value> constants,
+                  size_t max_stack, bool arguments_on_stack)
+      : code(std::move(code)), constants(std::move(constants)),
+        max_stack(max_stack), arguments_on_stack(arguments_on_stack),
+        cell(nullptr) {}
+
+  Trampoline Eval(Value act) override;
+  MeaningPointers Pointers() override { return {{}, 0, &constants}; }
+  void Dump(std::ostream &out) override;
+
+  const uint32_t *Code() const { return code.data(); }
+  const Value *Constants() const { return constants.data(); }
+  std::vector<Value> &ConstantVector() { return constants; }
+  size_t MaxStack() const { return max_stack; }
+  bool ArgumentsOnStack() const { return arguments_on_stack; }
+  Value Cell() const { return cell; }
+  void SetCell(Value meaning_cell) { cell = meaning_cell; }
+};
+
+// A Compiler builds the bytecode for a single BytecodeMeaning, out of the
+// meanings that are compiled into it. Nothing that it does can trigger a
+// GC, since the code space never does.
+class Compiler {
+private:
+  std::vector<uint32_t> code;
+  std::vector<Value> constants;
+  // The number of scopes between the code being compiled and the global
+  // scope. A variable that is this many levels up is a global.
+  size_t depth;
+  bool arguments_on_stack;
+  size_t stack_depth;
+  size_t max_stack;
+
+  void Emit(uint32_t word) { code.push_back(word); }
+  void Push(size_t count);
+  void Pop(size_t count);
+
+public:
+  // Creates a compiler for code whose frames start with frame_size values,
+  // which are its arguments after the function if arguments_on_stack is set.
+  Compiler(size_t depth, bool arguments_on_stack, size_t frame_size)
+      : depth(depth), arguments_on_stack(arguments_on_stack),
+        stack_depth(frame_size), max_stack(frame_size) {}
+
+  Compiler(const Compiler &) = delete;
+  Compiler &operator=(const Compiler &) = delete;
+
+  // Compiles the meaning held by the given MEANING cell.
+  void Compile(Value meaning, bool tail);
+
+  // Emits an instruction, keeping track of how deep the stack gets.
+  void Emit(Opcode op);
+  void Emit(Opcode op, uint32_t operand);
+  void Emit(Opcode op, uint32_t first, uint32_t second);
+
+  // Emits the instructions that load and store the variable at the given
+  // coordinates.
+  void EmitLoad(size_t up_index, size_t right_index);
+  void EmitStore(size_t up_index, size_t right_index);
+
+  // Emits a Return if the code that was just emitted is in tail position.
+  void EmitReturnIfTail(bool tail) {
+    if (tail) {
+      Emit(Opcode::Return);
+    }
+  }
+
+  // Emits a jump whose target isn't known yet, returning the location
+  // of its operand. PatchJump makes it jump to the next instruction that
+  // is emitted.
+  size_t EmitJump(Opcode op);
+  void PatchJump(size_t operand);
+
+  // Adds a value to the constants, returning its index.
+  uint32_t AddConstant(Value value);
+
+  // The number of values on the stack at this point of the code. Code
+  // that can be reached from more than one place resets it to what it
+  // is on every path there.
+  size_t StackDepth() const { return stack_depth; }
+  void SetStackDepth(size_t depth) { stack_depth = depth; }
+
+  size_t Depth() const { return depth; }
+
+  // Allocates the BytecodeMeaning for the code that has been compiled,
+  // returning its MEANING cell.
+  Value Finish();
+};
+
+// Compiles the result of an analysis into bytecode, returning the MEANING
+// cell of the BytecodeMeaning that runs it. depth is the number of scopes
+// that it was analyzed in, beyond the global scope. This has to be done
+// in the compilation unit that the meaning belongs to.
+Value Compile(Value meaning, size_t depth);
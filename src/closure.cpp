@@ -0,0 +1,431 @@
+// Copyright (c) 2016 Sean Gillespie
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// afurnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#include "closure.h"
+#include "contract.h"
+#include "gc.h"
+
+// The argument count of an invocation closure that works for any number
+// of arguments, instead of being specialized for one.
+static const size_t any_arity = (size_t)-1;
+
+// The most arguments that an invocation closure is specialized for.
+static const size_t max_specialized_arity = 3;
+
+// The closures of the different kinds of meanings. Closures that hold a
+// variable number of children keep them inline, after the closure itself.
+
+struct ConstantClosure : Closure {
+  // the field of the QuotedMeaning that holds the constant, which the GC
+  // keeps up to date.
+  const Value *quoted;
+};
+
+struct VariableClosure : Closure {
+  size_t up_index;
+  size_t right_index;
+};
+
+struct StoreClosure : Closure {
+  const Closure *value;
+  size_t up_index;
+  size_t right_index;
+};
+
+struct ConditionalClosure : Closure {
+  const Closure *condition;
+  const Closure *true_branch;
+  const Closure *false_branch;
+};
+
+struct SequenceClosure : Closure {
+  size_t count;
+  const Closure *final_form;
+
+  const Closure *const *Body() const {
+    return reinterpret_cast<const Closure *const *>(this + 1);
+  }
+};
+
+struct LambdaClosure : Closure {
+  Value cell;
+};
+
+struct InvocationClosure : Closure {
+  const Closure *base;
+  size_t count;
+
+  const Closure *const *Arguments() const {
+    return reinterpret_cast<const Closure *const *>(this + 1);
+  }
+};
+
+struct ShortCircuitClosure : Closure {
+  size_t count;
+
+  const Closure *const *Arguments() const {
+    return reinterpret_cast<const Closure *const *>(this + 1);
+  }
+};
+
+[[noreturn]] static void UninitializedRead() {
+  throw JetRuntimeException("invalid read of uninitialized variable. Run "
+                            "with --warnings for more details.");
+}
+
+static Trampoline RunConstant(const Closure *closure, Value act) {
+  CONTRACT { FORBID_GC; }
+
+  UNUSED_PARAMETER(act);
+  auto self = static_cast<const ConstantClosure *>(closure);
+  return Trampoline(GC_READ_BARRIER(*self->quoted));
+}
+
+static Trampoline RunLocalReference(const Closure *closure, Value act) {
+  CONTRACT { FORBID_GC; }
+
+  auto self = static_cast<const VariableClosure *>(closure);
+  Value value = act->AsObject()->activation.GetLocal(self->right_index);
+  if (value == nullptr) {
+    UninitializedRead();
+  }
+
+  return Trampoline(value);
+}
+
+static Trampoline RunReference(const Closure *closure, Value act) {
+  CONTRACT { FORBID_GC; }
+
+  auto self = static_cast<const VariableClosure *>(closure);
+  return Trampoline(
+      act->AsObject()->activation.Get(self->up_index, self->right_index));
+}
+
+// Globals are found in the global activation directly, instead of by
+// walking up to it.
+static Trampoline RunGlobalReference(const Closure *closure, Value act) {
+  CONTRACT { FORBID_GC; }
+
+  UNUSED_PARAMETER(act);
+  auto self = static_cast<const VariableClosure *>(closure);
+  return Trampoline(
+      g_global_activation->AsObject()->activation.Get(0, self->right_index));
+}
+
+// Definitions and set!s store their value the same way.
+static Trampoline RunStore(const Closure *closure, Value act) {
+  GC_HELPER_FRAME;
+  GC_PROTECT(act);
+  GC_PROTECTED_LOCAL(value);
+
+  auto self = static_cast<const StoreClosure *>(closure);
+  value = RunClosure(self->value, act);
+  Activation::Set(act, self->up_index, self->right_index, value);
+  return Trampoline(GcHeap::AllocateEmpty());
+}
+
+static Trampoline RunConditional(const Closure *closure, Value act) {
+  GC_HELPER_FRAME;
+  GC_PROTECT(act);
+
+  auto self = static_cast<const ConditionalClosure *>(closure);
+  Value cond = RunClosure(self->condition, act);
+  if (cond->IsTruthy()) {
+    return Trampoline(act, self->true_branch, nullptr);
+  } else {
+    return Trampoline(act, self->false_branch, nullptr);
+  }
+}
+
+static Trampoline RunSequence(const Closure *closure, Value act) {
+  GC_HELPER_FRAME;
+  GC_PROTECT(act);
+
+  auto self = static_cast<const SequenceClosure *>(closure);
+  const Closure *const *body = self->Body();
+  for (size_t i = 0; i < self->count; i++) {
+    RunClosure(body[i], act);
+  }
+
+  return Trampoline(act, self->final_form, nullptr);
+}
+
+static Trampoline RunLambda(const Closure *closure, Value act) {
+  auto self = static_cast<const LambdaClosure *>(closure);
+  return GcHeap::AllocateFunction(self->cell, act);
+}
+
+// Calls a function with the arguments that an invocation closure holds.
+// Arity is the number of arguments, if the closure is specialized for it,
+// which lets the compiler unroll the loops over them.
+template <size_t Arity>
+static Trampoline RunInvocation(const Closure *closure, Value act) {
+  GC_HELPER_FRAME;
+  GC_PROTECT(act);
+  GC_PROTECTED_LOCAL(child_act);
+  GC_PROTECTED_LOCAL(called_expr);
+  GC_PROTECTED_LOCAL(eval_arg);
+
+  auto self = static_cast<const InvocationClosure *>(closure);
+  const Closure *const *arguments = self->Arguments();
+  size_t count = Arity == any_arity ? self->count : Arity;
+  called_expr = RunClosure(self->base, act);
+  if (called_expr->IsFunction() || called_expr->IsMacro()) {
+    // the lambda meaning itself isn't on the heap, so it's safe to hold
+    // on to across a GC. called_expr keeps its compilation unit alive.
+    LambdaMeaning *lambda = called_expr->AsObject()->function.Lambda();
+    size_t arity = lambda->Arity();
+    if (lambda->IsVariadic() ? count < arity : count != arity) {
+      throw JetRuntimeException("arity mismatch");
+    }
+
+    child_act = GcHeap::AllocateActivation(
+        GC_READ_BARRIER(called_expr->AsObject()->function.activation),
+        lambda->SlotCount());
+    size_t i = 0;
+    for (; i < arity; i++) {
+      eval_arg = RunClosure(arguments[i], act);
+      Activation::Set(child_act, 0, i, eval_arg);
+    }
+
+    if (lambda->IsVariadic()) {
+      // the rest arguments go in a list in the last slot, which is empty
+      // if there aren't any.
+      GC_PROTECTED_LOCAL_VECTOR(rest_args);
+      for (; i < count; i++) {
+        eval_arg = RunClosure(arguments[i], act);
+        rest_args.push_back(eval_arg);
+      }
+
+      eval_arg = GcHeap::AllocateList(rest_args);
+      Activation::Set(child_act, 0, arity, eval_arg);
+    }
+
+    // tail call the function. The thunk holds on to the function's
+    // meaning, since nothing else might keep its body alive.
+    return Trampoline(
+        child_act, lambda->BodyClosure(),
+        GC_READ_BARRIER(called_expr->AsObject()->function.func_meaning));
+  }
+
+  if (!called_expr->IsNativeFunction()) {
+    throw JetRuntimeException("called a non-callable value");
+  }
+
+  if (count != called_expr->AsObject()->native_function.arity) {
+    throw JetRuntimeException("arity mismatch");
+  }
+
+  GC_PROTECTED_LOCAL(ret);
+  if (Arity != any_arity) {
+    // a call with a known number of arguments passes them in an array
+    // on the native stack instead of in a vector.
+    Value args[Arity == any_arity || Arity == 0 ? 1 : Arity];
+    for (size_t i = 0; i < count; i++) {
+      args[i] = nullptr;
+      GC_PROTECT(args[i]);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+      args[i] = RunClosure(arguments[i], act);
+    }
+
+    ret = (*called_expr->AsObject()->native_function.func)(args);
+    return Trampoline(ret);
+  }
+
+  GC_PROTECTED_LOCAL_VECTOR(args);
+  for (size_t i = 0; i < count; i++) {
+    eval_arg = RunClosure(arguments[i], act);
+    args.push_back(eval_arg);
+  }
+
+  ret = (*called_expr->AsObject()->native_function.func)(args.data());
+  return Trampoline(ret);
+}
+
+// Runs an `and` or an `or`, which stop at the first argument that is
+// false or true, respectively.
+template <bool StopOn>
+static Trampoline RunShortCircuit(const Closure *closure, Value act) {
+  GC_HELPER_FRAME;
+  GC_PROTECT(act);
+
+  auto self = static_cast<const ShortCircuitClosure *>(closure);
+  const Closure *const *arguments = self->Arguments();
+  for (size_t i = 0; i < self->count; i++) {
+    if (RunClosure(arguments[i], act)->IsTruthy() == StopOn) {
+      return GcHeap::AllocateBool(StopOn);
+    }
+  }
+
+  return GcHeap::AllocateBool(!StopOn);
+}
+
+Value RunThunks(Trampoline thunk) {
+  GC_HELPER_FRAME;
+
+  Trampoline result = thunk;
+  // the activation and value fields have the same memory location, just
+  // like in Evaluate.
+  GC_PROTECT(result.value);
+  GC_PROTECT(result.meaning);
+
+  while (result.IsThunk()) {
+    assert(result.activation->IsActivation());
+    assert(result.closure != nullptr);
+    Value meaning = result.meaning;
+    result = result.closure->Run(result.activation);
+    if (result.IsThunk() && result.meaning == nullptr) {
+      result.meaning = meaning;
+    }
+  }
+
+  return result.value;
+}
+
+const Closure *ClosureCompiler::Compile(Value meaning) {
+  assert(meaning->IsMeaning());
+  return meaning->AsObject()->meaning->CompileClosure(*this);
+}
+
+Value CompileClosures(Value meaning, size_t depth) {
+  CONTRACT { FORBID_GC; }
+
+  ClosureCompiler compiler(depth);
+  const Closure *root = compiler.Compile(meaning);
+  return GcHeap::AllocateMeaning(new ClosureMeaning(root));
+}
+
+const Closure *QuotedMeaning::CompileClosure(ClosureCompiler &compiler) {
+  auto closure = compiler.Allocate<ConstantClosure>(RunConstant);
+  closure->quoted = &quoted;
+  return closure;
+}
+
+const Closure *ReferenceMeaning::CompileClosure(ClosureCompiler &compiler) {
+  auto closure = compiler.Allocate<VariableClosure>(RunReference);
+  closure->up_index = up_index;
+  closure->right_index = right_index;
+  if (up_index == compiler.Depth()) {
+    closure->func = RunGlobalReference;
+  } else if (up_index == 0) {
+    closure->func = RunLocalReference;
+  }
+
+  return closure;
+}
+
+const Closure *DefinitionMeaning::CompileClosure(ClosureCompiler &compiler) {
+  auto closure = compiler.Allocate<StoreClosure>(RunStore);
+  closure->value = compiler.Compile(binding_value);
+  closure->up_index = up_index;
+  closure->right_index = right_index;
+  return closure;
+}
+
+const Closure *SetMeaning::CompileClosure(ClosureCompiler &compiler) {
+  auto closure = compiler.Allocate<StoreClosure>(RunStore);
+  closure->value = compiler.Compile(binding_value);
+  closure->up_index = up_index;
+  closure->right_index = right_index;
+  return closure;
+}
+
+const Closure *ConditionalMeaning::CompileClosure(ClosureCompiler &compiler) {
+  auto closure = compiler.Allocate<ConditionalClosure>(RunConditional);
+  closure->condition = compiler.Compile(condition);
+  closure->true_branch = compiler.Compile(true_branch);
+  closure->false_branch = compiler.Compile(false_branch);
+  return closure;
+}
+
+const Closure *SequenceMeaning::CompileClosure(ClosureCompiler &compiler) {
+  auto closure = compiler.Allocate<SequenceClosure>(RunSequence, body.size());
+  closure->count = body.size();
+  auto entries = const_cast<const Closure **>(closure->Body());
+  for (size_t i = 0; i < body.size(); i++) {
+    entries[i] = compiler.Compile(body[i]);
+  }
+
+  closure->final_form = compiler.Compile(final_form);
+  return closure;
+}
+
+const Closure *LambdaMeaning::CompileClosure(ClosureCompiler &compiler) {
+  // the body runs in a scope of its own, so its globals are one level
+  // further up.
+  ClosureCompiler body_compiler(compiler.Depth() + 1);
+  body_closure = body_compiler.Compile(body);
+
+  auto closure = compiler.Allocate<LambdaClosure>(RunLambda);
+  closure->cell = cell;
+  return closure;
+}
+
+const Closure *InvocationMeaning::CompileClosure(ClosureCompiler &compiler) {
+  static Trampoline (*const specialized[])(const Closure *, Value) = {
+      RunInvocation<0>, RunInvocation<1>, RunInvocation<2>, RunInvocation<3>};
+  static_assert(sizeof(specialized) / sizeof(specialized[0]) ==
+                    max_specialized_arity + 1,
+                "every specialized arity needs an entry");
+
+  size_t count = arguments.size();
+  auto closure = compiler.Allocate<InvocationClosure>(
+      count <= max_specialized_arity ? specialized[count]
+                                     : RunInvocation<any_arity>,
+      count);
+  closure->base = compiler.Compile(base);
+  closure->count = count;
+  auto entries = const_cast<const Closure **>(closure->Arguments());
+  for (size_t i = 0; i < count; i++) {
+    entries[i] = compiler.Compile(arguments[i]);
+  }
+
+  return closure;
+}
+
+// Compiles the arguments of an `and` or an `or`.
+static const Closure *CompileShortCircuit(ClosureCompiler &compiler,
+                                          const std::vector<Value> &arguments,
+                                          bool stop_on) {
+  auto closure = compiler.Allocate<ShortCircuitClosure>(
+      stop_on ? RunShortCircuit<true> : RunShortCircuit<false>,
+      arguments.size());
+  closure->count = arguments.size();
+  auto entries = const_cast<const Closure **>(closure->Arguments());
+  for (size_t i = 0; i < arguments.size(); i++) {
+    entries[i] = compiler.Compile(arguments[i]);
+  }
+
+  return closure;
+}
+
+const Closure *AndMeaning::CompileClosure(ClosureCompiler &compiler) {
+  return CompileShortCircuit(compiler, arguments, false);
+}
+
+const Closure *OrMeaning::CompileClosure(ClosureCompiler &compiler) {
+  return CompileShortCircuit(compiler, arguments, true);
+}
+
+Trampoline ClosureMeaning::Eval(Value act) {
+  return Trampoline(RunClosure(root, act));
+}
@@ -0,0 +1,115 @@
+// Copyright (c) 2016 Sean Gillespie
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// afurnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Closure compilation is a lighter alternative to the bytecode VM. Right
+// after a form is analyzed, every meaning in it is turned into a closure:
+// a plain C++ function, specialized for the kind of meaning and what is
+// known about it statically (whether a variable is local, free or global,
+// how many arguments a call passes), along with the operands that it needs
+// and direct pointers to the closures of its children. Running one is a
+// single indirect call, instead of loading the meaning out of its MEANING
+// cell and making a virtual call on it. Closures still return Trampolines,
+// so tail calls work the same way they do in the tree walker.
+//
+// Closures aren't managed objects. They're allocated from the arena of the
+// compilation unit that they were compiled from and are freed along with
+// it. Whatever they refer to on the heap is held by their meanings, which
+// the GC already traces.
+#pragma once
+
+#include "gc.h"
+#include "meaning.h"
+#include <new>
+
+// A Closure is the compiled form of a single meaning. The closures for
+// the different kinds of meanings extend this with the operands that
+// their functions read (see closure.cpp).
+struct Closure {
+  Trampoline (*func)(const Closure *self, Value act);
+
+  Trampoline Run(Value act) const { return func(this, act); }
+};
+
+// A ClosureCompiler compiles meanings into closures, in the compilation
+// unit that they belong to. Nothing that it does can trigger a GC.
+class ClosureCompiler {
+private:
+  // The number of scopes between the meanings being compiled and the
+  // global scope. A variable that is this many levels up is a global.
+  size_t depth;
+
+public:
+  ClosureCompiler(size_t depth) : depth(depth) {}
+
+  ClosureCompiler(const ClosureCompiler &) = delete;
+  ClosureCompiler &operator=(const ClosureCompiler &) = delete;
+
+  // Compiles the meaning held by the given MEANING cell.
+  const Closure *Compile(Value meaning);
+
+  // Allocates a closure of the given type, followed by room for extra
+  // pointers to other closures, and points it at the given function.
+  template <typename T>
+  T *Allocate(Trampoline (*func)(const Closure *, Value), size_t extra = 0) {
+    void *storage =
+        GcHeap::AllocateMeaningStorage(sizeof(T) + extra * sizeof(Closure *));
+    T *closure = new (storage) T();
+    closure->func = func;
+    return closure;
+  }
+
+  size_t Depth() const { return depth; }
+};
+
+// A ClosureMeaning is the compiled form of a top-level form. Evaluating it
+// runs its closure.
+class ClosureMeaning : public Meaning {
+private:
+  const Closure *root;
+
+public:
+  ClosureMeaning(const Closure *root) : root(root) {}
+
+  Trampoline Eval(Value act) override;
+
+  void Dump(std::ostream &out) override { out << "(meaning-closure)"; }
+};
+
+// Runs the thunks that a closure returned until one of them produces a
+// value. The thunk's compilation unit has to be alive when this is called.
+Value RunThunks(Trampoline thunk);
+
+// Runs a closure with the given activation, returning its value. Most
+// closures can't tail call, and don't need a loop to run them.
+inline Value RunClosure(const Closure *closure, Value act) {
+  Trampoline result = closure->Run(act);
+  if (result.IsValue()) {
+    return result.value;
+  }
+
+  return RunThunks(result);
+}
+
+// Compiles the result of an analysis into closures, returning the MEANING
+// cell of the ClosureMeaning that runs them. depth is the number of scopes
+// that it was analyzed in, beyond the global scope. This has to be done
+// in the compilation unit that the meaning belongs to.
+Value CompileClosures(Value meaning, size_t depth);
@@ -20,9 +20,19 @@
 // SOFTWARE.
 #include "gc.h"
 #include "contract.h"
+#include "options.h"
+#include "vm.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdarg>
-#include <list>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <mutex>
 #include <stack>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 
@@ -30,6 +40,8 @@
 #include "windows.h"
 #else
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
 #endif
 
 #ifdef DEBUG
@@ -38,12 +50,24 @@
 
 char *g_gc_log[GC_DEBUG_LOG_SIZE];
 size_t g_gc_log_index = 0;
+std::mutex g_gc_log_lock;
 #endif
 
 Frame *g_frames;
 Frame *g_current_frame;
+#ifdef CONSERVATIVE_GC
+uint8_t *g_stack_base;
+#endif
+uintptr_t g_root_stack[GC_ROOT_STACK_SIZE];
+#ifdef DEBUG
+const char *g_root_names[GC_ROOT_STACK_SIZE];
+#endif
+size_t g_root_stack_top;
 GcHeap *g_heap;
-Sexp g_the_empty_sexp;
+HeapPage *g_alloc_pages[Sexp::kind_count];
+uint8_t **g_free_lists[Sexp::kind_count];
+uint8_t *g_condemned_start;
+uint8_t *g_condemned_end;
 
 // Useful for debugging GC issues when
 // you have a repro
@@ -53,6 +77,7 @@ void DebugLog(const char *fmt, ...) {
 #if defined(DEBUG) && !defined(DEBUG_LOG_TO_STDOUT)
   // for troubleshooting GC issues, we maintain a circular buffer
   // of logs that we can inspect in a debugger.
+  std::lock_guard<std::mutex> guard(g_gc_log_lock);
   if (g_gc_log[g_gc_log_index]) {
     // free the existing message before overwriting it.
     delete[] g_gc_log[g_gc_log_index];
@@ -75,25 +100,118 @@ void DebugLog(const char *fmt, ...) {
 #endif
 }
 
+// Calls func on every value on the VM's stack, which holds the activation
+// and code of every frame that the VM is running along with the values
+// that they're working with.
+template <typename F> void ScanVmStack(F func) {
+  DebugLog("scanning %zu values on the VM stack",
+           (size_t)(g_vm_sp - g_vm_stack));
+  for (Value *slot = g_vm_stack; slot < g_vm_sp; slot++) {
+    func(slot);
+  }
+}
+
 template <typename F> void ScanRoots(F func) {
   // the VM maintains a linked list of native frames that may contain managed
   // pointers.
   assert(g_frames != nullptr);
+  size_t end = g_root_stack_top;
   for (Frame *frame = g_current_frame; frame != nullptr;
        frame = frame->GetParent()) {
     DebugLog("scanning roots for frame '%s'", frame->GetName());
-    // each frame in turn maintains a list of rooted pointers.
-    frame->TracePointers([&](std::tuple<const char *, Sexp **> root) {
+    // each frame in turn owns a range of the root stack.
+    auto trace = [&](const char *name, Value *root) {
       // roots may be null, since a GC may occur before a GC reference is
       // assigned to a protected slot. This is normal and OK.
-      DebugLog("  found root: %s (%p)", std::get<0>(root), *std::get<1>(root));
-      if (std::get<1>(root) != nullptr) {
-        func(std::get<1>(root));
+      DebugLog("  found root: %s (%p)", name, (void *)root->Bits());
+      if (root != nullptr) {
+        func(root);
       }
-    });
+    };
+
+    Frame::TraceRoots(frame->GetBase(), end, trace);
+    end = frame->GetBase();
+  }
+
+  ScanVmStack(func);
+}
+
+#ifdef COMPRESSED_REFS
+uint8_t *g_heap_base;
+
+// With compressed references, every space that objects live in is carved
+// out of a single reservation, so that an offset from g_heap_base can
+// reach any object. The reservation is as big as those offsets can reach;
+// only the parts of it that are handed out are accessible, and the OS
+// only backs the parts of those that get used. Cons fields are what can
+// reach the least far (see ConsField).
+const size_t heap_reservation_size = (size_t)1 << 34;
+
+// The parts of the reservation that aren't handed out, by address.
+// Neighbouring ranges are always merged.
+static std::map<uint8_t *, size_t> g_free_ranges;
+
+// Hands out the first part of the reservation that's big enough.
+uint8_t *MapTheHeap(size_t page_number) {
+  if (g_heap_base == nullptr) {
+    void *heap = mmap(nullptr, heap_reservation_size, PROT_NONE,
+                      MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    if (heap == (void *)-1) {
+      std::string msg(strerror(errno));
+      std::string result = "failed to reserve heap: " + msg;
+      PANIC(result.c_str());
+    }
+
+    g_heap_base = (uint8_t *)heap;
+    g_free_ranges[g_heap_base] = heap_reservation_size;
+  }
+
+  size_t size = PAGE_SIZE * page_number;
+  for (auto it = g_free_ranges.begin(); it != g_free_ranges.end(); ++it) {
+    if (it->second < size) {
+      continue;
+    }
+
+    uint8_t *heap = it->first;
+    size_t rest = it->second - size;
+    g_free_ranges.erase(it);
+    if (rest != 0) {
+      g_free_ranges[heap + size] = rest;
+    }
+
+    if (mprotect(heap, size, PROT_READ | PROT_WRITE) != 0) {
+      std::string msg(strerror(errno));
+      std::string result = "failed to allocate heap: " + msg;
+      PANIC(result.c_str());
+    }
+
+    return heap;
   }
+
+  PANIC("failed to allocate heap: the reservation is full");
 }
 
+// Gives part of the reservation back, along with the memory behind it.
+void UnmapTheHeap(uint8_t *heap, size_t size) {
+  mmap(heap, size, PROT_NONE,
+       MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE | MAP_FIXED, -1, 0);
+  auto next = g_free_ranges.lower_bound(heap);
+  if (next != g_free_ranges.end() && heap + size == next->first) {
+    size += next->second;
+    next = g_free_ranges.erase(next);
+  }
+
+  if (next != g_free_ranges.begin()) {
+    auto prev = std::prev(next);
+    if (prev->first + prev->second == heap) {
+      prev->second += size;
+      return;
+    }
+  }
+
+  g_free_ranges[heap] = size;
+}
+#else
 // Maps the heap, calling whatever platform APIs we need to do so.
 // On Unixes, we map the heap using mmap. On Windows, we'll use VirtualAlloc.
 uint8_t *MapTheHeap(size_t page_number) {
@@ -129,316 +247,3969 @@ void UnmapTheHeap(uint8_t *heap, size_t size) {
   VirtualFree(heap, 0, MEM_RELEASE);
 #endif
 }
+#endif
 
-// Jet's GC is a semispace copying collector. It partitions
-// the heap into two distinct regions: the "fromspace" and "tospace".
-// When a GC occurs, the two regions are swapped and all live objects
-// are copied to the new semispace.
-class GcHeap::GcHeapImpl {
-private:
-  // TODO(segilles) perf tweak this number.
-  const size_t number_of_pages = 8;
-  uint8_t *tospace;
-  uint8_t *fromspace;
-  uint8_t *top;
-  uint8_t *free;
-  uint8_t *heap_start;
-  uint8_t *heap_end;
-  std::unordered_map<Sexp *, Sexp *> forwarding_addresses;
-  std::vector<Sexp *> worklist;
-  size_t extent;
-  size_t gc_number;
-  bool stress;
-  bool heap_verify;
-  std::list<Sexp *> finalize_queue;
+// Hands the memory behind part of the heap back to the OS, leaving it
+// mapped. Whatever was there is lost, and it reads as zeroes the next time
+// that it's touched.
+void DecommitTheHeap(uint8_t *heap, size_t size) {
+#ifndef _WIN32
+  madvise(heap, size, MADV_DONTNEED);
+#else
+  VirtualFree(heap, size, MEM_DECOMMIT);
+  VirtualAlloc(heap, size, MEM_COMMIT, PAGE_READWRITE);
+#endif
+}
 
-public:
-  GcHeapImpl() {
-    uint8_t *heap = MapTheHeap(number_of_pages);
-    heap_start = heap;
-    heap_end = heap_start + PAGE_SIZE * number_of_pages;
-    tospace = heap_start;
-    extent = (heap_end - heap_start) / 2;
-    fromspace = heap_start + extent;
-    top = fromspace;
-    free = tospace;
-    stress = false;
-    gc_number = 0;
-    assert(heap_start < heap_end);
+// Asks the OS to back part of the heap with transparent huge pages, where
+// it knows how to.
+void AdviseHugePages(uint8_t *heap, size_t size) {
+#if !defined(_WIN32) && defined(MADV_HUGEPAGE)
+  madvise(heap, size, MADV_HUGEPAGE);
+#else
+  UNUSED_PARAMETER(heap);
+  UNUSED_PARAMETER(size);
+#endif
+}
+
+// Returns the resident set size of the process, in kilobytes, or zero if
+// it can't be found.
+static size_t CurrentRss() {
+#ifdef __linux__
+  std::ifstream statm("/proc/self/statm");
+  size_t total_pages = 0;
+  size_t resident_pages = 0;
+  if (statm >> total_pages >> resident_pages) {
+    return resident_pages * (sysconf(_SC_PAGESIZE) / 1024);
   }
+#endif
+  return 0;
+}
+
+// A work-stealing deque of objects that still need to be scanned, used by
+// the parallel collector. This is the deque described by Chase and Lev in
+// "Dynamic Circular Work-Stealing Deque", using the memory orderings from
+// Le et al., "Correct and Efficient Work-Stealing for Weak Memory Models".
+// The owning thread pushes and pops at the bottom, and other threads steal
+// from the top.
+class WorkStealingDeque {
+private:
+  struct Buffer {
+    int64_t capacity;
+    std::unique_ptr<std::atomic<Value>[]> slots;
 
-  ~GcHeapImpl() { UnmapTheHeap(heap_start, PAGE_SIZE * number_of_pages); }
+    Buffer(int64_t capacity)
+        : capacity(capacity), slots(new std::atomic<Value>[capacity]) {}
 
-  GcHeapImpl(const GcHeapImpl &) = delete;
-  GcHeapImpl &operator=(const GcHeapImpl &) = delete;
+    Value Get(int64_t index) {
+      return slots[index & (capacity - 1)].load(std::memory_order_relaxed);
+    }
 
-  // Allocates an s-expression from the heap, triggering a garbage collection if
-  // necessary.
-  Sexp *Allocate(bool should_finalize) {
-    // on a debug build, this triggers a stackwalk which will assert if
-    // any of the calling functions has a FORBID_GC contract.
-    CONTRACT_VIOLATIONS { PERFORMS_GC; }
+    void Put(int64_t index, Value value) {
+      slots[index & (capacity - 1)].store(value, std::memory_order_relaxed);
+    }
+  };
 
-    uint8_t *result = free;
-    uint8_t *bump = result + sizeof(Sexp);
-    if (bump > top
-#ifdef DEBUG
-        || stress
-#endif
-        ) {
-      DebugLog("bump pointer alloc failed, triggering a GC");
-      // we've filled up our fromspace - need to GC.
-      Collect();
+  std::atomic<int64_t> top;
+  std::atomic<int64_t> bottom;
+  std::atomic<Buffer *> buffer;
+  // buffers that have been outgrown can still be read by a thief, so they
+  // are kept around for the lifetime of the deque.
+  std::vector<std::unique_ptr<Buffer>> buffers;
+
+public:
+  WorkStealingDeque() : top(0), bottom(0) {
+    buffers.emplace_back(new Buffer(1024));
+    buffer.store(buffers.back().get(), std::memory_order_relaxed);
+  }
+
+  WorkStealingDeque(const WorkStealingDeque &) = delete;
+  WorkStealingDeque &operator=(const WorkStealingDeque &) = delete;
 
-      // try and allocate again.
-      result = free;
-      bump = result + sizeof(Sexp);
-      if (bump > top) {
-        // we're screwed. OOM.
-        // TODO(segilles) - we should be able to try and expand the
-        // heap here.
-        PANIC("out of memory!");
+  // Pushes an object onto the bottom of the deque. Only the owning thread
+  // can call this.
+  void Push(Value value) {
+    int64_t b = bottom.load(std::memory_order_relaxed);
+    int64_t t = top.load(std::memory_order_acquire);
+    Buffer *buf = buffer.load(std::memory_order_relaxed);
+    if (b - t > buf->capacity - 1) {
+      buffers.emplace_back(new Buffer(buf->capacity * 2));
+      Buffer *grown = buffers.back().get();
+      for (int64_t i = t; i < b; i++) {
+        grown->Put(i, buf->Get(i));
       }
+
+      buffer.store(grown, std::memory_order_release);
+      buf = grown;
     }
 
-    DebugLog("allocated object at %p, new bump at %p", result, bump);
-    free = bump;
+    buf->Put(b, value);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom.store(b + 1, std::memory_order_relaxed);
+  }
+
+  // Pops an object off of the bottom of the deque, returning null if
+  // the deque is empty. Only the owning thread can call this.
+  Value Pop() {
+    int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+    Buffer *buf = buffer.load(std::memory_order_relaxed);
+    bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top.load(std::memory_order_relaxed);
+    if (t > b) {
+      // the deque was empty.
+      bottom.store(b + 1, std::memory_order_relaxed);
+      return nullptr;
+    }
 
-    memset(result, 0x0, sizeof(Sexp));
+    Value value = buf->Get(b);
+    if (t == b) {
+      // this is the last object, so we race with the thieves for it.
+      if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                       std::memory_order_relaxed)) {
+        value = nullptr;
+      }
 
-    // if this s-expression needs to be finalized,
-    // stick it on the queue.
-    if (should_finalize) {
-      DebugLog("marking object %p for finalization", result);
-      finalize_queue.push_back((Sexp *)result);
+      bottom.store(b + 1, std::memory_order_relaxed);
     }
 
-    return (Sexp *)result;
+    return value;
   }
 
-  // Performs a garbage collection.
-  void Collect() {
-#ifdef DEBUG
-    if (heap_verify) {
-      VerifyHeap();
+  // Steals an object from the top of the deque, returning null if the
+  // deque was empty or another thread got to the object first.
+  Value Steal() {
+    int64_t t = top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = bottom.load(std::memory_order_acquire);
+    if (t >= b) {
+      return nullptr;
     }
-#endif
 
-    gc_number++;
-    DebugLog("[%d] beginning a GC", gc_number);
-    assert(forwarding_addresses.empty());
-    assert(worklist.empty());
-    // flip the fromspace and tospace - we're about
-    // to relocate all of our live objects to the new tospace.
-    Flip();
+    Buffer *buf = buffer.load(std::memory_order_acquire);
+    Value value = buf->Get(t);
+    if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                     std::memory_order_relaxed)) {
+      return nullptr;
+    }
 
-    // all roots are known to be live. we'll process those first.
-    DebugLog("[%d] processing roots", gc_number);
-    ScanRoots([&](Sexp **ptr) { Process(ptr); });
+    return value;
+  }
 
-    // we've populated our worklist, now we need to process it.
-    DebugLog("[%d] draining worklist", gc_number);
-    while (!worklist.empty()) {
-      Sexp *ptr = worklist.back();
-      worklist.pop_back();
-      // this pointer has already been relocated - we have to
-      // process its transitive closure now.
-      ptr->TracePointers([&](Sexp **ref) {
-        uint8_t *candidate = (uint8_t *)*ref;
-        if (candidate >= tospace && candidate < top) {
-          // if this pointer points into tospace, that means
-          // we've already relocated it and updated the pointer
-          // in this object. we don't need to process it again.
-          // in fact, we /can't/ process it again, because if we
-          // do, it'll get moved to some other garbage location.
-          return;
-        }
+  bool Empty() const {
+    int64_t t = top.load(std::memory_order_acquire);
+    int64_t b = bottom.load(std::memory_order_acquire);
+    return t >= b;
+  }
+};
 
-        Process(ref);
-      });
-    }
+// A pool of threads that run the parallel collector. The thread that
+// starts a collection does its share of the work as worker zero, so
+// a pool for n workers only has n - 1 threads.
+class GcThreadPool {
+private:
+  std::vector<std::thread> threads;
+  std::mutex lock;
+  std::condition_variable start_cond;
+  std::condition_variable done_cond;
+  std::function<void(size_t)> task;
+  size_t generation;
+  size_t running;
+  bool shutdown;
 
-    DebugLog("[%d] finalizing dead objects", gc_number);
+  void WorkerMain(size_t id) {
+    size_t seen_generation = 0;
+    for (;;) {
+      std::function<void(size_t)> current;
+      {
+        std::unique_lock<std::mutex> guard(lock);
+        start_cond.wait(guard, [&] {
+          return shutdown || generation != seen_generation;
+        });
+        if (shutdown) {
+          return;
+        }
 
-    finalize_queue.remove_if([&](Sexp *ptr) {
-      // check and see if this pointer got relocated. If it
-      // did, it has an entry in the forwarding address table.
-      if (forwarding_addresses.find(ptr) == forwarding_addresses.end()) {
-        // this is correct because, since the object did not relocate,
-        // it's still safe to refer to this object by its fromspace pointer.
-        DebugLog("[%d] finalizing object %p", gc_number, ptr);
-        ptr->Finalize();
-        return true;
+        seen_generation = generation;
+        current = task;
       }
 
-      // if the object did relocate, it's still live.
-      return false;
-    });
+      current(id);
+      std::lock_guard<std::mutex> guard(lock);
+      if (--running == 0) {
+        done_cond.notify_one();
+      }
+    }
+  }
 
-    DebugLog("[%d] updating pointers in finalizer queue", gc_number);
-    // for everything still live in the finalizer queue, we have to
-    // update it to point to its relocated location.
-    for (auto it = finalize_queue.begin(); it != finalize_queue.end();) {
-      Sexp *forward_ptr = forwarding_addresses[*it];
-      assert(forward_ptr != nullptr);
-      DebugLog("[%d] finalizer queue relocation: %p -> %p", gc_number, *it,
-               forward_ptr);
-      it = finalize_queue.erase(it);
-      finalize_queue.insert(it, forward_ptr);
+public:
+  GcThreadPool(size_t workers) : generation(0), running(0), shutdown(false) {
+    assert(workers > 1);
+    for (size_t i = 1; i < workers; i++) {
+      threads.emplace_back([this, i] { WorkerMain(i); });
     }
+  }
 
-    DebugLog("[%d] GC complete", gc_number);
-    // and we're done!
-    forwarding_addresses.clear();
-    worklist.clear();
+  ~GcThreadPool() {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      shutdown = true;
+    }
 
-#ifdef DEBUG
-    if (heap_verify) {
-      VerifyHeap();
+    start_cond.notify_all();
+    for (auto &thread : threads) {
+      thread.join();
     }
-#endif
   }
 
-  // Update a field with a reference to a tospace replica.
-  void Process(Sexp **ptr) {
-    // nothing to do for null pointers.
-    if (ptr == nullptr || *ptr == nullptr) {
-      return;
+  GcThreadPool(const GcThreadPool &) = delete;
+  GcThreadPool &operator=(const GcThreadPool &) = delete;
+
+  size_t Size() const { return threads.size() + 1; }
+
+  // Runs func on every worker, passing it the worker's index, and
+  // returns once all of them are done.
+  void Run(std::function<void(size_t)> func) {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      task = func;
+      running = threads.size();
+      generation++;
     }
 
-    if ((*ptr)->IsEmpty()) {
-      // the empty list is special and isn't managed
-      // by the GC.
-      return;
+    start_cond.notify_all();
+    func(0);
+    std::unique_lock<std::mutex> guard(lock);
+    done_cond.wait(guard, [&] { return running == 0; });
+  }
+};
+
+// A thread that does the work that a collection leaves behind but that
+// the program doesn't have to wait for: running the finalizers of the
+// objects that died, and decommitting the memory that was evacuated, which
+// also leaves it zeroed. The collector waits for it to be done before any
+// of that memory is used again.
+class GcHelperThread {
+private:
+  std::thread thread;
+  std::mutex lock;
+  std::condition_variable work_cond;
+  std::condition_variable done_cond;
+  std::vector<Finalizer> finalizers;
+  std::vector<std::pair<uint8_t *, size_t>> ranges;
+  bool busy;
+  bool shutdown;
+
+  void HelperMain() {
+    for (;;) {
+      std::vector<Finalizer> current_finalizers;
+      std::vector<std::pair<uint8_t *, size_t>> current_ranges;
+      {
+        std::unique_lock<std::mutex> guard(lock);
+        work_cond.wait(guard, [&] {
+          return shutdown || !finalizers.empty() || !ranges.empty();
+        });
+        if (finalizers.empty() && ranges.empty()) {
+          return;
+        }
+
+        current_finalizers.swap(finalizers);
+        current_ranges.swap(ranges);
+        busy = true;
+      }
+
+      for (auto &range : current_ranges) {
+        DecommitTheHeap(range.first, range.second);
+      }
+
+      for (Finalizer &finalizer : current_finalizers) {
+        finalizer.Run();
+      }
+
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        busy = false;
+      }
+
+      done_cond.notify_all();
     }
+  }
 
-    assert((uint8_t *)*ptr >= heap_start && (uint8_t *)*ptr <= heap_end);
-    *ptr = Forward(*ptr);
+public:
+  GcHelperThread() : busy(false), shutdown(false) {
+    thread = std::thread([this] { HelperMain(); });
   }
 
-  // Copies an object from fromspace to tospace, returning
-  // the forwarded pointer to this object.
-  Sexp *Forward(Sexp *ptr) {
-    Sexp *to_ref = forwarding_addresses[ptr];
-    if (to_ref == nullptr) {
-      // this reference hasn't been copied yet. do it.
-      to_ref = Copy(ptr);
+  // Finishes whatever work is still queued up before returning.
+  ~GcHelperThread() {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      shutdown = true;
     }
 
-    // DebugLog("processed value: %s", to_ref->DumpString().c_str());
-    assert(to_ref != nullptr);
-    return to_ref;
+    work_cond.notify_one();
+    thread.join();
   }
 
-  // Copy an object and return its forwarding address.
-  Sexp *Copy(Sexp *from_ref) {
-    Sexp *to_ref = (Sexp *)free;
-    free += sizeof(Sexp);
-    // this copy is guaranteed not to overlap since it
-    // doesn't cross the fromspace/tospace boundary.
-    DebugLog("[%d] relocating: %p -> %p", gc_number, from_ref, to_ref);
-#ifdef DEBUG
-    assert(from_ref->padding != 0xabababababababab &&
-           "relocating an invalid object");
-#endif
-    memcpy(to_ref, from_ref, sizeof(Sexp));
+  GcHelperThread(const GcHelperThread &) = delete;
+  GcHelperThread &operator=(const GcHelperThread &) = delete;
 
-#ifdef DEBUG
-    // use a distinct bit pattern to ensure that
-    // we insta-crash on a GC hole.
-    memset(from_ref, 0xAB, sizeof(Sexp));
-#endif
+  // Queues up finalizers to run and memory to decommit, taking them out
+  // of the given vectors.
+  void Submit(std::vector<Finalizer> &new_finalizers,
+              std::vector<std::pair<uint8_t *, size_t>> &new_ranges) {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      finalizers.insert(finalizers.end(), new_finalizers.begin(),
+                        new_finalizers.end());
+      ranges.insert(ranges.end(), new_ranges.begin(), new_ranges.end());
+    }
 
-    forwarding_addresses[from_ref] = to_ref;
-    worklist.push_back(to_ref);
-    return to_ref;
+    new_finalizers.clear();
+    new_ranges.clear();
+    work_cond.notify_one();
   }
 
-  // Flips the fromspace and tospace during a GC.
-  void Flip() {
-    std::swap(fromspace, tospace);
-    top = tospace + extent;
-    free = tospace;
+  // Returns once everything that was submitted has been done.
+  void Wait() {
+    std::unique_lock<std::mutex> guard(lock);
+    done_cond.wait(guard, [&] {
+      return !busy && finalizers.empty() && ranges.empty();
+    });
   }
+};
 
-  void ToggleStress() { stress = !stress; }
+// The state of a single parallel GC worker.
+struct GcWorker {
+  size_t id;
+  WorkStealingDeque deque;
+  // the pages of tospace that the worker copies objects of each kind
+  // into, without synchronizing with the other workers.
+  HeapPage *copy_pages[Sexp::kind_count];
+  size_t objects_copied;
+  size_t objects_promoted;
+};
 
-  void ToggleHeapVerify() { heap_verify = !heap_verify; }
+// Loads and stores of pointer fields during a parallel collection.
+// Objects are only ever copied by one worker, but a field can still be
+// updated by more than one: every FUNCTION cell for a lambda shares the
+// lambda's Meaning, for example. Every worker writes the same value, so
+// relaxed atomics are enough.
+static Value LoadField(Value *field) {
+  return reinterpret_cast<std::atomic<Value> *>(field)->load(
+      std::memory_order_relaxed);
+}
 
-  void VerifyHeap() {
-// The basic idea here is to traverse the entire
-// heap and verify that every pointer is 1) within
-// the valid heap range (i.e. we didn't accidentally introduce
-// any wild pointers during a GC) and to ensure that every pointer
-// points to a non-relocated object.
-//
-// When an object is relocated in a debug build, it is replaced
-// with the bit pattern 0xab - if we see a pointer here that
-// observes that bit pattern, we know that we failed to update
-// a pointer somewhere.
-#ifdef DEBUG
-    DebugLog("[%d] verifying heap", gc_number);
-    std::vector<Sexp *> stack;
-    std::unordered_set<Sexp *> visited;
-    ScanRoots([&](Sexp **ptr) {
-      if (ptr == nullptr || *ptr == nullptr) {
-        return;
-      }
+static void StoreField(Value *field, Value value) {
+  reinterpret_cast<std::atomic<Value> *>(field)->store(
+      value, std::memory_order_relaxed);
+}
 
-      if ((*ptr)->IsEmpty()) {
-        return;
-      }
+static_assert(sizeof(std::atomic<Value>) == sizeof(Value),
+              "atomic values must be the same size as values");
 
-      stack.push_back(*ptr);
-    });
+// Starts a new page for objects of the given kind at the given address.
+static HeapPage *InitPage(uint8_t *address, Sexp::Kind kind) {
+  HeapPage *page = reinterpret_cast<HeapPage *>(address);
+  page->kind = kind;
+  page->remembered = 0;
+  page->pinned = 0;
+  page->end = sizeof(HeapPage);
+  page->unit = 0;
+  return page;
+}
 
-    // make sure we relocated the finalize queue right
-    for (auto &it : finalize_queue) {
-      stack.push_back(it);
-    }
+#ifdef CONSERVATIVE_GC
+// The states of a page's pinned field.
+enum PinState : uint16_t {
+  // The page's objects are copied by a collection, as usual.
+  UNPINNED = 0,
+  // Something on the native stack might point into the page, so its objects
+  // stay where they are. A page stays pinned until the next collection.
+  PINNED = 1,
+  // The page was pinned by the last collection but not by the one that is
+  // in progress, so its objects are being copied out of it.
+  EVACUATING = 2
+};
+#endif
 
-    while (!stack.empty()) {
-      Sexp *ptr = stack.back();
-      stack.pop_back();
-      if (visited.count(ptr) != 0) {
-        continue;
-      }
+// Forgets about every page in a set of pages that are being allocated into.
+static void ResetPages(HeapPage **pages) {
+  std::fill(pages, pages + Sexp::kind_count, nullptr);
+}
 
-      visited.insert(ptr);
-      assert((uint8_t *)ptr >= heap_start && (uint8_t *)ptr <= heap_end &&
-             "pointer not in heap!");
-      assert(ptr->padding != 0xabababababababab &&
-             "observed a pointer that has been relocated!");
-      ptr->TracePointers([&](Sexp **child) {
-        assert(child != nullptr && "passed a null pointer to TracePointers!");
-        assert(*child != nullptr && "observed a null pointer!");
-        if ((*child)->IsEmpty()) {
-          return;
-        }
+// Bump-allocates an object of the given size on a page, returning null
+// if there isn't any room left on it. The memory isn't cleared: the pages
+// that the program allocates into are zeroed when they're started, and a
+// copy of an object overwrites all of it.
+static uint8_t *AllocateOnPage(HeapPage *page, size_t size) {
+  if (page == nullptr || page->end + size > PAGE_SIZE) {
+    return nullptr;
+  }
 
-        stack.push_back(*child);
-      });
+  uint8_t *result = page->End();
+  page->end += size;
+  return result;
+}
 
-      // DebugLog("heap verify: object %s is reachable",
-      // ptr->DumpString().c_str());
-    }
+// The sizes of the cells that the pages of the mark-sweep collector are
+// divided into. An object goes in the smallest cell that it fits in. Each
+// size divides the usable part of a page as evenly as a multiple of 8 can,
+// and the largest one takes up the whole page.
+static const size_t size_classes[] = {
+#ifdef COMPRESSED_REFS
+    // conses, which are only two 32-bit fields.
+    8,
 #endif
-  }
-};
+    16,  24,  32,  48,   64,   96,   128,  192,
+    256, 384, 512, 768, 1024, 1360, 2040, PAGE_SIZE - sizeof(HeapPage)};
+static const size_t size_class_count =
+    sizeof(size_classes) / sizeof(size_classes[0]);
 
-GcHeap::GcHeap() { pimpl = std::make_unique<GcHeap::GcHeapImpl>(); }
+// Returns the index of the smallest size class that an object of the
+// given size fits in.
+static size_t SizeClassOf(size_t size) {
+  const size_t *end = size_classes + size_class_count;
+  const size_t *found = std::lower_bound(size_classes, end, size);
+  assert(found != end && "object too big for a page");
+  return found - size_classes;
+}
 
-GcHeap::~GcHeap() {}
+// The size of the lines that the mark-region collector tracks which parts
+// of a page are in use by.
+static const size_t line_size = 128;
+static const size_t lines_per_page = PAGE_SIZE / line_size;
 
-Sexp *GcHeap::Allocate(bool should_finalize) {
-  return pimpl->Allocate(should_finalize);
+// Hints to the processor that the object at the given address is about to
+// be read. The address doesn't have to be valid.
+static void Prefetch(Value value) {
+#if defined(__GNUC__) || defined(__clang__)
+  __builtin_prefetch(reinterpret_cast<void *>(value.Bits()));
+#else
+  UNUSED_PARAMETER(value);
+#endif
 }
 
-void GcHeap::Collect() {
-  CONTRACT_VIOLATIONS { PERFORMS_GC; }
-  return pimpl->Collect();
+// When an object is copied, the address of its copy is stored in the
+// object's forwarding word. That's the first word of every object: for an
+// Sexp, its padding word, which is zero until then. A cons cell doesn't
+// have a word to spare, so its car is used instead.
+static uint64_t *ForwardingWord(Value object) {
+  return reinterpret_cast<uint64_t *>(object.Bits());
+}
+
+#ifdef COMPRESSED_REFS
+// With compressed references, the first word of a cons is both of its
+// fields. Neither of them ever has both low bits set, so a forwarding word
+// has them set, with the offset of the copy from g_heap_base (in words) in
+// its upper half.
+static uint64_t ForwardingWordTo(uint8_t *to) {
+  return ((uint64_t)(to - g_heap_base) >> 3 << 32) | 3;
+}
+
+static bool IsForwarded(uint64_t word) { return (word & 3) == 3; }
+
+static uint8_t *ForwardedTo(uint64_t word) {
+  return g_heap_base + ((word >> 32) << 3);
+}
+
+// A forwarding word that doesn't point anywhere, which marks an object
+// that a GC worker is in the middle of copying.
+static const uint64_t forwarding_busy = 3;
+#else
+// Otherwise, the forwarding word is the address of the copy with the low
+// bit set. No value is ever an odd number with the high bits clear, since
+// heap objects are aligned and immediates all have the high bits set, so
+// the two can't be confused.
+static uint64_t ForwardingWordTo(uint8_t *to) { return (uint64_t)to | 1; }
+
+static bool IsForwarded(uint64_t word) {
+  return (word >> 48) == 0 && (word & 1) != 0;
+}
+
+static uint8_t *ForwardedTo(uint64_t word) {
+  return reinterpret_cast<uint8_t *>(word & ~(uint64_t)1);
+}
+
+static const uint64_t forwarding_busy = 1;
+#endif
+
+// Returns the copy of an object, or null if it hasn't been copied.
+static Value ForwardingAddress(Value object) {
+  uint64_t word = *ForwardingWord(object);
+  if (!IsForwarded(word)) {
+    return nullptr;
+  }
+
+  return Value::FromAddress(ForwardedTo(word));
+}
+
+// A variable-length object with inline contents points to them, so a copy
+// of one has to be pointed at its own.
+static void RelocateStorage(Sexp::Kind kind, uint8_t *from, uint8_t *to) {
+  Sexp *from_obj = reinterpret_cast<Sexp *>(from);
+  Sexp *to_obj = reinterpret_cast<Sexp *>(to);
+  if (kind == Sexp::Kind::STRING &&
+      from_obj->string.chars == (jet_string)from_obj->InlineStorage()) {
+    to_obj->string.chars = (jet_string)to_obj->InlineStorage();
+  } else if (kind == Sexp::Kind::SLOTS &&
+             from_obj->slots.values == (Value *)from_obj->InlineStorage()) {
+    to_obj->slots.values = (Value *)to_obj->InlineStorage();
+  }
 }
 
-void GcHeap::ToggleStress() { pimpl->ToggleStress(); }
+// A compilation unit, which holds everything that one call to Analyze
+// created: the code pages that its meanings and constants live on, and the
+// arena that the Meaning objects themselves are allocated from. A unit is
+// freed as a whole once a full collection finds no pointers to it.
+struct CodeUnit {
+  uint32_t id;
+  HeapPage *current_pages[Sexp::kind_count];
+  std::vector<HeapPage *> pages;
+  std::vector<std::unique_ptr<uint8_t[]>> arena;
+  uint8_t *arena_free;
+  uint8_t *arena_end;
+  // Set by the collector when it finds a pointer into this unit. GC
+  // threads can set it concurrently.
+  std::atomic<bool> marked;
+};
+
+
+// Jet can manage its heap with one of several collectors, which is picked
+// with --gc. A Collector is what GcHeap drives: it allocates the objects
+// that can't be bump-allocated inline by the interpreter (see
+// g_alloc_pages), and it collects the heap. Each kind of collector is a
+// subclass of it. The parts that are the same for every collector live
+// here: the code space, the work that a pause hands off to the helper
+// thread, the limits on the size of the heap, and the statistics that
+// every collector keeps.
+//
+// Meanings and the constants that they quote live in a separate code space,
+// which never moves. Since the program that has been loaded can be much
+// bigger than the data it works with, the code space isn't traced by
+// collections. Instead, the write barrier records the pages of the code
+// space that point into the rest of the heap, or into other compilation
+// units, and those pages are scanned as roots. The code space is split up
+// into compilation units (see CodeUnit), and a full collection marks every
+// unit that it finds a pointer to. The units that weren't marked are freed
+// once the collection is over.
+class Collector {
+protected:
+  // Once the heap has reached the RSS target, it is only grown if more
+  // than this fraction of it is live.
+  const double target_grow_threshold = 0.9;
+  // The amount of address space reserved for the code space. The OS only
+  // hands out memory for the parts of it that get used.
+  const size_t code_space_size = 64 * 1024 * 1024;
+  // The size of the chunks that compilation unit arenas are made of.
+  const size_t arena_chunk_size = 1024;
+  // A full collection is started once this many code pages, or twice as
+  // many as were live after the last one, are in use.
+  const size_t min_code_page_budget = 256;
+
+  size_t min_size;
+  size_t max_size;
+  // The footprint that the heap sizing policy aims to stay under, or zero
+  // if there isn't one.
+  size_t rss_target;
+  // The live size past which collections get more aggressive and the soft
+  // limit hook is called, or zero if there isn't one. The hard limit is
+  // max_size: an allocation that doesn't fit under it throws.
+  size_t soft_limit;
+  SoftLimitHook soft_limit_hook;
+  bool over_soft_limit;
+  bool soft_limit_pending;
+  size_t soft_limit_live;
+  size_t soft_limit_count;
+  size_t out_of_memory_count;
+  bool huge_pages;
+  size_t decommitted_bytes;
+  std::vector<Value> worklist;
+  size_t gc_number;
+  bool stress;
+  bool heap_verify;
+  // The objects that own memory on the native heap, which is freed when
+  // they die: native functions, and strings and slot arrays that are too
+  // big to be stored inline. Everything else lives entirely on the GC heap,
+  // so this stays short, and each collection sweeps it in one pass.
+  std::vector<Sexp *> finalize_queue;
 
-void GcHeap::ToggleHeapVerify() { pimpl->ToggleHeapVerify(); }
+  // The code space, and the pages of it that might point to objects
+  // outside of their compilation unit.
+  uint8_t *code_space;
+  uint8_t *code_free;
+  std::vector<uint8_t *> free_code_pages;
+  std::vector<HeapPage *> code_roots;
+  size_t code_pages_in_use;
+  size_t code_page_budget;
+  bool code_collection_requested;
+  // The compilation units, indexed by id. The ids of freed units are
+  // reused. The units that are being analyzed are on unit_stack, and are
+  // never freed. The bottom of the stack is a unit that lives forever,
+  // for meanings that are created outside of Analyze.
+  std::vector<std::unique_ptr<CodeUnit>> units;
+  std::vector<uint32_t> free_unit_ids;
+  std::vector<CodeUnit *> unit_stack;
+#ifdef CONSERVATIVE_GC
+  // The arena chunks of every compilation unit, by address, so that a
+  // pointer into a Meaning can be traced back to its unit.
+  std::map<uint8_t *, std::pair<uint8_t *, uint32_t>> arena_chunks;
+#endif
+
+  // Null if the work that a collection leaves behind is done during the
+  // collection instead.
+  std::unique_ptr<GcHelperThread> helper;
+  // The finalizers of the objects that died, and the memory that is to
+  // be decommitted, since the end of the last pause.
+  std::vector<Finalizer> dead_finalizers;
+  std::vector<std::pair<uint8_t *, size_t>> decommit_ranges;
+  size_t finalizers_handed_off;
+
+  // Statistics, reported by DumpStatistics.
+  std::chrono::steady_clock::duration total_scavenge;
+  size_t peak_size;
+  std::chrono::steady_clock::duration total_pause;
+  std::chrono::steady_clock::duration max_pause;
+  std::vector<std::chrono::steady_clock::duration> pauses;
+  size_t units_freed;
+
+public:
+  Collector(const Options &options)
+      : min_size(options.heap_min_size), max_size(options.heap_max_size),
+        rss_target(options.gc_rss_target), soft_limit(options.heap_soft_limit),
+        soft_limit_hook(nullptr), over_soft_limit(false),
+        soft_limit_pending(false), soft_limit_live(0), soft_limit_count(0),
+        out_of_memory_count(0), huge_pages(options.gc_huge_pages),
+        decommitted_bytes(0) {
+    stress = false;
+    heap_verify = false;
+    gc_number = 0;
+    code_space = MapTheHeap(code_space_size / PAGE_SIZE);
+    code_free = code_space;
+    code_pages_in_use = 0;
+    code_page_budget = min_code_page_budget;
+    code_collection_requested = false;
+    unit_stack.push_back(NewUnit());
+    if (options.gc_helper_thread) {
+      helper = std::make_unique<GcHelperThread>();
+    }
+
+    finalizers_handed_off = 0;
+    total_scavenge = std::chrono::steady_clock::duration::zero();
+    peak_size = 0;
+    total_pause = std::chrono::steady_clock::duration::zero();
+    max_pause = std::chrono::steady_clock::duration::zero();
+    units_freed = 0;
+  }
+
+  // A collector that maps a space of its own has to stop the helper
+  // thread before unmapping it, since the helper might still be using it.
+  virtual ~Collector() {
+    helper.reset();
+    UnmapTheHeap(code_space, code_space_size);
+  }
+
+  Collector(const Collector &) = delete;
+  Collector &operator=(const Collector &) = delete;
+
+  // The bounds of the nursery, which are needed by the write barrier.
+  // Both are null if the heap isn't generational.
+  virtual uint8_t *NurseryStart() const { return nullptr; }
+  virtual uint8_t *NurseryEnd() const { return nullptr; }
+
+  // The bounds of the code space, which are also needed by the write
+  // barrier.
+  uint8_t *CodeStart() const { return code_space; }
+  uint8_t *CodeEnd() const { return code_space + code_space_size; }
+
+  // Allocates an object of the given kind in the code space, as part of
+  // the compilation unit that is being analyzed. Objects in the code space
+  // don't move, so this can't trigger a GC. If the code space has grown
+  // enough, a full collection is done at the next allocation instead, and
+  // if it's full, this throws.
+  uint8_t *AllocateCode(Sexp::Kind kind, size_t size) {
+    CodeUnit *unit = unit_stack.back();
+    uint8_t *result = AllocateOnPage(unit->current_pages[kind], size);
+    if (result == nullptr) {
+      uint8_t *page;
+      if (!free_code_pages.empty()) {
+        page = free_code_pages.back();
+        free_code_pages.pop_back();
+      } else {
+        if (code_free + PAGE_SIZE > CodeEnd()) {
+          OutOfCodeSpace();
+        }
+
+        page = code_free;
+        code_free += PAGE_SIZE;
+      }
+
+      unit->current_pages[kind] = InitPage(page, kind);
+      unit->current_pages[kind]->unit = unit->id;
+      unit->pages.push_back(unit->current_pages[kind]);
+      if (++code_pages_in_use > code_page_budget) {
+        code_collection_requested = true;
+      }
+
+      result = AllocateOnPage(unit->current_pages[kind], size);
+    }
+
+    memset(result, 0x0, size);
+    DebugLog("allocated code object at %p", result);
+    return result;
+  }
+
+  // Gives up on analyzing code that doesn't fit in the code space. Like
+  // OutOfMemory, this throws instead of killing the process: the unit that
+  // was being analyzed is ended by whatever unwinds past it, and a full
+  // collection is done at the next allocation, which frees the units that
+  // aren't in use anymore so that later code has room.
+  void OutOfCodeSpace() {
+    out_of_memory_count++;
+    code_collection_requested = true;
+    PublishAllocPages();
+    throw JetRuntimeException(
+        "out of memory: the code space can't grow past " +
+        std::to_string(code_space_size / 1024) + " kb");
+  }
+
+  // Starts a page that the program allocates into. Objects are handed out
+  // on it without being cleared, so the page is zeroed here unless the
+  // space that it's in is known to be already.
+  HeapPage *StartAllocPage(uint8_t *address, Sexp::Kind kind, bool zeroed) {
+    if (!zeroed) {
+      memset(address, 0x0, PAGE_SIZE);
+    }
+
+    return InitPage(address, kind);
+  }
+
+  // Allocates memory for a Meaning from the arena of the compilation unit
+  // that is being analyzed.
+  void *AllocateArena(size_t size) {
+    const size_t align = alignof(std::max_align_t);
+    size = (size + align - 1) & ~(align - 1);
+    CodeUnit *unit = unit_stack.back();
+    if (unit->arena_free == nullptr ||
+        size > (size_t)(unit->arena_end - unit->arena_free)) {
+      size_t chunk_size = std::max(arena_chunk_size, size);
+      unit->arena.emplace_back(new uint8_t[chunk_size]);
+      unit->arena_free = unit->arena.back().get();
+      unit->arena_end = unit->arena_free + chunk_size;
+#ifdef CONSERVATIVE_GC
+      arena_chunks[unit->arena_free] =
+          std::make_pair(unit->arena_end, unit->id);
+#endif
+    }
+
+    void *result = unit->arena_free;
+    unit->arena_free += size;
+    return result;
+  }
+
+  CodeUnit *NewUnit() {
+    uint32_t id;
+    if (!free_unit_ids.empty()) {
+      id = free_unit_ids.back();
+      free_unit_ids.pop_back();
+    } else {
+      id = (uint32_t)units.size();
+      units.emplace_back();
+    }
+
+    units[id] = std::make_unique<CodeUnit>();
+    CodeUnit *unit = units[id].get();
+    unit->id = id;
+    ResetPages(unit->current_pages);
+    unit->arena_free = nullptr;
+    unit->arena_end = nullptr;
+    // a unit that is created during an incremental collection can't have
+    // been seen by it, so it starts out marked.
+    unit->marked.store(true);
+    return unit;
+  }
+
+  void BeginUnit() {
+    unit_stack.push_back(NewUnit());
+    DebugLog("beginning compilation unit %u", unit_stack.back()->id);
+  }
+
+  void EndUnit() {
+    assert(unit_stack.size() > 1 && "ended the permanent compilation unit");
+    unit_stack.pop_back();
+  }
+
+  uint32_t UnitOf(Value ref) const {
+    assert(InCodeSpace(ref));
+    return HeapPage::Of(ref.Bits())->unit;
+  }
+
+  // Returns true if ref and value are both in the code space, in the same
+  // compilation unit.
+  bool InSameUnit(Value ref, Value value) const {
+    return InCodeSpace(ref) && InCodeSpace(value) &&
+           UnitOf(ref) == UnitOf(value);
+  }
+
+  void MarkCode(Value ref) {
+    assert(units[UnitOf(ref)] != nullptr && "pointer to a freed code unit!");
+    units[UnitOf(ref)]->marked.store(true, std::memory_order_relaxed);
+  }
+
+  // Clears the marks of every compilation unit at the start of a full
+  // collection.
+  void ResetCodeMarks() {
+    for (auto &unit : units) {
+      if (unit) {
+        unit->marked.store(false, std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Frees the compilation units that weren't marked by the full collection
+  // that just finished.
+  void SweepCodeUnits() {
+    for (CodeUnit *unit : unit_stack) {
+      unit->marked.store(true, std::memory_order_relaxed);
+    }
+
+    // the remembered pages of dead units have to be forgotten before the
+    // pages are handed back out.
+    code_roots.erase(std::remove_if(code_roots.begin(), code_roots.end(),
+                                    [&](HeapPage *page) {
+                                      return !units[page->unit]->marked.load();
+                                    }),
+                     code_roots.end());
+    for (auto &unit : units) {
+      if (unit && !unit->marked.load()) {
+        FreeUnit(unit.get());
+      }
+    }
+
+    code_page_budget = std::max(min_code_page_budget, 2 * code_pages_in_use);
+    code_collection_requested = false;
+  }
+
+  void FreeUnit(CodeUnit *unit) {
+    DebugLog("[%d] freeing compilation unit %u", gc_number, unit->id);
+    for (HeapPage *page : unit->pages) {
+      if (page->kind == Sexp::Kind::MEANING ||
+          page->kind == Sexp::Kind::STRING) {
+        uint8_t *end = page->End();
+        for (uint8_t *obj = page->Begin(); obj < end;
+             obj += ObjectSize(page->kind, obj)) {
+          reinterpret_cast<Sexp *>(obj)->Finalize();
+        }
+      }
+
+#ifdef DEBUG
+      memset(page, 0xAB, PAGE_SIZE);
+#endif
+      free_code_pages.push_back(reinterpret_cast<uint8_t *>(page));
+    }
+
+#ifdef CONSERVATIVE_GC
+    for (auto &chunk : unit->arena) {
+      arena_chunks.erase(chunk.get());
+    }
+#endif
+
+    code_pages_in_use -= unit->pages.size();
+    units_freed++;
+    free_unit_ids.push_back(unit->id);
+    units[unit->id].reset();
+  }
+
+  // Copies a constant into the code space. Structure that is shared
+  // within the constant stays shared in the copy.
+  Value CopyToCodeSpace(Value constant) {
+    std::unordered_map<uint64_t, Value> copies;
+    return CopyConstant(constant, copies);
+  }
+
+  Value CopyConstant(Value constant,
+                     std::unordered_map<uint64_t, Value> &copies) {
+    CodeUnit *unit = unit_stack.back();
+    if (!constant.IsObject() ||
+        (InCodeSpace(constant) && UnitOf(constant) == unit->id)) {
+      return constant;
+    }
+
+    auto existing = copies.find(constant.Bits());
+    if (existing != copies.end()) {
+      return existing->second;
+    }
+
+    if (constant.IsString()) {
+      String &str = constant->AsObject()->string;
+      size_t storage = InlineSize(str.length + 1);
+      Sexp *copy =
+          (Sexp *)AllocateCode(Sexp::Kind::STRING, sizeof(Sexp) + storage);
+      GcHeap::InitializeString(copy, str.chars, str.length, storage);
+      copies[constant.Bits()] = copy;
+      return copy;
+    }
+
+    if (!constant.IsCons()) {
+      // the reader only produces conses and strings, so anything else
+      // was put here by a macro. it stays where it is, and the page of
+      // whatever points to it is remembered.
+      return constant;
+    }
+
+    // lists are copied a cons at a time so that long ones don't
+    // recurse too deeply.
+    Value head = nullptr;
+    Cons *last = nullptr;
+    Value cursor = constant;
+    while (cursor.IsObject() && cursor.IsCons() &&
+           !(InCodeSpace(cursor) && UnitOf(cursor) == unit->id) &&
+           copies.count(cursor.Bits()) == 0) {
+      Cons *copy = (Cons *)AllocateCode(Sexp::Kind::CONS, sizeof(Cons));
+      copies[cursor.Bits()] = copy;
+      if (last == nullptr) {
+        head = copy;
+      } else {
+        last->cdr = copy;
+      }
+
+      copy->car = BoxInCodeSpace(CopyConstant(cursor.Car(), copies));
+      RecordCodeObject(copy);
+      last = copy;
+      cursor = cursor.Cdr();
+    }
+
+    last->cdr = BoxInCodeSpace(CopyConstant(cursor, copies));
+    RecordCodeObject(last);
+    return head;
+  }
+
+  // Returns what to store in a field of a cons in the code space, which
+  // is a box in the code space for a number in a build with compressed
+  // references, and the value itself otherwise.
+  Value BoxInCodeSpace(Value value) {
+#ifdef COMPRESSED_REFS
+    if (value.IsFixnum()) {
+      Sexp *box = (Sexp *)AllocateCode(Sexp::Kind::BOX,
+                                       ObjectSize(Sexp::Kind::BOX));
+      box->number = value.AsFixnum();
+      return box;
+    }
+#endif
+
+    return value;
+  }
+
+  // Remembers the page of an object in the code space if the object
+  // points to anything outside of its compilation unit.
+  void RecordCodeObject(Value ref) {
+    assert(InCodeSpace(ref));
+    bool points_out = false;
+    ref.TracePointers([&](Value *child) {
+      if (child->IsObject() && !InSameUnit(ref, *child)) {
+        points_out = true;
+      }
+    });
+
+    if (points_out) {
+      Remember(ref);
+    }
+  }
+
+  // Calls func on every pointer held by the remembered pages of the
+  // code space that points outside of the page's compilation unit. The
+  // pointers within a unit are skipped, since they would keep the unit
+  // alive forever.
+  template <typename F> void ScanCodeRoots(F func) {
+    DebugLog("[%d] scanning %zu code pages", gc_number, code_roots.size());
+    for (HeapPage *page : code_roots) {
+      uint8_t *end = page->End();
+      for (uint8_t *obj = page->Begin(); obj < end;
+           obj += ObjectSize(page->kind, obj)) {
+        Value::FromAddress(obj)->TracePointers([&](Value *ref) {
+          if (!InCodeSpace(*ref) || UnitOf(*ref) != page->unit) {
+            func(ref);
+          }
+        });
+      }
+    }
+  }
+
+  // Hands the pages that new objects are allocated on out to the inline
+  // allocation path (see g_alloc_pages), along with the free lists that
+  // they're taken from by a collector that keeps them (see g_free_lists),
+  // or takes them back if every allocation has to come through here for
+  // now. This has to be called whenever the current pages change, or any
+  // of the conditions that the collector hands them out under.
+  void PublishAllocPages() {
+    bool fast_path = !stress && !code_collection_requested;
+    for (size_t kind = 0; kind < Sexp::kind_count; kind++) {
+      Sexp::Kind k = static_cast<Sexp::Kind>(kind);
+      g_alloc_pages[kind] = fast_path ? InlineAllocPage(k) : nullptr;
+      g_free_lists[kind] = fast_path ? InlineFreeList(k) : nullptr;
+    }
+  }
+
+  // Allocates an object of the given kind from the heap, triggering a
+  // garbage collection if necessary. This is the slow path of
+  // GcHeap::AllocateRaw.
+  uint8_t *Allocate(Sexp::Kind kind, size_t size, bool should_finalize) {
+    // on a debug build, this triggers a stackwalk which will assert if
+    // any of the calling functions has a FORBID_GC contract.
+    CONTRACT_VIOLATIONS { PERFORMS_GC; }
+
+    if (soft_limit_pending) {
+      // the hook might allocate, so it's told about the soft limit out
+      // here instead of during the collection that went over it.
+      soft_limit_pending = false;
+      if (soft_limit_hook != nullptr) {
+        soft_limit_hook(soft_limit_live, soft_limit);
+      }
+    }
+
+    if (code_collection_requested) {
+      DebugLog("the code space has grown, triggering a full GC");
+      StartFullCollection();
+    }
+
+    uint8_t *result = AllocateObject(kind, size, should_finalize);
+    DebugLog("allocated object at %p", result);
+    return result;
+  }
+
+  // Performs a full collection, resizing the heap afterwards if
+  // necessary.
+  virtual void Collect() = 0;
+
+  // Called by the read barrier when the interpreter loads a pointer to
+  // an object that hasn't been copied yet. Only a collector that copies
+  // objects while the program runs has a read barrier.
+  virtual Value ForwardField(Value *field) {
+    assert(false && "the read barrier isn't used by this collector");
+    return *field;
+  }
+
+  // Called by the write barrier when a pointer to a young object is stored
+  // into an object that is not in the nursery, or when a pointer to an
+  // object outside of the code space is stored into the code space. The
+  // whole page that the object is on is remembered. Code pages stay
+  // remembered until their compilation unit is freed.
+  void Remember(Value ref) {
+    HeapPage *page = HeapPage::Of(ref.Bits());
+    if (page->remembered) {
+      return;
+    }
+
+    DebugLog("remembering page %p", page);
+    page->remembered = 1;
+    if (InCodeSpace(ref)) {
+      code_roots.push_back(page);
+    } else {
+      RememberPage(page);
+    }
+  }
+
+  // Called by the write barrier when anything is stored into the code
+  // space. Pointers within a compilation unit don't need to be remembered.
+  void RememberCode(Value ref, Value value) {
+    if (!InSameUnit(ref, value)) {
+      Remember(ref);
+    }
+  }
+
+  void RecordPause(std::chrono::steady_clock::duration pause) {
+    // every pause ends here, so this is where the work that it left
+    // behind is handed off.
+    HandOff();
+    pauses.push_back(pause);
+    total_pause += pause;
+    max_pause = std::max(max_pause, pause);
+  }
+
+  bool InCodeSpace(Value ptr) const {
+    return ptr.Bits() >= (uintptr_t)CodeStart() &&
+           ptr.Bits() < (uintptr_t)CodeEnd();
+  }
+
+  // Finalizes an object that died. Unless there's no helper thread, what
+  // it owns is only released once the pause is over.
+  void FinalizeDead(Sexp *ptr) {
+    if (helper == nullptr) {
+      ptr->Finalize();
+      return;
+    }
+
+    dead_finalizers.push_back(ptr->DetachFinalizer());
+  }
+
+  // Hands the work that the pause that is ending left behind to the
+  // helper thread, or does it now if there isn't one.
+  void HandOff() {
+    if (helper == nullptr) {
+      for (auto &range : decommit_ranges) {
+        DecommitTheHeap(range.first, range.second);
+      }
+
+      decommit_ranges.clear();
+      return;
+    }
+
+    if (dead_finalizers.empty() && decommit_ranges.empty()) {
+      return;
+    }
+
+    finalizers_handed_off += dead_finalizers.size();
+    helper->Submit(dead_finalizers, decommit_ranges);
+  }
+
+  // Waits for the helper thread to finish, which has to be done before
+  // any memory that it might be decommitting is used again.
+  void WaitForHelper() {
+    if (helper != nullptr) {
+      helper->Wait();
+    }
+  }
+
+  void Decommit(uint8_t *start, size_t size) {
+#ifdef DEBUG
+    if (heap_verify) {
+      // leave the poison where it is, so that a pointer to a dead object
+      // is still caught.
+      return;
+    }
+#endif
+
+    decommit_ranges.emplace_back(start, size);
+    decommitted_bytes += size;
+  }
+
+  // Maps a semispace, or the mark space, backing it with huge pages if
+  // asked to. Since fromspace is decommitted after every collection, only
+  // the space that is in use ends up with any.
+  uint8_t *MapSpace(size_t size) {
+    uint8_t *space = MapTheHeap(size / PAGE_SIZE);
+    if (huge_pages) {
+      AdviseHugePages(space, size);
+    }
+
+    return space;
+  }
+
+  // The size that the heap sizing policy tries to keep the heap under:
+  // the RSS target, less whatever else the heap always has committed, if
+  // there is one.
+  size_t SoftMaxSize() const {
+    size_t soft_max = max_size;
+    if (rss_target != 0) {
+      size_t nursery_size = NurseryEnd() - NurseryStart();
+      size_t target =
+          rss_target > nursery_size ? rss_target - nursery_size : 0;
+      soft_max = std::min(std::max(target, min_size), max_size);
+    }
+
+    if (soft_limit != 0) {
+      soft_max = std::min(std::max(soft_limit, min_size), soft_max);
+    }
+
+    return soft_max;
+  }
+
+  // Notes whether a full collection left more live data than the soft
+  // limit. The hook is only told the first time that it does, and
+  // again once the heap has gone back under the limit in between.
+  void CheckSoftLimit(size_t live) {
+    if (soft_limit == 0) {
+      return;
+    }
+
+    if (live <= soft_limit) {
+      over_soft_limit = false;
+      return;
+    }
+
+    if (!over_soft_limit) {
+      DebugLog("[%d] %zu bytes live, over the soft limit", gc_number, live);
+      over_soft_limit = true;
+      soft_limit_pending = true;
+      soft_limit_live = live;
+      soft_limit_count++;
+    }
+  }
+
+  // Gives up on an allocation that doesn't fit under the hard limit. The
+  // collection before it has finished, so the heap can still be used by
+  // whatever catches this, and the memory that the failed computation was
+  // holding on to is freed by the next collection.
+  void OutOfMemory() {
+    out_of_memory_count++;
+    PublishAllocPages();
+    throw JetRuntimeException("out of memory: the heap can't grow past " +
+                              std::to_string(max_size / 1024) + " kb");
+  }
+
+  // Whether the heap has a size that it only grows past when it's nearly
+  // full, either because of the RSS target or because of the soft limit.
+  bool HasSoftMax() const { return rss_target != 0 || soft_limit != 0; }
+
+  void ToggleStress() { stress = !stress; }
+
+  void SetSoftLimitHook(SoftLimitHook hook) { soft_limit_hook = hook; }
+
+  void ToggleHeapVerify() { heap_verify = !heap_verify; }
+
+  void VerifyHeap() {
+// The basic idea here is to traverse the entire
+// heap and verify that every pointer is 1) within
+// the valid heap range (i.e. we didn't accidentally introduce
+// any wild pointers during a GC) and to ensure that every pointer
+// points to a non-relocated object.
+//
+// When an object is relocated in a debug build, it is replaced
+// with the bit pattern 0xab - if we see a pointer here that
+// observes that bit pattern, we know that we failed to update
+// a pointer somewhere.
+//
+// Each collector checks what it knows about where its objects can be,
+// and which pointers have to be remembered by the write barrier.
+#ifdef DEBUG
+    DebugLog("[%d] verifying heap", gc_number);
+    std::vector<Value> stack;
+    std::unordered_set<uint64_t> visited;
+    ScanRoots([&](Value *ptr) {
+      if (ptr == nullptr || !ptr->IsObject()) {
+        return;
+      }
+
+      stack.push_back(*ptr);
+    });
+
+    for (HeapPage *page : code_roots) {
+      assert(page->remembered && "code root isn't remembered!");
+    }
+
+    AddVerifyRoots(stack);
+    while (!stack.empty()) {
+      Value ptr = stack.back();
+      stack.pop_back();
+      if (visited.count(ptr.Bits()) != 0) {
+        continue;
+      }
+
+      visited.insert(ptr.Bits());
+      uint8_t *address = (uint8_t *)ptr.Bits();
+      bool in_code = InCodeSpace(ptr);
+      assert((in_code ? address < code_free : InHeap(ptr)) &&
+             "pointer not in heap!");
+      HeapPage *page = HeapPage::Of(ptr.Bits());
+      assert(page->kind < Sexp::kind_count &&
+             "observed a pointer that has been relocated!");
+      assert(address >= page->Begin() &&
+             "pointer before the start of its page!");
+      if (in_code) {
+        assert(address < page->End() && "pointer past the end of its page!");
+        assert(units[page->unit] != nullptr &&
+               "pointer to a freed compilation unit!");
+      } else {
+        VerifyObject(address, page);
+      }
+
+      ptr.TracePointers([&](Value *child) {
+        assert(child != nullptr && "passed a null pointer to TracePointers!");
+        assert(*child != nullptr && "observed a null pointer!");
+        if (!child->IsObject()) {
+          return;
+        }
+
+        assert((!MustBeRemembered(ptr, *child) || page->remembered != 0) &&
+               "pointer that the write barrier should have remembered "
+               "isn't remembered!");
+        stack.push_back(*child);
+      });
+
+      // DebugLog("heap verify: object %s is reachable",
+      // ptr->DumpString().c_str());
+    }
+#endif
+  }
+
+  void DumpStatistics(std::ostream &out) {
+    using std::chrono::duration;
+    using ms = duration<double, std::milli>;
+    out << "gc: " << gc_number << " collections, "
+        << ms(total_pause).count() << " ms total pause, "
+        << ms(max_pause).count() << " ms max pause" << std::endl;
+    if (helper != nullptr) {
+      out << "gc: " << finalizers_handed_off
+          << " finalizers run on the helper thread" << std::endl;
+    }
+
+    if (soft_limit != 0 || out_of_memory_count != 0) {
+      out << "gc: went over the soft limit " << soft_limit_count
+          << " times, " << out_of_memory_count << " allocations failed"
+          << std::endl;
+    }
+
+    out << "gc: " << code_pages_in_use * PAGE_SIZE / 1024
+        << " kb code space, " << units.size() - free_unit_ids.size()
+        << " code units, " << units_freed << " code units freed, "
+        << code_roots.size() << " code pages scanned as roots" << std::endl;
+#ifndef _WIN32
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    size_t peak_rss = usage.ru_maxrss;
+#ifdef __APPLE__
+    // macOS reports this in bytes rather than kilobytes.
+    peak_rss /= 1024;
+#endif
+    out << "gc: " << CurrentRss() << " kb rss, " << peak_rss
+        << " kb peak rss, " << decommitted_bytes / 1024
+        << " kb returned to the os" << std::endl;
+#endif
+
+    if (!pauses.empty()) {
+      using us = duration<double, std::micro>;
+      std::vector<std::chrono::steady_clock::duration> sorted(pauses);
+      std::sort(sorted.begin(), sorted.end());
+      auto percentile = [&](double p) {
+        size_t index = std::min((size_t)(p * sorted.size()), sorted.size() - 1);
+        return us(sorted[index]).count();
+      };
+
+      out << "gc: " << percentile(0.5) << " us p50 pause, " << percentile(0.99)
+          << " us p99 pause, " << us(sorted.back()).count()
+          << " us max pause" << std::endl;
+    }
+
+    DumpCollectorStatistics(out);
+  }
+
+protected:
+  // Allocates an object that the inline allocation path couldn't, which
+  // is the part of Allocate that depends on the collector.
+  virtual uint8_t *AllocateObject(Sexp::Kind kind, size_t size,
+                                  bool should_finalize) = 0;
+
+  // Starts a full collection, so that the compilation units that aren't
+  // in use anymore are freed. Most collectors do the whole collection
+  // right away.
+  virtual void StartFullCollection() { Collect(); }
+
+  // The page that the inline allocation path can bump objects of the given
+  // kind onto, if there's one, and the free list that it can take them off
+  // of, if the collector keeps one.
+  virtual HeapPage *InlineAllocPage(Sexp::Kind kind) = 0;
+  virtual uint8_t **InlineFreeList(Sexp::Kind) { return nullptr; }
+
+  // Called by Remember for a page outside of the code space, which only
+  // the generational collector has the write barrier remember.
+  virtual void RememberPage(HeapPage *) {
+    assert(false && "only the generational collector remembers heap pages");
+  }
+
+  // Prints the statistics that are specific to the collector.
+  virtual void DumpCollectorStatistics(std::ostream &out) = 0;
+
+#ifdef DEBUG
+  // The parts of VerifyHeap that are specific to the collector: the
+  // objects that it keeps alive without anything pointing to them, whether
+  // an object outside of the code space is somewhere that it keeps live
+  // objects, what has to be true of where the object is on its page, and
+  // whether a pointer from one object to another has to be remembered.
+  virtual void AddVerifyRoots(std::vector<Value> &stack) {
+    for (Sexp *ptr : finalize_queue) {
+      stack.push_back(ptr);
+    }
+  }
+
+  virtual bool InHeap(Value ptr) const = 0;
+
+  virtual void VerifyObject(uint8_t *address, HeapPage *page) {
+    assert(address < page->End() && "pointer past the end of its page!");
+  }
+
+  virtual bool MustBeRemembered(Value from, Value to) const {
+    return InCodeSpace(from) && !InSameUnit(from, to);
+  }
+#endif
+};
+
+// The semispace collector is a copying collector. It partitions
+// the heap into two distinct regions: the "fromspace" and "tospace".
+// When a GC occurs, the two regions are swapped and all live objects
+// are copied to the new semispace.
+//
+// Each semispace is handed out a page at a time, and every page only
+// holds objects of one kind (see HeapPage). Objects are bump-allocated
+// within the current page for their kind, and a new page is taken from
+// the semispace whenever that page fills up. Copying works the same way,
+// so a collection leaves the objects of each kind packed together.
+//
+// The semispaces are mapped separately so that they can be resized
+// independently of one another. After every collection, the heap looks
+// at how much data survived and decides whether or not the semispaces
+// should grow or shrink - see AdjustHeapSize for the details.
+//
+// With more than one GC thread, the copying done by a full collection is
+// spread across a pool of threads - see ParallelTrace for the details.
+//
+// A conservative build (CONSERVATIVE_GC) doesn't know where the native
+// code keeps its pointers, so it treats every word on the native stack
+// that points into an object as a possible pointer. Such pointers can't be
+// updated, so the pages that they point into are pinned: they stay where
+// they are, become part of tospace, and everything on them is treated as
+// live and scanned like a root. Everything else is copied as usual. This is
+// Bartlett's mostly-copying collector. A pinned page might sit in the
+// middle of the semispace that the next collection copies into, so pages
+// are handed out around it, and a pinned page whose semispace is unmapped
+// by a resize is left mapped on its own until it's no longer pinned.
+class SemispaceCollector : public Collector {
+protected:
+  // If more than this fraction of a semispace is live after a
+  // collection, the semispaces are grown.
+  const double grow_threshold = 0.5;
+  // If less than this fraction of a semispace is live after
+  // shrink_delay consecutive collections, the semispaces are shrunk.
+  const double shrink_threshold = 0.125;
+  const size_t shrink_delay = 4;
+
+  // Collections that copy less than this many bytes are done by one
+  // thread, since waking up the others would cost more than it saves.
+  const size_t parallel_threshold = 256 * 1024;
+
+  uint8_t *tospace;
+  uint8_t *fromspace;
+  size_t tospace_size;
+  size_t fromspace_size;
+  uint8_t *top;
+  // The first page of tospace that hasn't been handed out yet.
+  uint8_t *free;
+  // The end of the space that free can bump into. This is the same as top,
+  // except for the incremental collector, where objects allocated during a
+  // collection live between limit and top.
+  uint8_t *limit;
+  // The pages that new objects of each kind are allocated on, and the
+  // pages that the collector copies objects of each kind onto. Either
+  // can be null if there isn't a current page for a kind.
+  HeapPage *alloc_pages[Sexp::kind_count];
+  HeapPage *copy_pages[Sexp::kind_count];
+  size_t low_occupancy_count;
+  // The order that a stop-the-world collection copies objects in, and
+  // the cells of the list spine that is being scanned in list order.
+  CopyOrder copy_order;
+  std::vector<Value> spine;
+  // The bounds of the nursery, if the heap is generational. A full
+  // collection copies the objects in it along with the ones in fromspace.
+  uint8_t *nursery_start;
+  uint8_t *nursery_end;
+#ifdef CONSERVATIVE_GC
+  // The pages that the last collection pinned, sorted by address.
+  std::vector<HeapPage *> pinned_pages;
+  std::vector<HeapPage *> newly_pinned;
+  size_t pinned_count;
+#endif
+
+  // The parallel collector, which is only used with more than one
+  // GC thread.
+  std::unique_ptr<GcThreadPool> pool;
+  // Whether the parts of each semispace that haven't been handed out
+  // since it was last emptied are known to be zero. Pages that the program
+  // allocates into are only zeroed by hand if they aren't.
+  bool tospace_zeroed;
+  bool fromspace_zeroed;
+  std::vector<std::unique_ptr<GcWorker>> workers;
+  std::atomic<size_t> next_root;
+  std::atomic<size_t> idle_workers;
+  std::atomic<uint8_t *> shared_free;
+
+  size_t objects_copied;
+  size_t objects_promoted;
+  size_t resize_count;
+
+public:
+  SemispaceCollector(const Options &options) : Collector(options) {
+    size_t initial_size = options.heap_initial_size;
+    assert(initial_size % PAGE_SIZE == 0);
+    assert(min_size <= initial_size && initial_size <= max_size);
+    tospace = MapSpace(initial_size);
+    fromspace = MapSpace(initial_size);
+    tospace_size = initial_size;
+    fromspace_size = initial_size;
+    top = tospace + tospace_size;
+    free = tospace;
+    limit = top;
+    ResetPages(alloc_pages);
+    ResetPages(copy_pages);
+    low_occupancy_count = 0;
+    copy_order = options.gc_copy_order;
+    nursery_start = nullptr;
+    nursery_end = nullptr;
+    size_t gc_threads = options.gc_threads;
+    if (gc_threads > 1) {
+      pool = std::make_unique<GcThreadPool>(gc_threads);
+      for (size_t i = 0; i < gc_threads; i++) {
+        workers.push_back(std::make_unique<GcWorker>());
+        workers.back()->id = i;
+      }
+    }
+
+    tospace_zeroed = true;
+    fromspace_zeroed = true;
+    objects_copied = 0;
+    objects_promoted = 0;
+    resize_count = 0;
+    peak_size = initial_size;
+#ifdef CONSERVATIVE_GC
+    pinned_count = 0;
+#endif
+  }
+
+  ~SemispaceCollector() {
+    helper.reset();
+    UnmapTheHeap(tospace, tospace_size);
+    UnmapTheHeap(fromspace, fromspace_size);
+  }
+
+  uint8_t *AllocateObject(Sexp::Kind kind, size_t size,
+                          bool should_finalize) override {
+#ifdef DEBUG
+    if (stress) {
+      Collect();
+    }
+#endif
+
+    uint8_t *result = AllocateOnPage(alloc_pages[kind], size);
+    if (result == nullptr) {
+      SkipPinnedPages();
+      if (free + PAGE_SIZE > limit) {
+        DebugLog("out of pages, triggering a GC");
+        // we've filled up our fromspace - need to GC.
+        Collect();
+        SkipPinnedPages();
+        if (free + PAGE_SIZE > limit) {
+          // the collection didn't free up anything and the heap
+          // has already been grown as much as it is allowed to.
+          OutOfMemory();
+        }
+      }
+
+      alloc_pages[kind] = StartAllocPage(free, kind, tospace_zeroed);
+      free += PAGE_SIZE;
+      result = AllocateOnPage(alloc_pages[kind], size);
+    }
+
+    // if this object needs to be finalized,
+    // stick it on the queue.
+    if (should_finalize) {
+      DebugLog("marking object %p for finalization", result);
+      finalize_queue.push_back((Sexp *)result);
+    }
+
+    return result;
+  }
+
+  HeapPage *InlineAllocPage(Sexp::Kind kind) override {
+    return alloc_pages[kind];
+  }
+
+  // Performs a garbage collection, resizing the heap afterwards
+  // if necessary.
+  void Collect() override {
+    auto start = std::chrono::steady_clock::now();
+#ifdef DEBUG
+    if (heap_verify) {
+      VerifyHeap();
+    }
+#endif
+
+    Scavenge();
+    if (fromspace_size != tospace_size) {
+      // the space we just copied into was grown before the collection,
+      // so the other one needs to be grown to match it.
+      ReleaseFromspace();
+      fromspace = MapSpace(tospace_size);
+      fromspace_size = tospace_size;
+      fromspace_zeroed = true;
+    }
+
+    AdjustHeapSize();
+    DecommitFromspace();
+
+#ifdef DEBUG
+    if (heap_verify) {
+      VerifyHeap();
+    }
+#endif
+
+    RecordPause(std::chrono::steady_clock::now() - start);
+  }
+
+  // The number of bytes that have been handed out since the last
+  // collection, which is at most what the next one copies.
+  virtual size_t UsedSize() const { return (free - tospace) + (top - limit); }
+
+  // Finishes whatever still needs the objects that the last collection
+  // left in fromspace, which has to be done before fromspace is reused.
+  virtual void SettleFromspace() {}
+
+  // Copies all live objects out of the current semispace and into
+  // the other semispace.
+  virtual void Scavenge() {
+    auto start = std::chrono::steady_clock::now();
+    SettleFromspace();
+    gc_number++;
+    DebugLog("[%d] beginning a GC", gc_number);
+    assert(worklist.empty());
+    size_t used = UsedSize();
+    ResetCodeMarks();
+#ifdef CONSERVATIVE_GC
+    // the native stack is scanned before the flip, since a pointer is only
+    // worth pinning if it points into the space that's in use right now.
+    PinAmbiguousRoots();
+#endif
+
+    // flip the fromspace and tospace - we're about
+    // to relocate all of our live objects to the new tospace.
+    Flip();
+
+    // the parallel collector leaves holes in tospace, so it can only
+    // be used if there's room for them.
+    if (pool && (used >= parallel_threshold || stress) &&
+        used + pool->Size() * Sexp::kind_count * PAGE_SIZE <= tospace_size) {
+      ParallelTrace();
+    } else {
+      // all roots are known to be live. we'll process those first.
+      DebugLog("[%d] processing roots", gc_number);
+#ifdef CONSERVATIVE_GC
+      ScanPinnedPages();
+#endif
+      ScanRoots([&](Value *ptr) { Process(ptr); });
+      ScanCodeRoots([&](Value *ptr) { Process(ptr); });
+
+      // we've populated our worklist, now we need to process it.
+      DebugLog("[%d] draining worklist", gc_number);
+      DrainWorklist([&](Value *ref) { Process(ref); });
+    }
+
+    FinalizeDeadObjects();
+    SweepCodeUnits();
+#ifdef CONSERVATIVE_GC
+    FinishPinning();
+#endif
+
+#ifdef DEBUG
+    // everything left in fromspace is now garbage. use a distinct bit
+    // pattern to ensure that we insta-crash on a GC hole.
+    PoisonFromspace();
+#endif
+
+    DebugLog("[%d] GC complete", gc_number);
+    // and we're done!
+    assert(worklist.empty());
+    total_scavenge += std::chrono::steady_clock::now() - start;
+  }
+
+  // Scans everything on the worklist, and everything that gets copied
+  // while doing so, calling process on every pointer. The objects on the
+  // worklist have already been relocated, so this processes their
+  // transitive closure. This is only used by stop-the-world collections;
+  // an incremental one always scans depth first, since scanning a whole
+  // list spine at once could take longer than a slice is allowed to.
+  template <typename F> void DrainWorklist(F process) {
+    while (!worklist.empty()) {
+      Value ptr = worklist.back();
+      worklist.pop_back();
+      if (!worklist.empty()) {
+        Prefetch(worklist.back());
+      }
+
+      if (copy_order == CopyOrder::List &&
+          HeapPage::Of(ptr.Bits())->kind == Sexp::Kind::CONS) {
+        ScanList(ptr, process);
+      } else {
+        ptr->TracePointers(process);
+      }
+    }
+  }
+
+  // Scans a cons cell in list order. The rest of its spine is copied
+  // first, one cell right after the other, and then the cars of its cells
+  // are copied in order. Their contents are scanned in that order too,
+  // so each list hanging off of the spine ends up laid out in one piece,
+  // after the ones before it.
+  template <typename F> void ScanList(Value cell, F process) {
+    assert(spine.empty());
+    while (true) {
+      spine.push_back(cell);
+      size_t pending = worklist.size();
+      TraceRef(&cell.AsCons()->cdr, process);
+      if (worklist.size() == pending) {
+        // the cdr wasn't copied just now, so it's either not on the heap
+        // or something else is taking care of it.
+        break;
+      }
+
+      Value next = worklist.back();
+      if (HeapPage::Of(next.Bits())->kind != Sexp::Kind::CONS) {
+        break;
+      }
+
+      // the next cell of the spine stays off of the worklist, since it's
+      // being scanned right now.
+      worklist.pop_back();
+      cell = next;
+    }
+
+    size_t first_car = worklist.size();
+    for (size_t i = 0; i < spine.size(); i++) {
+      if (i + 1 < spine.size()) {
+        Prefetch(spine[i + 1].AsCons()->car);
+      }
+
+      TraceRef(&spine[i].AsCons()->car, process);
+    }
+
+    // the worklist is popped from the back, so the cars are put on it
+    // backwards to have them scanned in order.
+    std::reverse(worklist.begin() + first_car, worklist.end());
+    spine.clear();
+  }
+
+  // Finalizes the objects in the finalizer queue that weren't copied
+  // by the collection that just finished.
+  void FinalizeDeadObjects() {
+    DebugLog("[%d] finalizing dead objects", gc_number);
+    // everything in the finalizer queue that didn't get relocated is dead
+    // and gets finalized. this is correct because, since the object did not
+    // relocate, it's still safe to refer to this object by its fromspace
+    // pointer. everything that did get relocated is still live, and
+    // its entry is updated to point to its new location. the queue is
+    // compacted in place as we go.
+    size_t live_count = 0;
+    for (Sexp *ptr : finalize_queue) {
+      Sexp *live = FinalizeIfDead(ptr);
+      if (live != nullptr) {
+        finalize_queue[live_count++] = live;
+      }
+    }
+
+    finalize_queue.resize(live_count);
+  }
+
+  // Finalizes the object that a finalizer queue entry refers to if it
+  // didn't survive the last collection, returning null. Otherwise, returns
+  // the object's current location.
+  Sexp *FinalizeIfDead(Sexp *ptr) {
+#ifdef CONSERVATIVE_GC
+    if (HeapPage::Of((uint64_t)ptr)->pinned == PINNED) {
+      // this object didn't move.
+      return ptr;
+    }
+#else
+    if ((uint8_t *)ptr >= tospace && (uint8_t *)ptr < top) {
+      // this object was allocated during an incremental collection.
+      return ptr;
+    }
+#endif
+
+    Value live = ForwardingAddress(ptr);
+    if (live == nullptr) {
+      DebugLog("[%d] finalizing object %p", gc_number, ptr);
+      FinalizeDead(ptr);
+      return nullptr;
+    }
+
+    DebugLog("[%d] finalizer queue relocation: %p -> %p", gc_number, ptr,
+             live.AsObject());
+    return live.AsObject();
+  }
+  // Copies everything reachable from the roots using all of the GC
+  // threads. The workers split up the roots by claiming a chunk of the
+  // root stack at a time, and then copy the transitive closure of what
+  // they found. A worker that runs out of objects to scan steals them
+  // from the others.
+  //
+  // Each worker copies into its own pages of tospace, so the only
+  // synchronization a copy needs is claiming the object, which is done
+  // by swinging its forwarding word to a busy marker with a CAS. The
+  // parts of the pages that don't get used are left as holes in tospace.
+  void ParallelTrace() {
+    DebugLog("[%d] tracing with %zu threads", gc_number, workers.size());
+    next_root.store(0);
+    idle_workers.store(0);
+    shared_free.store(free);
+    for (auto &worker : workers) {
+      ResetPages(worker->copy_pages);
+      worker->objects_copied = 0;
+      worker->objects_promoted = 0;
+    }
+
+    pool->Run([this](size_t id) { ParallelWorker(*workers[id]); });
+    free = shared_free.load();
+    for (auto &worker : workers) {
+      assert(worker->deque.Empty());
+      objects_copied += worker->objects_copied;
+      objects_promoted += worker->objects_promoted;
+    }
+  }
+
+  void ParallelWorker(GcWorker &self) {
+    auto process = [&](Value *ref) { ProcessParallel(self, ref); };
+    // the root stack is split into chunks that workers claim in turn.
+    const size_t chunk = 64;
+    size_t start;
+    while ((start = next_root.fetch_add(chunk)) < g_root_stack_top) {
+      size_t end = std::min(start + chunk, g_root_stack_top);
+      Frame::TraceRoots(start, end, [&](const char *, Value *root) {
+        if (root != nullptr) {
+          process(root);
+        }
+      });
+    }
+
+    if (self.id == 0) {
+      ScanCodeRoots(process);
+      ScanVmStack(process);
+    }
+
+    for (;;) {
+      Value ptr;
+      while ((ptr = self.deque.Pop()) != nullptr) {
+        ptr->TracePointers(process);
+      }
+
+      ptr = StealWork(self);
+      if (ptr != nullptr) {
+        ptr->TracePointers(process);
+        continue;
+      }
+
+      // this worker is out of work. only workers with work can create more
+      // of it, so once every worker is idle the collection is over.
+      idle_workers.fetch_add(1);
+      for (;;) {
+        if (idle_workers.load() == workers.size()) {
+          return;
+        }
+
+        if (AnyWork()) {
+          idle_workers.fetch_sub(1);
+          break;
+        }
+
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  Value StealWork(GcWorker &self) {
+    for (size_t i = 1; i < workers.size(); i++) {
+      GcWorker &victim = *workers[(self.id + i) % workers.size()];
+      Value ptr = victim.deque.Steal();
+      if (ptr != nullptr) {
+        return ptr;
+      }
+    }
+
+    return nullptr;
+  }
+
+  bool AnyWork() {
+    for (auto &worker : workers) {
+      if (!worker->deque.Empty()) {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  // The parallel version of Process.
+  void ProcessParallel(GcWorker &self, Value *ref) {
+    Value value = LoadField(ref);
+    if (!value.IsObject()) {
+      // null or an immediate.
+      return;
+    }
+
+    // this has to be checked before looking at the object, since
+    // another worker might still be copying it.
+    uint8_t *candidate = (uint8_t *)value.Bits();
+    if (candidate >= tospace && candidate < top) {
+      return;
+    }
+
+    if (InCodeSpace(value)) {
+      MarkCode(value);
+      return;
+    }
+
+    assert((candidate >= fromspace && candidate < fromspace + fromspace_size) ||
+           InNursery(value));
+    StoreField(ref, ForwardParallel(self, value));
+  }
+
+  // The parallel version of Forward and Copy. If another worker is in the
+  // middle of copying this object, this waits for it to finish.
+  Value ForwardParallel(GcWorker &self, Value from_ref) {
+    const uint64_t busy = forwarding_busy;
+    auto *forwarding_word =
+        reinterpret_cast<std::atomic<uint64_t> *>(ForwardingWord(from_ref));
+    uint64_t word = forwarding_word->load(std::memory_order_acquire);
+    if (!IsForwarded(word) &&
+        forwarding_word->compare_exchange_strong(word, busy,
+                                                 std::memory_order_acquire,
+                                                 std::memory_order_acquire)) {
+      // this worker claimed the object, so it gets to copy it.
+      Sexp::Kind kind = HeapPage::Of(from_ref.Bits())->kind;
+      size_t size = ObjectSize(kind, (uint8_t *)from_ref.Bits());
+      uint8_t *to = AllocateOnPage(self.copy_pages[kind], size);
+      if (to == nullptr) {
+        uint8_t *page = shared_free.fetch_add(PAGE_SIZE);
+        assert(page + PAGE_SIZE <= top);
+        self.copy_pages[kind] = InitPage(page, kind);
+        to = AllocateOnPage(self.copy_pages[kind], size);
+      }
+
+      memcpy(to, (uint8_t *)from_ref.Bits(), size);
+      RelocateStorage(kind, (uint8_t *)from_ref.Bits(), to);
+      // the copy picked up the busy marker, so the forwarding word's old
+      // value (the car, for a cons) has to be put back.
+      Value to_ref = Value::FromAddress(to);
+      *ForwardingWord(to_ref) = word;
+      self.objects_copied++;
+      if (InNursery(from_ref)) {
+        self.objects_promoted++;
+      }
+
+      forwarding_word->store(ForwardingWordTo(to), std::memory_order_release);
+      self.deque.Push(to_ref);
+      return to_ref;
+    }
+
+    while (word == busy) {
+      std::this_thread::yield();
+      word = forwarding_word->load(std::memory_order_acquire);
+    }
+
+    assert(IsForwarded(word));
+    return Value::FromAddress(ForwardedTo(word));
+  }
+
+  // Decides whether or not the semispaces should be resized, given
+  // the amount of data that survived the last collection, and resizes
+  // them if so.
+  //
+  // The heap grows whenever a collection leaves less than half of
+  // a semispace free, since a heap that is mostly live will collect
+  // often and copy a lot every time it does. It shrinks only after
+  // several collections in a row have found it to be mostly empty, so
+  // that a program with a bursty allocation pattern doesn't bounce
+  // between sizes.
+  void AdjustHeapSize() {
+    size_t live = UsedSize();
+    CheckSoftLimit(live);
+    live = SizingLiveSize(live);
+
+    // the heap grows as far as the RSS target as usual, and past that
+    // only when it's nearly full, trading more frequent collections for
+    // a smaller footprint. a heap that's over the target is shrunk as
+    // soon as what's live fits in a smaller one.
+    size_t soft_max = SoftMaxSize();
+    size_t new_size = tospace_size;
+    if (tospace_size > max_size) {
+      // a major collection went past the hard limit to make room for the
+      // nursery. the heap goes back under it as soon as it can.
+      if ((size_t)(free - tospace) <= max_size) {
+        low_occupancy_count = 0;
+        new_size = max_size;
+      }
+    } else if (live > tospace_size * GrowThreshold(tospace_size)) {
+      low_occupancy_count = 0;
+      while (live > new_size * GrowThreshold(new_size) &&
+             new_size < max_size) {
+        size_t cap = new_size < soft_max ? soft_max : max_size;
+        new_size = std::min(new_size * 2, cap);
+      }
+    } else if (tospace_size > soft_max &&
+               live < std::max(tospace_size / 2, soft_max) *
+                          target_grow_threshold) {
+      low_occupancy_count = 0;
+      new_size = std::max({tospace_size / 2, soft_max, min_size});
+    } else if (live < tospace_size * shrink_threshold &&
+               tospace_size > min_size) {
+      if (++low_occupancy_count >= shrink_delay) {
+        low_occupancy_count = 0;
+        new_size = std::max(tospace_size / 2, min_size);
+      }
+    } else {
+      low_occupancy_count = 0;
+    }
+
+    if (new_size != tospace_size) {
+      Resize(new_size);
+    }
+
+#ifdef CONSERVATIVE_GC
+    // the room set aside for pinned pages can take up all of a small
+    // semispace, leaving nowhere to allocate, in which case the heap is
+    // grown whatever the policy above decided.
+    SkipPinnedPages();
+    while (free + PAGE_SIZE > limit && tospace_size < max_size) {
+      Resize(std::min(tospace_size * 2, max_size));
+      SkipPinnedPages();
+    }
+#endif
+  }
+
+  // Resizes both semispaces. Live data is in tospace, so the (empty)
+  // fromspace is remapped at the new size, the live data is copied
+  // into it, and then the old tospace is remapped at the new size.
+  void Resize(size_t new_size) {
+    assert(new_size % PAGE_SIZE == 0);
+    assert((size_t)(free - tospace) <= new_size);
+    DebugLog("[%d] resizing semispaces: %zu -> %zu bytes", gc_number,
+             tospace_size, new_size);
+    SettleFromspace();
+
+    ReleaseFromspace();
+    fromspace = MapSpace(new_size);
+    fromspace_size = new_size;
+    fromspace_zeroed = true;
+    Scavenge();
+    ReleaseFromspace();
+    fromspace = MapSpace(new_size);
+    fromspace_size = new_size;
+    fromspace_zeroed = true;
+    resize_count++;
+    peak_size = std::max(peak_size, new_size);
+  }
+
+  // The amount of live data that the heap is sized for, given how much
+  // survived the last collection.
+  virtual size_t SizingLiveSize(size_t live) const { return live; }
+
+  bool InNursery(Value ptr) const {
+    return ptr.Bits() >= (uintptr_t)nursery_start &&
+           ptr.Bits() < (uintptr_t)nursery_end;
+  }
+
+  // Update a field with a reference to a tospace replica.
+  void Process(Value *ptr) {
+    // nothing to do for null pointers or immediates, which
+    // aren't managed by the GC.
+    if (ptr == nullptr || !ptr->IsObject()) {
+      return;
+    }
+
+    uint8_t *candidate = (uint8_t *)ptr->Bits();
+#ifdef CONSERVATIVE_GC
+    if (!InCodeSpace(*ptr)) {
+      uint16_t pin_state = HeapPage::Of(ptr->Bits())->pinned;
+      if (pin_state == PINNED) {
+        // the object stays where it is, and everything on its page is
+        // scanned already.
+        return;
+      }
+
+      if (pin_state == EVACUATING) {
+        // the page might be in tospace, but its objects still have to
+        // be copied out of it.
+        *ptr = Forward(*ptr);
+        return;
+      }
+    }
+#endif
+    if (candidate >= tospace && candidate < top) {
+      // if this pointer points into tospace, that means
+      // we've already relocated it and updated the pointer.
+      // we don't need to process it again.
+      // in fact, we /can't/ process it again, because if we
+      // do, it'll get moved to some other garbage location.
+      return;
+    }
+
+    if (InCodeSpace(*ptr)) {
+      // the code space doesn't move, but its compilation unit is in use.
+      MarkCode(*ptr);
+      return;
+    }
+
+    assert((candidate >= fromspace && candidate < fromspace + fromspace_size) ||
+           InNursery(*ptr));
+    *ptr = Forward(*ptr);
+  }
+
+  // Copies an object from fromspace to tospace, returning
+  // the forwarded pointer to this object. Objects that have already
+  // been copied have their new location stored in their forwarding word.
+  Value Forward(Value ptr) {
+    Value to_ref = ForwardingAddress(ptr);
+    if (to_ref == nullptr) {
+      // this reference hasn't been copied yet. do it.
+      to_ref = Copy(ptr);
+    }
+
+    // DebugLog("processed value: %s", to_ref->DumpString().c_str());
+    assert(to_ref != nullptr);
+    return to_ref;
+  }
+
+  // Copy an object and return its forwarding address.
+  Value Copy(Value from_ref) {
+    Sexp::Kind kind = HeapPage::Of(from_ref.Bits())->kind;
+#ifdef DEBUG
+    assert(kind < Sexp::kind_count && "relocating an invalid object");
+#endif
+    size_t size = ObjectSize(kind, (uint8_t *)from_ref.Bits());
+    uint8_t *to = AllocateOnPage(copy_pages[kind], size);
+    if (to == nullptr) {
+      SkipPinnedPages();
+      assert(free + PAGE_SIZE <= limit);
+      copy_pages[kind] = InitPage(free, kind);
+      free += PAGE_SIZE;
+      to = AllocateOnPage(copy_pages[kind], size);
+    }
+
+    // this copy is guaranteed not to overlap since it
+    // doesn't cross the fromspace/tospace boundary.
+    DebugLog("[%d] relocating: %p -> %p", gc_number, from_ref.Bits(), to);
+    memcpy(to, (uint8_t *)from_ref.Bits(), size);
+    RelocateStorage(kind, (uint8_t *)from_ref.Bits(), to);
+    objects_copied++;
+    if (InNursery(from_ref)) {
+      objects_promoted++;
+    }
+
+    // the fromspace object stays intact, apart from its forwarding word,
+    // until the end of the GC so that the finalizer queue can still be
+    // inspected.
+    *ForwardingWord(from_ref) = ForwardingWordTo(to);
+    Value to_ref = Value::FromAddress(to);
+    worklist.push_back(to_ref);
+    return to_ref;
+  }
+
+  // Moves free past any pinned pages, which are still in use. Pages are
+  // never pinned in a precise build, so this does nothing there.
+  void SkipPinnedPages() {
+#ifdef CONSERVATIVE_GC
+    while (free < limit && IsPinnedPage(free)) {
+      free += PAGE_SIZE;
+    }
+#endif
+  }
+
+  // Unmaps fromspace. In a conservative build, the pages in it that are
+  // pinned are still in use, so they are left mapped on their own.
+  void ReleaseFromspace() {
+    WaitForHelper();
+    ForEachUnpinnedRun(
+        [](uint8_t *start, size_t size) { UnmapTheHeap(start, size); });
+  }
+
+  // Gives the memory behind fromspace back to the OS once nothing in it
+  // is needed anymore, so that a process only pays for one semispace
+  // between collections.
+  void DecommitFromspace() {
+#ifdef DEBUG
+    if (heap_verify) {
+      return;
+    }
+#endif
+
+    // a page that is pinned keeps its objects, and once they're evacuated
+    // they're left on it, so fromspace is only all zero without any.
+    size_t decommitted = 0;
+    ForEachUnpinnedRun([&](uint8_t *start, size_t size) {
+      Decommit(start, size);
+      decommitted += size;
+    });
+    fromspace_zeroed = decommitted == fromspace_size;
+    // this is handed off right away, since fromspace might be unmapped
+    // before the pause is over.
+    HandOff();
+  }
+
+  // Calls func with the start and size of each run of fromspace pages that
+  // isn't pinned. Outside of the conservative build, that's all of it.
+  template <typename F> void ForEachUnpinnedRun(F func) {
+#ifdef CONSERVATIVE_GC
+    uint8_t *start = fromspace;
+    uint8_t *end = fromspace + fromspace_size;
+    for (HeapPage *page : pinned_pages) {
+      uint8_t *address = reinterpret_cast<uint8_t *>(page);
+      if (address < fromspace || address >= end) {
+        continue;
+      }
+
+      if (address > start) {
+        func(start, address - start);
+      }
+
+      start = address + PAGE_SIZE;
+    }
+
+    if (end > start) {
+      func(start, end - start);
+    }
+#else
+    func(fromspace, fromspace_size);
+#endif
+  }
+
+  // The fraction of a heap of the given size that has to be live for it
+  // to be grown.
+  double GrowThreshold(size_t size) const {
+    if (HasSoftMax() && size >= SoftMaxSize()) {
+      return target_grow_threshold;
+    }
+
+    return grow_threshold;
+  }
+
+  // Fills fromspace with garbage once nothing in it is live anymore.
+  void PoisonFromspace() {
+#ifdef CONSERVATIVE_GC
+    for (uint8_t *page = fromspace; page < fromspace + fromspace_size;
+         page += PAGE_SIZE) {
+      if (!IsPinnedPage(page)) {
+        memset(page, 0xAB, PAGE_SIZE);
+      }
+    }
+#else
+    memset(fromspace, 0xAB, fromspace_size);
+#endif
+  }
+
+#ifdef CONSERVATIVE_GC
+  bool IsPinnedPage(uint8_t *address) const {
+    return std::binary_search(pinned_pages.begin(), pinned_pages.end(),
+                              reinterpret_cast<HeapPage *>(address));
+  }
+
+  // Pins every page that a word on the native stack might point into, and
+  // marks every compilation unit that one might point into. This has to
+  // be done before the flip. The pages that the last collection pinned are
+  // evacuated, unless they get pinned again.
+  void PinAmbiguousRoots() {
+    for (HeapPage *page : pinned_pages) {
+      page->pinned = EVACUATING;
+    }
+
+    newly_pinned.clear();
+    ScanNativeStack();
+    DebugLog("[%d] pinned %zu pages", gc_number, newly_pinned.size());
+  }
+
+  // Returns the frame address of a function that was called by the
+  // caller, which is below everything that the caller has on the stack.
+  __attribute__((noinline)) static void *NativeStackTop() {
+    return __builtin_frame_address(0);
+  }
+
+  __attribute__((noinline)) void ScanNativeStack() {
+    // spill the callee-saved registers onto the stack, so that pointers
+    // that only live in a register are seen too.
+    __builtin_unwind_init();
+    assert(g_stack_base != nullptr);
+    uintptr_t top = reinterpret_cast<uintptr_t>(NativeStackTop());
+    top = (top + sizeof(uintptr_t) - 1) & ~(sizeof(uintptr_t) - 1);
+    auto *end = reinterpret_cast<uintptr_t *>(g_stack_base);
+    for (auto *word = reinterpret_cast<uintptr_t *>(top); word < end;
+         word++) {
+      PinIfHeapPointer(*word);
+    }
+  }
+
+  // Looks at a word that might be a pointer to, or into, an object.
+  void PinIfHeapPointer(uintptr_t word) {
+    uint8_t *address = reinterpret_cast<uint8_t *>(word);
+    HeapPage *page = HeapPage::Of(word);
+    uint8_t *page_start = reinterpret_cast<uint8_t *>(page);
+    if ((page_start >= tospace && page_start < free) ||
+        IsPinnedPage(page_start)) {
+      if (address < page->Begin() || address >= page->End()) {
+        return;
+      }
+
+      if (page->pinned != PINNED) {
+        page->pinned = PINNED;
+        newly_pinned.push_back(page);
+      }
+
+      return;
+    }
+
+    if (address >= code_space && address < code_free) {
+      // a freed page might still name the unit it used to belong to, but
+      // marking a unit that is dead by mistake only keeps it around longer.
+      if (page->unit < units.size() && units[page->unit] != nullptr) {
+        units[page->unit]->marked.store(true, std::memory_order_relaxed);
+      }
+
+      return;
+    }
+
+    auto chunk = arena_chunks.upper_bound(address);
+    if (chunk != arena_chunks.begin()) {
+      --chunk;
+      if (address < chunk->second.first) {
+        units[chunk->second.second]->marked.store(true,
+                                                 std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Puts every object on the newly pinned pages on the worklist. They
+  // don't move, so they're only scanned.
+  void ScanPinnedPages() {
+    for (HeapPage *page : newly_pinned) {
+      uint8_t *end = page->End();
+      for (uint8_t *obj = page->Begin(); obj < end;
+           obj += ObjectSize(page->kind, obj)) {
+        worklist.push_back(Value::FromAddress(obj));
+      }
+    }
+  }
+
+  // Called at the end of a collection. The pages that were evacuated are
+  // emptied, or unmapped if their semispace has been unmapped already, and
+  // the newly pinned pages take their place.
+  void FinishPinning() {
+    for (HeapPage *page : pinned_pages) {
+      if (page->pinned != EVACUATING) {
+        continue;
+      }
+
+      uint8_t *address = reinterpret_cast<uint8_t *>(page);
+      if (address >= tospace && address < top) {
+        // the page might be below free, so it's left as an empty page.
+        InitPage(address, page->kind);
+      } else if (address >= fromspace && address < fromspace + fromspace_size) {
+        page->pinned = UNPINNED;
+      } else {
+        UnmapTheHeap(address, PAGE_SIZE);
+      }
+    }
+
+    std::sort(newly_pinned.begin(), newly_pinned.end());
+    pinned_pages.swap(newly_pinned);
+    newly_pinned.clear();
+    pinned_count += pinned_pages.size();
+
+    // the pages pinned outside of tospace can sit in the semispace that the
+    // next collection copies into, so room is set aside for them twice:
+    // once for the page itself, and once for the objects that might have to
+    // be copied out of it.
+    size_t outside = std::count_if(
+        pinned_pages.begin(), pinned_pages.end(), [&](HeapPage *page) {
+          uint8_t *address = reinterpret_cast<uint8_t *>(page);
+          return address < tospace || address >= top;
+        });
+    limit = top - std::min(2 * outside * PAGE_SIZE, (size_t)(top - free));
+  }
+#endif
+
+  // Flips the fromspace and tospace during a GC.
+  void Flip() {
+    WaitForHelper();
+    std::swap(fromspace, tospace);
+    std::swap(fromspace_size, tospace_size);
+    tospace_zeroed = fromspace_zeroed;
+    fromspace_zeroed = false;
+    top = tospace + tospace_size;
+    free = tospace;
+    limit = top;
+    ResetPages(alloc_pages);
+    ResetPages(copy_pages);
+  }
+
+  void DumpCollectorStatistics(std::ostream &out) override {
+    using std::chrono::duration;
+    double scavenge_seconds = duration<double>(total_scavenge).count();
+    out << "gc: " << objects_copied << " objects copied, "
+        << (size_t)(scavenge_seconds > 0 ? objects_copied / scavenge_seconds
+                                         : 0)
+        << " objects copied per second" << std::endl;
+#ifdef CONSERVATIVE_GC
+    out << "gc: " << pinned_count << " pages pinned" << std::endl;
+#endif
+    out << "gc: " << resize_count << " resizes, " << tospace_size / 1024
+        << " kb semispace, " << peak_size / 1024 << " kb peak semispace"
+        << std::endl;
+  }
+
+#ifdef DEBUG
+  void AddVerifyRoots(std::vector<Value> &stack) override {
+    Collector::AddVerifyRoots(stack);
+#ifdef CONSERVATIVE_GC
+    // everything on a pinned page is treated as live.
+    for (HeapPage *page : pinned_pages) {
+      assert(page->pinned == PINNED && "pinned page isn't pinned!");
+      for (uint8_t *obj = page->Begin(); obj < page->End();
+           obj += ObjectSize(page->kind, obj)) {
+        stack.push_back(Value::FromAddress(obj));
+      }
+    }
+#endif
+  }
+
+  bool InHeap(Value ptr) const override {
+    uint8_t *address = (uint8_t *)ptr.Bits();
+#ifdef CONSERVATIVE_GC
+    if (IsPinnedPage((uint8_t *)HeapPage::Of(ptr.Bits()))) {
+      return true;
+    }
+#endif
+
+    return (address >= tospace && address < free) ||
+           (address >= limit && address < top);
+  }
+#endif
+};
+
+// The generational collector puts a small nursery in front of the
+// semispaces, which become the old generation, and allocates objects in
+// the nursery instead. A minor collection copies the objects that survive
+// the nursery into the old generation, treating the roots and the old
+// objects recorded by the write barrier (the "remembered set") as the only
+// references into the nursery. A major collection is a normal semispace collection that
+// evacuates the nursery as well. Every object that survives a minor
+// collection is promoted, so the nursery is always empty after a GC.
+class GenerationalCollector : public SemispaceCollector {
+private:
+  uint8_t *nursery;
+  size_t nursery_size;
+  uint8_t *nursery_free;
+  HeapPage *young_pages[Sexp::kind_count];
+  std::vector<Sexp *> nursery_finalize_queue;
+  // The pages of the old generation that might point into the nursery.
+  std::vector<HeapPage *> remembered_set;
+  size_t minor_count;
+
+public:
+  GenerationalCollector(const Options &options)
+      : SemispaceCollector(options) {
+    nursery_size = options.nursery_size;
+    assert(nursery_size % PAGE_SIZE == 0);
+    nursery = MapTheHeap(nursery_size / PAGE_SIZE);
+    nursery_free = nursery;
+    nursery_start = nursery;
+    nursery_end = nursery + nursery_size;
+    ResetPages(young_pages);
+    minor_count = 0;
+  }
+
+  ~GenerationalCollector() {
+    helper.reset();
+    UnmapTheHeap(nursery, nursery_size);
+  }
+
+  uint8_t *NurseryStart() const override { return nursery; }
+  uint8_t *NurseryEnd() const override { return nursery + nursery_size; }
+
+  // Allocates an object from the nursery, triggering a minor
+  // collection if the nursery is full.
+  uint8_t *AllocateObject(Sexp::Kind kind, size_t size,
+                          bool should_finalize) override {
+#ifdef DEBUG
+    if (stress) {
+      CollectYoung();
+    }
+#endif
+
+    uint8_t *result = AllocateOnPage(young_pages[kind], size);
+    if (result == nullptr) {
+      if (nursery_free + PAGE_SIZE > nursery + nursery_size) {
+        DebugLog("nursery alloc failed, triggering a minor GC");
+        CollectYoung();
+
+        // every collection leaves the nursery empty.
+        assert(nursery_free == nursery);
+        if ((size_t)(free - tospace) > max_size) {
+          // a major collection had to go past the hard limit to make
+          // room for the nursery, and more survived than fits under it.
+          OutOfMemory();
+        }
+      }
+
+      // the nursery is reused as soon as it's been collected, so there's
+      // no time to zero it ahead of time.
+      young_pages[kind] = StartAllocPage(nursery_free, kind, false);
+      nursery_free += PAGE_SIZE;
+      result = AllocateOnPage(young_pages[kind], size);
+    }
+
+    if (should_finalize) {
+      DebugLog("marking object %p for finalization", result);
+      nursery_finalize_queue.push_back((Sexp *)result);
+    }
+
+    return result;
+  }
+
+  HeapPage *InlineAllocPage(Sexp::Kind kind) override {
+    return young_pages[kind];
+  }
+
+  // A major collection is a normal semispace collection that evacuates
+  // the nursery as well.
+  void Collect() override {
+    EnsureRoomForNursery();
+    SemispaceCollector::Collect();
+  }
+
+  // Performs a minor collection, promoting everything that is live in
+  // the nursery. If the old generation might not have enough room for
+  // everything in the nursery, this does a major collection instead.
+  void CollectYoung() {
+    if ((size_t)(top - free) < (size_t)(nursery_free - nursery)) {
+      DebugLog("old generation is full, triggering a major GC");
+      Collect();
+      return;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+#ifdef DEBUG
+    if (heap_verify) {
+      VerifyHeap();
+    }
+#endif
+
+    auto scavenge_start = std::chrono::steady_clock::now();
+    gc_number++;
+    minor_count++;
+    DebugLog("[%d] beginning a minor GC", gc_number);
+    assert(worklist.empty());
+    ScanRoots([&](Value *ptr) { ProcessYoung(ptr); });
+    ScanCodeRoots([&](Value *ptr) { ProcessYoung(ptr); });
+
+    // the remembered set holds every old page that might point into
+    // the nursery. after this GC, none of them will. objects that are
+    // promoted onto one of these pages while it's being scanned are on
+    // the worklist already, so they don't need to be scanned here.
+    DebugLog("[%d] processing remembered set", gc_number);
+    for (HeapPage *page : remembered_set) {
+      page->remembered = 0;
+      uint8_t *end = page->End();
+      for (uint8_t *obj = page->Begin(); obj < end;
+           obj += ObjectSize(page->kind, obj)) {
+        Value::FromAddress(obj)->TracePointers(
+            [&](Value *ref) { ProcessYoung(ref); });
+      }
+    }
+
+    remembered_set.clear();
+    DebugLog("[%d] draining worklist", gc_number);
+    DrainWorklist([&](Value *ref) { ProcessYoung(ref); });
+
+    FinalizeNursery();
+    DebugLog("[%d] minor GC complete", gc_number);
+    total_scavenge += std::chrono::steady_clock::now() - scavenge_start;
+
+#ifdef DEBUG
+    if (heap_verify) {
+      VerifyHeap();
+    }
+#endif
+
+    RecordPause(std::chrono::steady_clock::now() - start);
+  }
+
+  void Scavenge() override {
+    SemispaceCollector::Scavenge();
+    // everything in the nursery has been evacuated along with the
+    // old generation, so nothing old points into the nursery anymore.
+    // the pages that remembered objects were copied onto start out
+    // unremembered.
+    remembered_set.clear();
+    FinalizeNursery();
+  }
+
+  size_t UsedSize() const override {
+    return SemispaceCollector::UsedSize() + (nursery_free - nursery);
+  }
+
+  // The old generation has to be able to absorb a full nursery, so the
+  // size of the nursery counts as live.
+  size_t SizingLiveSize(size_t live) const override {
+    return live + nursery_size;
+  }
+
+  // A major collection copies the live parts of both the nursery and the
+  // old generation into fromspace, which might not be big enough to hold
+  // them. If that's the case, fromspace is grown before the collection.
+  void EnsureRoomForNursery() {
+    size_t needed = (free - tospace) + (nursery_free - nursery);
+    if (needed <= fromspace_size) {
+      return;
+    }
+
+    // a collection can't be given up on halfway through, so if everything
+    // in the nursery might not fit under the hard limit, this one goes
+    // past it. the allocation that needed it fails afterwards if what
+    // survived still doesn't fit.
+    size_t new_size = fromspace_size;
+    while (new_size < needed) {
+      new_size = std::min(new_size * 2, std::max(max_size, needed));
+    }
+
+    DebugLog("[%d] growing fromspace for a major GC: %zu -> %zu bytes",
+             gc_number, fromspace_size, new_size);
+    ReleaseFromspace();
+    fromspace = MapSpace(new_size);
+    fromspace_size = new_size;
+    fromspace_zeroed = true;
+    resize_count++;
+    peak_size = std::max(peak_size, new_size);
+  }
+
+  // Finalizes the dead objects in the nursery once everything live has
+  // been evacuated, and then empties the nursery.
+  void FinalizeNursery() {
+    for (Sexp *ptr : nursery_finalize_queue) {
+      Value live = ForwardingAddress(ptr);
+      if (live == nullptr) {
+        DebugLog("[%d] finalizing young object %p", gc_number, ptr);
+        FinalizeDead(ptr);
+        continue;
+      }
+
+      finalize_queue.push_back(live.AsObject());
+    }
+
+    nursery_finalize_queue.clear();
+#ifdef DEBUG
+    memset(nursery, 0xAB, nursery_size);
+#endif
+    nursery_free = nursery;
+    ResetPages(young_pages);
+  }
+
+  // Update a field with a reference to the promoted copy of a young
+  // object. Pointers to anything other than the nursery are left alone.
+  void ProcessYoung(Value *ptr) {
+    if (ptr == nullptr || !InNursery(*ptr)) {
+      return;
+    }
+
+    *ptr = Forward(*ptr);
+  }
+
+  void RememberPage(HeapPage *page) override {
+    remembered_set.push_back(page);
+  }
+
+  void DumpCollectorStatistics(std::ostream &out) override {
+    out << "gc: " << minor_count << " minor collections, "
+        << gc_number - minor_count << " major collections, "
+        << objects_promoted << " objects promoted" << std::endl;
+    SemispaceCollector::DumpCollectorStatistics(out);
+  }
+
+#ifdef DEBUG
+  void AddVerifyRoots(std::vector<Value> &stack) override {
+    assert(std::none_of(finalize_queue.begin(), finalize_queue.end(),
+                        [&](Sexp *ptr) { return InNursery(ptr); }) &&
+           "young object in the old finalize queue!");
+    SemispaceCollector::AddVerifyRoots(stack);
+    for (Sexp *ptr : nursery_finalize_queue) {
+      assert(InNursery(ptr) && "old object in the nursery finalize queue!");
+      stack.push_back(ptr);
+    }
+  }
+
+  bool InHeap(Value ptr) const override {
+    uint8_t *address = (uint8_t *)ptr.Bits();
+    return SemispaceCollector::InHeap(ptr) ||
+           (address >= nursery && address < nursery_free);
+  }
+
+  // every old object that points into the nursery has to be in the
+  // remembered set.
+  bool MustBeRemembered(Value from, Value to) const override {
+    return (InNursery(to) && !InNursery(from)) ||
+           SemispaceCollector::MustBeRemembered(from, to);
+  }
+#endif
+};
+
+// The incremental collector spreads a semispace collection out over many
+// short pauses instead. The collection starts by copying the objects that
+// the roots point to, and then the rest of the copying is done a slice at a time
+// as the interpreter allocates. The read barrier (GC_READ_BARRIER) copies
+// any object that the interpreter loads a pointer to before the collector
+// gets to it, so that the interpreter never sees an object in fromspace.
+// Objects allocated during a collection are placed at the top of tospace,
+// and since they can only point to objects in tospace, they're never
+// scanned. This is Baker's algorithm.
+class IncrementalCollector : public SemispaceCollector {
+private:
+  // The number of allocations between two slices of an incremental
+  // collection.
+  const size_t slice_interval = 256;
+  const size_t stress_slice_interval = 8;
+
+  // While a collection is in progress, the objects that have been copied
+  // but not scanned are on the worklist, and the objects that are yet to be
+  // copied will end up between free and reserve_end, so allocation must
+  // not go below reserve_end.
+  bool collecting;
+  uint8_t *reserve_end;
+  std::chrono::steady_clock::duration max_slice;
+  size_t slice_countdown;
+  std::vector<Sexp *> finalize_pending;
+  size_t slice_count;
+  size_t forced_finish_count;
+
+public:
+  IncrementalCollector(const Options &options) : SemispaceCollector(options) {
+    collecting = false;
+    reserve_end = nullptr;
+    max_slice = std::chrono::microseconds(options.gc_max_pause_us);
+    slice_countdown = 0;
+    slice_count = 0;
+    forced_finish_count = 0;
+  }
+
+  // Allocates an object in incremental mode. A collection is started
+  // when half of the semispace is in use, and is then advanced a slice at a
+  // time as objects are allocated. Until it finishes, anything in fromspace
+  // might have to be copied, so the other half of tospace is all that the
+  // program has to allocate into.
+  uint8_t *AllocateObject(Sexp::Kind kind, size_t size,
+                          bool should_finalize) override {
+    size_t used = UsedSize();
+    bool needs_page = alloc_pages[kind] == nullptr ||
+                      alloc_pages[kind]->end + size > PAGE_SIZE;
+    if (!collecting && ((needs_page && used + PAGE_SIZE > tospace_size / 2)
+#ifdef DEBUG
+                        || stress
+#endif
+                        )) {
+      DebugLog("half of the heap is used, starting a collection");
+      StartCollection();
+    }
+
+    if ((collecting || !finalize_pending.empty()) && --slice_countdown == 0) {
+      if (collecting) {
+        CollectionSlice();
+      } else {
+        FinalizationSlice();
+      }
+    }
+
+    uint8_t *result = AllocateOnPage(alloc_pages[kind], size);
+    if (result == nullptr) {
+      if (collecting && (size_t)(limit - reserve_end) < PAGE_SIZE) {
+        // there's no room for another page without risking running out of
+        // room for the objects that still have to be copied, so the rest
+        // of the collection has to be done now.
+        DebugLog("[%d] out of room, finishing the collection", gc_number);
+        auto start = std::chrono::steady_clock::now();
+        forced_finish_count++;
+        FinishCollection();
+        RecordPause(std::chrono::steady_clock::now() - start);
+      }
+
+      if (collecting) {
+        // objects allocated during a collection go on pages at the top
+        // of tospace.
+        limit -= PAGE_SIZE;
+        alloc_pages[kind] = StartAllocPage(limit, kind, tospace_zeroed);
+      } else {
+        if (free + PAGE_SIZE > limit) {
+          OutOfMemory();
+        }
+
+        alloc_pages[kind] = StartAllocPage(free, kind, tospace_zeroed);
+        free += PAGE_SIZE;
+      }
+
+      result = AllocateOnPage(alloc_pages[kind], size);
+    }
+
+    if (should_finalize) {
+      DebugLog("marking object %p for finalization", result);
+      finalize_queue.push_back((Sexp *)result);
+    }
+
+    return result;
+  }
+
+  HeapPage *InlineAllocPage(Sexp::Kind kind) override {
+    if (collecting || !finalize_pending.empty()) {
+      // every allocation might have to do a slice of the work.
+      return nullptr;
+    }
+
+    return alloc_pages[kind];
+  }
+
+  // A full collection that is asked for while an incremental one is
+  // already in progress only has to finish it.
+  void Collect() override {
+    if (!collecting) {
+      SemispaceCollector::Collect();
+      return;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    FinishCollection();
+    RecordPause(std::chrono::steady_clock::now() - start);
+  }
+
+  void StartFullCollection() override {
+    if (!collecting) {
+      StartCollection();
+    }
+  }
+
+  // Starts an incremental collection by flipping the semispaces and
+  // copying the objects that the roots point to.
+  void StartCollection() {
+    auto start = std::chrono::steady_clock::now();
+#ifdef DEBUG
+    if (heap_verify) {
+      VerifyHeap();
+    }
+#endif
+
+    if (!finalize_pending.empty()) {
+      FinishFinalization();
+    }
+
+    gc_number++;
+    DebugLog("[%d] beginning an incremental GC", gc_number);
+    assert(worklist.empty());
+    size_t used = UsedSize();
+    Flip();
+    reserve_end = tospace + used;
+    collecting = true;
+    g_condemned_start = fromspace;
+    g_condemned_end = fromspace + fromspace_size;
+    ResetCodeMarks();
+    ScanRoots([&](Value *ptr) { Process(ptr); });
+    ScanCodeRoots([&](Value *ptr) { Process(ptr); });
+    ResetSliceCountdown();
+    auto pause = std::chrono::steady_clock::now() - start;
+    total_scavenge += pause;
+    RecordPause(pause);
+  }
+
+  // Scans objects on the worklist until there are none left, or until
+  // the pause budget runs out.
+  void CollectionSlice() {
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start + max_slice;
+    size_t scanned = 0;
+    while (!worklist.empty()) {
+      Value ptr = worklist.back();
+      worklist.pop_back();
+      ptr->TracePointers([&](Value *ref) { Process(ref); });
+      scanned++;
+#ifdef DEBUG
+      if (stress) {
+        // scan as little as possible, so that the interpreter runs in
+        // between as many steps of the collection as it can.
+        break;
+      }
+#endif
+
+      // reading the clock isn't free, so it's only done every so often.
+      if (scanned % 32 == 0 && std::chrono::steady_clock::now() >= deadline) {
+        break;
+      }
+    }
+
+    DebugLog("[%d] slice scanned %zu objects", gc_number, scanned);
+    slice_count++;
+    total_scavenge += std::chrono::steady_clock::now() - start;
+    if (worklist.empty()) {
+      FinishCollection();
+    } else {
+      ResetSliceCountdown();
+    }
+
+    RecordPause(std::chrono::steady_clock::now() - start);
+  }
+
+  // Finishes an incremental collection, scanning whatever is left on
+  // the worklist.
+  void FinishCollection() {
+    assert(collecting);
+    auto start = std::chrono::steady_clock::now();
+    while (!worklist.empty()) {
+      Value ptr = worklist.back();
+      worklist.pop_back();
+      ptr->TracePointers([&](Value *ref) { Process(ref); });
+    }
+
+    // the roots weren't looked at since the collection started, so they
+    // might hold the only pointers to some compilation units. everything
+    // else that points into the code space has been seen by now, either
+    // by the collector or by the write barrier.
+    ScanRoots([&](Value *ptr) {
+      if (InCodeSpace(*ptr)) {
+        MarkCode(*ptr);
+      }
+    });
+    SweepCodeUnits();
+
+    // finalizing the dead objects can take a while, so it's done
+    // in slices too.
+    assert(finalize_pending.empty());
+    finalize_pending.swap(finalize_queue);
+    if (finalize_pending.empty()) {
+      FinishFinalization();
+    }
+
+    ResetSliceCountdown();
+    collecting = false;
+    g_condemned_start = nullptr;
+    g_condemned_end = nullptr;
+    DebugLog("[%d] incremental GC complete", gc_number);
+    total_scavenge += std::chrono::steady_clock::now() - start;
+    AdjustHeapSize();
+
+#ifdef DEBUG
+    if (heap_verify) {
+      VerifyHeap();
+    }
+#endif
+  }
+
+  void ResetSliceCountdown() {
+    slice_countdown = slice_interval;
+#ifdef DEBUG
+    if (stress) {
+      // in stress mode, slices are small and frequent, but not so frequent
+      // that the interpreter never gets ahead of the collector.
+      slice_countdown = stress_slice_interval;
+    }
+#endif
+  }
+
+  // Called by the read barrier when the interpreter loads a pointer to
+  // an object that hasn't been copied yet.
+  Value ForwardField(Value *field) override {
+    assert(collecting);
+    *field = Forward(*field);
+    return *field;
+  }
+
+  // Finalizes some of the entries that were in the finalizer queue when
+  // the last incremental collection finished, stopping when the pause
+  // budget runs out.
+  void FinalizationSlice() {
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start + max_slice;
+    size_t processed = 0;
+    while (!finalize_pending.empty()) {
+      Sexp *live = FinalizeIfDead(finalize_pending.back());
+      finalize_pending.pop_back();
+      if (live != nullptr) {
+        finalize_queue.push_back(live);
+      }
+
+      processed++;
+      if (processed % 32 == 0 && std::chrono::steady_clock::now() >= deadline) {
+        break;
+      }
+    }
+
+    if (finalize_pending.empty()) {
+      FinishFinalization();
+    } else {
+      ResetSliceCountdown();
+    }
+
+    RecordPause(std::chrono::steady_clock::now() - start);
+  }
+
+  // Finalizes everything left over from the last incremental collection.
+  // This has to be done before fromspace is used again.
+  void FinishFinalization() {
+    for (Sexp *ptr : finalize_pending) {
+      Sexp *live = FinalizeIfDead(ptr);
+      if (live != nullptr) {
+        finalize_queue.push_back(live);
+      }
+    }
+
+    finalize_pending.clear();
+#ifdef DEBUG
+    // now that the finalizer is done with the objects in fromspace,
+    // they can be poisoned.
+    memset(fromspace, 0xAB, fromspace_size);
+#endif
+    DecommitFromspace();
+  }
+
+  void SettleFromspace() override {
+    if (!finalize_pending.empty()) {
+      FinishFinalization();
+    }
+  }
+
+  // Only half of the heap can be used before a collection has to start,
+  // so the heap is sized as if it were half as big.
+  size_t SizingLiveSize(size_t live) const override { return live * 2; }
+
+  void DumpCollectorStatistics(std::ostream &out) override {
+    out << "gc: " << slice_count << " slices, " << forced_finish_count
+        << " forced finishes" << std::endl;
+    SemispaceCollector::DumpCollectorStatistics(out);
+  }
+};
+
+// The state shared by the collectors that mark objects in place: the
+// mark-sweep and mark-region collectors. Their heap is a single reserved
+// range of pages, of which mark_pages are in use. Objects are marked in a
+// bitmap that has a bit for every word of the heap.
+class MarkCollector : public Collector {
+protected:
+  // What the collectors that mark in place know about each page of their
+  // space.
+  struct MarkPageInfo {
+    // The size class of a mark-sweep page.
+    uint8_t size_class;
+    // The number of lines of a mark-region page that were in use after
+    // the last collection.
+    uint8_t live_lines;
+    // Set while a mark-region collection is evacuating the page.
+    bool evacuating;
+  };
+
+  uint8_t *mark_space;
+  size_t mark_space_size;
+  uint8_t *mark_free;
+  std::vector<HeapPage *> mark_pages;
+  std::vector<uint8_t *> mark_free_pages;
+  // Free pages whose memory has been given back to the OS. These are
+  // only used once the other free pages have run out.
+  std::vector<uint8_t *> mark_decommitted_pages;
+  // The info of every page that has been handed out, by index.
+  std::vector<MarkPageInfo> mark_page_info;
+  std::vector<uint64_t> mark_bits;
+  // A collection is done before the heap grows past this many pages.
+  size_t mark_page_budget;
+
+  // The pages that objects of each kind are bump-allocated on, if any.
+  HeapPage *alloc_pages[Sexp::kind_count];
+  size_t objects_marked;
+
+public:
+  MarkCollector(const Options &options) : Collector(options) {
+    // the whole heap is reserved up front, since it doesn't have to be
+    // copied into a new space to grow. the OS only hands out memory for
+    // the pages that get used.
+    mark_space = MapSpace(max_size);
+    mark_space_size = max_size;
+    mark_free = mark_space;
+    mark_page_budget = options.heap_initial_size / PAGE_SIZE;
+    ResetPages(alloc_pages);
+    objects_marked = 0;
+  }
+
+  ~MarkCollector() {
+    helper.reset();
+    UnmapTheHeap(mark_space, mark_space_size);
+  }
+
+  void Collect() override {
+    auto start = std::chrono::steady_clock::now();
+#ifdef DEBUG
+    if (heap_verify) {
+      VerifyHeap();
+    }
+#endif
+
+    CollectInPlace();
+
+#ifdef DEBUG
+    if (heap_verify) {
+      VerifyHeap();
+    }
+#endif
+
+    RecordPause(std::chrono::steady_clock::now() - start);
+  }
+
+  // Marks everything that is reachable and reclaims the rest, which is
+  // what a collection does apart from verifying the heap.
+  virtual void CollectInPlace() = 0;
+
+  // Starts a new page of the given kind in the space of a collector that
+  // marks in place, returning null if the heap can't get any bigger.
+  HeapPage *NewMarkPage(Sexp::Kind kind) {
+    uint8_t *address;
+    if (!mark_free_pages.empty()) {
+      address = mark_free_pages.back();
+      mark_free_pages.pop_back();
+    } else if (!mark_decommitted_pages.empty()) {
+      WaitForHelper();
+      address = mark_decommitted_pages.back();
+      mark_decommitted_pages.pop_back();
+    } else {
+      if (mark_free + PAGE_SIZE > mark_space + mark_space_size) {
+        return nullptr;
+      }
+
+      address = mark_free;
+      mark_free += PAGE_SIZE;
+      size_t words = (mark_free - mark_space) / sizeof(uint64_t);
+      mark_bits.resize((words + 63) / 64);
+      mark_page_info.resize((mark_free - mark_space) / PAGE_SIZE);
+    }
+
+    HeapPage *page = InitPage(address, kind);
+    InfoOf(page) = MarkPageInfo();
+    mark_pages.push_back(page);
+    peak_size = std::max(peak_size, mark_pages.size() * PAGE_SIZE);
+    return page;
+  }
+
+  MarkPageInfo &InfoOf(HeapPage *page) {
+    return mark_page_info[((uint8_t *)page - mark_space) / PAGE_SIZE];
+  }
+
+  bool InMarkSpace(Value ptr) const {
+    return ptr.Bits() >= (uintptr_t)mark_space && ptr.Bits() < (uintptr_t)mark_free;
+  }
+
+  bool IsMarked(uint8_t *address) const {
+    size_t bit = (address - mark_space) / sizeof(uint64_t);
+    return (mark_bits[bit / 64] & ((uint64_t)1 << (bit % 64))) != 0;
+  }
+
+  // Marks an object, returning false if it was already marked.
+  bool SetMark(uint8_t *address) {
+    size_t bit = (address - mark_space) / sizeof(uint64_t);
+    uint64_t mask = (uint64_t)1 << (bit % 64);
+    if ((mark_bits[bit / 64] & mask) != 0) {
+      return false;
+    }
+
+    mark_bits[bit / 64] |= mask;
+    return true;
+  }
+
+  // Gives the free pages of the mark space back to the OS, apart from the
+  // ones that it's allowed to use before the next collection. Runs of
+  // neighbouring pages are decommitted together, so that this takes as
+  // few calls into the OS as possible.
+  void DecommitFreePages() {
+    size_t headroom = mark_page_budget > mark_pages.size()
+                          ? mark_page_budget - mark_pages.size()
+                          : 0;
+    if (mark_free_pages.size() <= headroom) {
+      return;
+    }
+
+    // pages are taken from the back, so the ones with the lowest
+    // addresses are kept, which keeps the heap compact.
+    std::sort(mark_free_pages.begin(), mark_free_pages.end(),
+              std::greater<uint8_t *>());
+    size_t spare = mark_free_pages.size() - headroom;
+    size_t run_start = 0;
+    for (size_t i = 1; i <= spare; i++) {
+      if (i == spare ||
+          mark_free_pages[i] != mark_free_pages[i - 1] - PAGE_SIZE) {
+        Decommit(mark_free_pages[i - 1], (i - run_start) * PAGE_SIZE);
+        run_start = i;
+      }
+    }
+
+    mark_decommitted_pages.insert(mark_decommitted_pages.end(),
+                                  mark_free_pages.begin(),
+                                  mark_free_pages.begin() + spare);
+    mark_free_pages.erase(mark_free_pages.begin(),
+                          mark_free_pages.begin() + spare);
+    HandOff();
+  }
+
+  // The number of pages that the mark space can use before the next
+  // collection. That's twice what is live, or, past the RSS target, just
+  // enough that the heap is nearly full when it's collected again.
+  size_t MarkPageBudget() const {
+    size_t budget = std::max(2 * mark_pages.size(), min_size / PAGE_SIZE);
+    if (HasSoftMax()) {
+      size_t full = (size_t)(mark_pages.size() / target_grow_threshold) + 1;
+      budget = std::max(std::min(budget, SoftMaxSize() / PAGE_SIZE), full);
+    }
+
+    return std::min(budget, max_size / PAGE_SIZE);
+  }
+
+  void DumpCollectorStatistics(std::ostream &out) override {
+    using std::chrono::duration;
+    double scavenge_seconds = duration<double>(total_scavenge).count();
+      out << "gc: " << objects_marked << " objects marked, "
+          << (size_t)(scavenge_seconds > 0 ? objects_marked / scavenge_seconds
+                                           : 0)
+          << " objects marked per second" << std::endl;
+      out << "gc: " << mark_pages.size() * PAGE_SIZE / 1024 << " kb heap, "
+          << peak_size / 1024 << " kb peak heap" << std::endl;
+  }
+
+#ifdef DEBUG
+  bool InHeap(Value ptr) const override { return InMarkSpace(ptr); }
+#endif
+};
+
+// The mark-sweep collector never moves objects. Each of its pages holds
+// cells of one kind and one size class. The cells that are free are
+// threaded onto a free list for their kind and size class, through their
+// first word, and the inline allocation path takes objects of each kind's
+// usual size off of the free list that they go on (see g_free_lists).
+// Objects that are allocated in batches get pages of cells that are exactly
+// their size, which are bump-allocated into once the free list runs out,
+// with the inline allocation path doing most of it. The cells of such a
+// page that haven't been handed out yet only go on the free list once the
+// page is given up on.
+class MarkSweepCollector : public MarkCollector {
+private:
+  uint8_t *free_lists[Sexp::kind_count][size_class_count];
+  // The size class of an object of each kind without any inline storage,
+  // which is what the inline allocation path takes off of the free lists.
+  size_t usual_size_classes[Sexp::kind_count];
+
+public:
+  MarkSweepCollector(const Options &options) : MarkCollector(options) {
+    for (auto &lists : free_lists) {
+      std::fill(lists, lists + size_class_count, nullptr);
+    }
+
+    for (size_t kind = 0; kind < Sexp::kind_count; kind++) {
+      usual_size_classes[kind] =
+          SizeClassOf(ObjectSize(static_cast<Sexp::Kind>(kind)));
+    }
+  }
+
+  // Allocates an object from the free list for its size class, or from
+  // the page that objects of its kind are bump-allocated on. When neither
+  // has room, a new page is started for it, and a collection is done first
+  // if the heap has used up its budget of pages.
+  uint8_t *AllocateObject(Sexp::Kind kind, size_t size,
+                          bool should_finalize) override {
+#ifdef DEBUG
+    if (stress) {
+      Collect();
+    }
+#endif
+
+    uint8_t *result = TakeCell(kind, size);
+    if (result == nullptr && mark_pages.size() >= mark_page_budget) {
+      DebugLog("out of pages, triggering a GC");
+      Collect();
+      result = TakeCell(kind, size);
+    }
+
+    if (result == nullptr) {
+      result = AllocateOnNewPage(kind, size);
+      if (result == nullptr) {
+        OutOfMemory();
+      }
+    }
+
+    if (should_finalize) {
+      DebugLog("marking object %p for finalization", result);
+      finalize_queue.push_back((Sexp *)result);
+    }
+
+    return result;
+  }
+
+  static bool IsBatchKind(Sexp::Kind kind) {
+    return kind == Sexp::Kind::CONS || kind == Sexp::Kind::FUNCTION ||
+           kind == Sexp::Kind::MACRO;
+  }
+
+  // Takes a cell for an object from the free list for its size class, or
+  // bumps room for it, or for a batch of objects, on the page that objects
+  // of its kind are bump-allocated on. Returns null if neither has room.
+  uint8_t *TakeCell(Sexp::Kind kind, size_t size) {
+    if (size == ObjectSize(kind) || !IsBatchKind(kind)) {
+      uint8_t *cell = TakeFreeCell(kind, SizeClassOf(size));
+      if (cell != nullptr) {
+        // a free cell still holds the free list link, along with whatever
+        // was in it before.
+        memset(cell, 0x0, size);
+        return cell;
+      }
+    }
+
+    if (IsBatchKind(kind)) {
+      return AllocateOnPage(alloc_pages[kind], size);
+    }
+
+    return nullptr;
+  }
+
+  uint8_t *TakeFreeCell(Sexp::Kind kind, size_t size_class) {
+    uint8_t *cell = free_lists[kind][size_class];
+    if (cell != nullptr) {
+      free_lists[kind][size_class] = *reinterpret_cast<uint8_t **>(cell);
+    }
+
+    return cell;
+  }
+
+  // Starts a new page for an object that didn't fit anywhere else, and
+  // allocates the object on it, returning null if the heap can't get any
+  // bigger. An object of a kind that is allocated in batches gets a page
+  // that is bump-allocated into, which replaces the old one for its kind,
+  // and anything else gets a page whose cells all go on the free list.
+  uint8_t *AllocateOnNewPage(Sexp::Kind kind, size_t size) {
+    if (!IsBatchKind(kind)) {
+      HeapPage *page = NewMarkSweepPage(kind, SizeClassOf(size));
+      if (page == nullptr) {
+        return nullptr;
+      }
+
+      ThreadFreeCells(page, page->Begin());
+      return TakeCell(kind, size);
+    }
+
+    size_t size_class = usual_size_classes[kind];
+    assert(size_classes[size_class] == ObjectSize(kind));
+    HeapPage *page = NewMarkSweepPage(kind, size_class);
+    if (page == nullptr) {
+      return nullptr;
+    }
+
+    if (alloc_pages[kind] != nullptr) {
+      ThreadFreeCells(alloc_pages[kind], alloc_pages[kind]->End());
+    }
+
+    // objects are bumped onto the page without being cleared.
+    memset(page->Begin(), 0x0, PAGE_SIZE - sizeof(HeapPage));
+    alloc_pages[kind] = page;
+    return AllocateOnPage(page, size);
+  }
+
+  // Adds a page to the mark-sweep heap for cells of the given kind and
+  // size class, with none of them in use. Returns null if the heap can't
+  // get any bigger.
+  HeapPage *NewMarkSweepPage(Sexp::Kind kind, size_t size_class) {
+    HeapPage *page = NewMarkPage(kind);
+    if (page != nullptr) {
+      InfoOf(page).size_class = (uint8_t)size_class;
+    }
+
+    return page;
+  }
+
+  // Puts the cells of a page from the given one on up on the free list,
+  // which leaves the page with all of its cells in use, as far as the
+  // inline allocation path is concerned.
+  void ThreadFreeCells(HeapPage *page, uint8_t *first) {
+    size_t cell_size = CellSize(page);
+    page->end = CellsEnd(page) - (uint8_t *)page;
+
+    // cells are threaded from the end of the page, so that they're handed
+    // out in order.
+    uint8_t **list = &free_lists[page->kind][InfoOf(page).size_class];
+    for (uint8_t *cell = page->End() - cell_size; cell >= first;
+         cell -= cell_size) {
+      *reinterpret_cast<uint8_t **>(cell) = *list;
+      *list = cell;
+    }
+  }
+
+  size_t CellSize(HeapPage *page) {
+    return size_classes[InfoOf(page).size_class];
+  }
+
+  // The end of the last cell that fits on a page.
+  uint8_t *CellsEnd(HeapPage *page) {
+    size_t cell_size = CellSize(page);
+    return page->Begin() +
+           (PAGE_SIZE - sizeof(HeapPage)) / cell_size * cell_size;
+  }
+
+  HeapPage *InlineAllocPage(Sexp::Kind kind) override {
+    return alloc_pages[kind];
+  }
+
+  uint8_t **InlineFreeList(Sexp::Kind kind) override {
+    return &free_lists[kind][usual_size_classes[kind]];
+  }
+
+  // Marks everything that is reachable, and then sweeps the rest of the
+  // heap onto the free lists. Nothing moves, so no pointers are updated.
+  void CollectInPlace() override {
+    auto start = std::chrono::steady_clock::now();
+    gc_number++;
+    DebugLog("[%d] beginning a mark-sweep GC", gc_number);
+    assert(worklist.empty());
+    ResetCodeMarks();
+    // the cells of the pages that are being bump-allocated into that
+    // haven't been handed out yet are swept onto the free lists along
+    // with the dead ones.
+    for (HeapPage *page : alloc_pages) {
+      if (page != nullptr) {
+        page->end = CellsEnd(page) - (uint8_t *)page;
+      }
+    }
+
+    ResetPages(alloc_pages);
+    std::fill(mark_bits.begin(), mark_bits.end(), 0);
+    ScanRoots([&](Value *ptr) { Mark(ptr); });
+    ScanCodeRoots([&](Value *ptr) { Mark(ptr); });
+    while (!worklist.empty()) {
+      Value ptr = worklist.back();
+      worklist.pop_back();
+      ptr->TracePointers([&](Value *ref) { Mark(ref); });
+    }
+
+    // everything in the finalizer queue that wasn't marked is dead.
+    size_t live_count = 0;
+    for (Sexp *ptr : finalize_queue) {
+      if (IsMarked((uint8_t *)ptr)) {
+        finalize_queue[live_count++] = ptr;
+      } else {
+        DebugLog("[%d] finalizing dead object %p", gc_number, ptr);
+        FinalizeDead(ptr);
+      }
+    }
+
+    finalize_queue.resize(live_count);
+    SweepCodeUnits();
+    Sweep();
+
+    CheckSoftLimit(mark_pages.size() * PAGE_SIZE);
+    mark_page_budget = MarkPageBudget();
+    DecommitFreePages();
+    DebugLog("[%d] mark-sweep GC complete, %zu pages in use", gc_number,
+             mark_pages.size());
+    total_scavenge += std::chrono::steady_clock::now() - start;
+  }
+
+  void Mark(Value *ptr) {
+    if (ptr == nullptr || !ptr->IsObject()) {
+      return;
+    }
+
+    if (InCodeSpace(*ptr)) {
+      MarkCode(*ptr);
+      return;
+    }
+
+    assert(InMarkSpace(*ptr));
+    if (SetMark((uint8_t *)ptr->Bits())) {
+      objects_marked++;
+      worklist.push_back(*ptr);
+    }
+  }
+
+  // Rebuilds the free lists from the cells that weren't marked. Pages
+  // without any marked cells are handed back, so that they can be used
+  // for objects of any kind.
+  void Sweep() {
+    for (auto &lists : free_lists) {
+      std::fill(lists, lists + size_class_count, nullptr);
+    }
+
+    size_t kept = 0;
+    for (HeapPage *page : mark_pages) {
+      size_t cell_size = CellSize(page);
+      uint8_t *begin = page->Begin();
+      uint8_t *end = page->End();
+      bool any_marked = false;
+      for (uint8_t *cell = begin; cell < end; cell += cell_size) {
+        if (IsMarked(cell)) {
+          any_marked = true;
+          break;
+        }
+      }
+
+      if (!any_marked) {
+#ifdef DEBUG
+        memset(page, 0xAB, PAGE_SIZE);
+#endif
+        mark_free_pages.push_back(reinterpret_cast<uint8_t *>(page));
+        continue;
+      }
+
+      mark_pages[kept++] = page;
+      size_t size_class = SizeClassOf(cell_size);
+      uint8_t **list = &free_lists[page->kind][size_class];
+      for (uint8_t *cell = end - cell_size; cell >= begin; cell -= cell_size) {
+        if (IsMarked(cell)) {
+          continue;
+        }
+
+#ifdef DEBUG
+        memset(cell, 0xAB, cell_size);
+#endif
+        *reinterpret_cast<uint8_t **>(cell) = *list;
+        *list = cell;
+      }
+    }
+
+    mark_pages.resize(kept);
+  }
+
+#ifdef DEBUG
+  void VerifyObject(uint8_t *address, HeapPage *page) override {
+    MarkCollector::VerifyObject(address, page);
+    assert((address - page->Begin()) % CellSize(page) == 0 &&
+           "pointer into the middle of a cell!");
+  }
+#endif
+};
+
+// The mark-region collector is modeled on Immix: each of its pages holds
+// objects of one kind, and is split into lines that are marked along with
+// the objects on them. Objects are bump-allocated into holes, which are
+// runs of lines that weren't marked by the last collection, using
+// alloc_pages, with the end of the current hole for each kind in limits.
+// Pages with holes are only searched for them once an allocator gets to
+// them. A collection also evacuates the live objects of the sparsest
+// pages, which are copied onto copy_pages.
+class MarkRegionCollector : public MarkCollector {
+private:
+  std::vector<uint8_t> line_marks;
+  size_t limits[Sexp::kind_count];
+  std::vector<HeapPage *> recyclable[Sexp::kind_count];
+  HeapPage *copy_pages[Sexp::kind_count];
+  size_t copy_budget;
+  size_t objects_evacuated;
+
+public:
+  MarkRegionCollector(const Options &options) : MarkCollector(options) {
+    ResetPages(copy_pages);
+    std::fill(limits, limits + Sexp::kind_count, 0);
+    copy_budget = 0;
+    objects_evacuated = 0;
+  }
+
+  // Allocates an object in mark-region mode, by bumping it into the
+  // current hole for its kind. When the object doesn't fit, the allocator
+  // moves on to the next hole on the page, then to the next page of that
+  // kind that has holes, and then to a new page. A collection is done
+  // first if the heap has used up its budget of pages.
+  uint8_t *AllocateObject(Sexp::Kind kind, size_t size,
+                          bool should_finalize) override {
+#ifdef DEBUG
+    if (stress) {
+      Collect();
+    }
+#endif
+
+    bool collected = false;
+    uint8_t *result;
+    while ((result = BumpInHole(kind, size)) == nullptr) {
+      HeapPage *page = alloc_pages[kind];
+      if (page != nullptr && FindHole(page, limits[kind] / line_size)) {
+        continue;
+      }
+
+      if (!recyclable[kind].empty()) {
+        page = recyclable[kind].back();
+        recyclable[kind].pop_back();
+        // what's known about the page's free space is about to be out of
+        // date, so it shouldn't be picked for evacuation.
+        InfoOf(page).live_lines = lines_per_page;
+        alloc_pages[kind] = page;
+        bool found = FindHole(page, 0);
+        assert(found && "recyclable page without a hole");
+        UNUSED_PARAMETER(found);
+        continue;
+      }
+
+      if (!collected && mark_pages.size() >= mark_page_budget) {
+        DebugLog("out of pages, triggering a GC");
+        Collect();
+        collected = true;
+        continue;
+      }
+
+      page = NewRegionPage(kind);
+      if (page == nullptr) {
+        if (!collected) {
+          Collect();
+          collected = true;
+          continue;
+        }
+
+        OutOfMemory();
+      }
+
+      InfoOf(page).live_lines = lines_per_page;
+      memset(page->Begin(), 0x0, PAGE_SIZE - sizeof(HeapPage));
+      alloc_pages[kind] = page;
+      limits[kind] = PAGE_SIZE;
+    }
+
+    if (should_finalize) {
+      DebugLog("marking object %p for finalization", result);
+      finalize_queue.push_back((Sexp *)result);
+    }
+
+    return result;
+  }
+
+  uint8_t *BumpInHole(Sexp::Kind kind, size_t size) {
+    HeapPage *page = alloc_pages[kind];
+    if (page == nullptr || page->end + size > limits[kind]) {
+      return nullptr;
+    }
+
+    uint8_t *result = page->End();
+    page->end += size;
+    return result;
+  }
+
+  // Moves the allocator for a page's kind to the first hole on the page
+  // at or after the given line, returning false if there isn't one. The
+  // hole is zeroed, since objects are handed out of it without being
+  // cleared, and the inline allocation path might be the one doing it.
+  bool FindHole(HeapPage *page, size_t line) {
+    uint8_t *lines = &line_marks[LineIndex((uint8_t *)page)];
+    while (line < lines_per_page && lines[line] != 0) {
+      line++;
+    }
+
+    if (line == lines_per_page) {
+      return false;
+    }
+
+    size_t end = line;
+    while (end < lines_per_page && lines[end] == 0) {
+      end++;
+    }
+
+    page->end = std::max(line * line_size, sizeof(HeapPage));
+    limits[page->kind] = end * line_size;
+    memset(page->End(), 0x0, limits[page->kind] - page->end);
+    return true;
+  }
+
+  size_t LineIndex(uint8_t *address) const {
+    return (address - mark_space) / line_size;
+  }
+
+  // Marks every line that the object at the given address overlaps.
+  void MarkLines(uint8_t *address, size_t size) {
+    size_t first = LineIndex(address);
+    size_t last = LineIndex(address + size - 1);
+    std::fill(&line_marks[first], &line_marks[last] + 1, 1);
+  }
+
+  // Starts a new page, making room for the marks of its lines.
+  HeapPage *NewRegionPage(Sexp::Kind kind) {
+    HeapPage *page = NewMarkPage(kind);
+    if (page != nullptr) {
+      line_marks.resize((mark_free - mark_space) / line_size);
+    }
+
+    return page;
+  }
+
+  HeapPage *InlineAllocPage(Sexp::Kind kind) override {
+    // the inline path only knows to stop at the end of the page, so it
+    // can't be used while allocating into a hole that ends before that.
+    return limits[kind] == PAGE_SIZE ? alloc_pages[kind] : nullptr;
+  }
+
+  // Does a mark-region collection. Everything that's reachable is marked
+  // where it is, apart from the objects on the pages that were picked for
+  // evacuation, which are copied off of them as they're found.
+  void CollectInPlace() override {
+    auto start = std::chrono::steady_clock::now();
+    gc_number++;
+    DebugLog("[%d] beginning a mark-region GC", gc_number);
+    assert(worklist.empty());
+    ResetCodeMarks();
+    std::fill(mark_bits.begin(), mark_bits.end(), 0);
+    std::fill(line_marks.begin(), line_marks.end(), 0);
+    ResetPages(alloc_pages);
+    ResetPages(copy_pages);
+    for (size_t kind = 0; kind < Sexp::kind_count; kind++) {
+      limits[kind] = 0;
+      recyclable[kind].clear();
+    }
+
+    PickEvacuationCandidates();
+    ScanRoots([&](Value *ptr) { MarkOrEvacuate(ptr); });
+    ScanCodeRoots([&](Value *ptr) { MarkOrEvacuate(ptr); });
+    while (!worklist.empty()) {
+      Value ptr = worklist.back();
+      worklist.pop_back();
+      ptr->TracePointers([&](Value *ref) { MarkOrEvacuate(ref); });
+    }
+
+    // everything in the finalizer queue that wasn't marked or evacuated
+    // is dead.
+    size_t live_count = 0;
+    for (Sexp *ptr : finalize_queue) {
+      Value copy = nullptr;
+      if (InfoOf(HeapPage::Of((uint64_t)ptr)).evacuating) {
+        copy = ForwardingAddress(ptr);
+      }
+
+      if (copy != nullptr) {
+        finalize_queue[live_count++] = copy.AsObject();
+      } else if (IsMarked((uint8_t *)ptr)) {
+        finalize_queue[live_count++] = ptr;
+      } else {
+        DebugLog("[%d] finalizing dead object %p", gc_number, ptr);
+        FinalizeDead(ptr);
+      }
+    }
+
+    finalize_queue.resize(live_count);
+    SweepCodeUnits();
+    ReleaseEmptyPages();
+    CheckSoftLimit(mark_pages.size() * PAGE_SIZE);
+    mark_page_budget = MarkPageBudget();
+    DecommitFreePages();
+    DebugLog("[%d] mark-region GC complete, %zu pages in use", gc_number,
+             mark_pages.size());
+    total_scavenge += std::chrono::steady_clock::now() - start;
+  }
+
+  // Picks the pages whose objects are copied off of them by the next
+  // collection: the ones with the fewest lines in use, as of the last
+  // collection, up to as many as the free pages that are left could hold
+  // the contents of.
+  void PickEvacuationCandidates() {
+    size_t max_pages = max_size / PAGE_SIZE;
+    size_t reserve = mark_pages.size() < max_pages
+                         ? max_pages - mark_pages.size()
+                         : 0;
+    reserve = std::min(reserve, std::max(mark_pages.size() / 8, size_t(1)));
+    std::vector<HeapPage *> sparse;
+    for (HeapPage *page : mark_pages) {
+      if (InfoOf(page).live_lines <= lines_per_page / 4) {
+        sparse.push_back(page);
+      }
+    }
+
+    std::sort(sparse.begin(), sparse.end(), [&](HeapPage *a, HeapPage *b) {
+      return InfoOf(a).live_lines < InfoOf(b).live_lines;
+    });
+
+    size_t lines = 0;
+    for (HeapPage *page : sparse) {
+      lines += InfoOf(page).live_lines;
+      if ((lines + lines_per_page - 1) / lines_per_page > reserve) {
+        break;
+      }
+
+      InfoOf(page).evacuating = true;
+    }
+
+    copy_budget = reserve;
+  }
+
+  // Marks the object that a field points to, unless it's on a page that's
+  // being evacuated, in which case it's copied instead and the field is
+  // updated to point to the copy. If there's no room left for the copy,
+  // the object is marked where it is.
+  void MarkOrEvacuate(Value *ptr) {
+    if (ptr == nullptr || !ptr->IsObject()) {
+      return;
+    }
+
+    if (InCodeSpace(*ptr)) {
+      MarkCode(*ptr);
+      return;
+    }
+
+    assert(InMarkSpace(*ptr));
+    uint8_t *address = (uint8_t *)ptr->Bits();
+    HeapPage *page = HeapPage::Of(ptr->Bits());
+    size_t size = ObjectSize(page->kind, address);
+    if (InfoOf(page).evacuating && !IsMarked(address)) {
+      Value copy = ForwardingAddress(*ptr);
+      if (copy != nullptr) {
+        *ptr = copy;
+        return;
+      }
+
+      uint8_t *to = AllocateForEvacuation(page->kind, size);
+      if (to != nullptr) {
+        DebugLog("[%d] evacuating: %p -> %p", gc_number, address, to);
+        memcpy(to, address, size);
+        RelocateStorage(page->kind, address, to);
+        *ForwardingWord(*ptr) = ForwardingWordTo(to);
+        objects_evacuated++;
+        *ptr = Value::FromAddress(to);
+        address = to;
+      }
+    }
+
+    if (SetMark(address)) {
+      objects_marked++;
+      MarkLines(address, size);
+      worklist.push_back(Value::FromAddress(address));
+    }
+  }
+
+  // Bump-allocates room for an evacuated object on a page that's only used
+  // for copies, returning null if the evacuation reserve is used up.
+  uint8_t *AllocateForEvacuation(Sexp::Kind kind, size_t size) {
+    uint8_t *result = AllocateOnPage(copy_pages[kind], size);
+    if (result != nullptr) {
+      return result;
+    }
+
+    if (copy_budget == 0) {
+      return nullptr;
+    }
+
+    HeapPage *page = NewRegionPage(kind);
+    if (page == nullptr) {
+      copy_budget = 0;
+      return nullptr;
+    }
+
+    copy_budget--;
+    copy_pages[kind] = page;
+    return AllocateOnPage(page, size);
+  }
+
+  // Counts the lines of every page that were marked by the collection that
+  // just finished. Pages without any are handed back, so that they can be
+  // used for objects of any kind. The others are recycled if they have any
+  // holes, which are found once an allocator gets to them.
+  void ReleaseEmptyPages() {
+    size_t kept = 0;
+    for (HeapPage *page : mark_pages) {
+      uint8_t *lines = &line_marks[LineIndex((uint8_t *)page)];
+      size_t live_lines = std::count(lines, lines + lines_per_page, 1);
+      if (live_lines == 0) {
+#ifdef DEBUG
+        memset(page, 0xAB, PAGE_SIZE);
+#endif
+        mark_free_pages.push_back(reinterpret_cast<uint8_t *>(page));
+        continue;
+      }
+
+      MarkPageInfo &info = InfoOf(page);
+      info.live_lines = (uint8_t)live_lines;
+      info.evacuating = false;
+      mark_pages[kept++] = page;
+      if (live_lines < lines_per_page) {
+        recyclable[page->kind].push_back(page);
+#ifdef DEBUG
+        // whatever is left in the holes is garbage.
+        for (size_t line = 0; line < lines_per_page; line++) {
+          if (lines[line] == 0) {
+            uint8_t *begin = (uint8_t *)page + line * line_size;
+            begin = std::max(begin, page->Begin());
+            memset(begin, 0xAB, (uint8_t *)page + (line + 1) * line_size - begin);
+          }
+        }
+#endif
+      }
+    }
+
+    mark_pages.resize(kept);
+  }
+
+  void DumpCollectorStatistics(std::ostream &out) override {
+    MarkCollector::DumpCollectorStatistics(out);
+    out << "gc: " << objects_evacuated << " objects evacuated" << std::endl;
+  }
+
+#ifdef DEBUG
+  // the objects on a page can be past the hole that's being allocated
+  // into.
+  void VerifyObject(uint8_t *, HeapPage *) override {}
+#endif
+};
+
+// Creates the collector that was picked with --gc.
+static std::unique_ptr<Collector> NewCollector(const Options &options) {
+  switch (options.gc_kind) {
+  case GcKind::Generational:
+    return std::make_unique<GenerationalCollector>(options);
+  case GcKind::Incremental:
+    return std::make_unique<IncrementalCollector>(options);
+  case GcKind::MarkSweep:
+    return std::make_unique<MarkSweepCollector>(options);
+  case GcKind::MarkRegion:
+    return std::make_unique<MarkRegionCollector>(options);
+  case GcKind::Semispace:
+    break;
+  }
+
+  return std::make_unique<SemispaceCollector>(options);
+}
+
+GcHeap::GcHeap() {
+  collector = NewCollector(g_options);
+  nursery_start = collector->NurseryStart();
+  nursery_end = collector->NurseryEnd();
+  code_start = collector->CodeStart();
+  code_end = collector->CodeEnd();
+}
+
+GcHeap::~GcHeap() {}
+
+uint8_t *GcHeap::Allocate(Sexp::Kind kind, size_t size, bool should_finalize) {
+  uint8_t *result = collector->Allocate(kind, size, should_finalize);
+  collector->PublishAllocPages();
+  return result;
+}
+
+uint8_t *GcHeap::AllocateCode(Sexp::Kind kind, size_t size) {
+  uint8_t *result = collector->AllocateCode(kind, size);
+  // the code space might have grown enough to need a collection, which
+  // the next allocation does.
+  collector->PublishAllocPages();
+  return result;
+}
+
+Value GcHeap::CopyToCodeSpace(Value constant) {
+  return collector->CopyToCodeSpace(constant);
+}
+
+void GcHeap::RecordCodeObject(Value ref) { collector->RecordCodeObject(ref); }
+
+void *GcHeap::AllocateArena(size_t size) {
+  return collector->AllocateArena(size);
+}
+
+void GcHeap::BeginUnit() { collector->BeginUnit(); }
+
+void GcHeap::EndUnit() { collector->EndUnit(); }
+
+void GcHeap::MarkCode(Value ref) { collector->MarkCode(ref); }
+
+void GcHeap::Collect() {
+  CONTRACT_VIOLATIONS { PERFORMS_GC; }
+  collector->Collect();
+  collector->PublishAllocPages();
+}
+
+void GcHeap::Remember(Value ref) { collector->Remember(ref); }
+
+void GcHeap::RememberCode(Value ref, Value value) {
+  collector->RememberCode(ref, value);
+}
+
+Value GcForwardField(Value *field) {
+  assert(g_heap != nullptr);
+  return g_heap->collector->ForwardField(field);
+}
+
+void GcHeap::ToggleStress() {
+  collector->ToggleStress();
+  collector->PublishAllocPages();
+}
+
+void GcHeap::ToggleHeapVerify() { collector->ToggleHeapVerify(); }
+
+void GcHeap::DumpStatistics(std::ostream &out) {
+  collector->DumpStatistics(out);
+}
+
+void GcHeap::SetSoftLimit(SoftLimitHook hook) {
+  collector->SetSoftLimitHook(hook);
+}
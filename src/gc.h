@@ -21,12 +21,63 @@
 #pragma once
 
 #include "activation.h"
+#include "contract.h"
 #include "meaning.h"
 #include "sexp.h"
+#include <algorithm>
 #include <cstring>
 #include <memory>
 #include <vector>
 
+template <typename F> void Value::TracePointers(F func) const {
+  assert(IsObject());
+  switch (HeapPage::Of(bits)->kind) {
+  case Sexp::Kind::CONS:
+    TraceRef(&AsCons()->car, func);
+    TraceRef(&AsCons()->cdr, func);
+    break;
+  case Sexp::Kind::MACRO:
+  case Sexp::Kind::FUNCTION:
+    TraceRef(&AsObject()->function.func_meaning, func);
+    TraceRef(&AsObject()->function.activation, func);
+    break;
+  case Sexp::Kind::ACTIVATION:
+    AsObject()->activation.TracePointers(func);
+    break;
+  case Sexp::Kind::MEANING:
+    AsObject()->meaning->TracePointers(func);
+    break;
+  case Sexp::Kind::SLOTS: {
+    Slots &slots = AsObject()->slots;
+    for (size_t i = 0; i < slots.count; i++) {
+      if (slots.values[i] != nullptr) {
+        func(&slots.values[i]);
+      }
+    }
+
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+class Frame;
+extern Frame *g_frames;
+extern Frame *g_current_frame;
+
+// The number of locations that can be protected at once, by all frames.
+#define GC_ROOT_STACK_SIZE (1 << 20)
+
+// The locations protected by every live frame, in the order in which they
+// were protected. Vectors are stored with the low bit of their address set,
+// which is free since both are at least word-aligned.
+extern uintptr_t g_root_stack[GC_ROOT_STACK_SIZE];
+#ifdef DEBUG
+extern const char *g_root_names[GC_ROOT_STACK_SIZE];
+#endif
+extern size_t g_root_stack_top;
+
 // When execution crosses into native code, the interpreter
 // will need to inform the GC that certain values are live
 // since the GC otherwise would not be able to recover that information.
@@ -37,263 +88,633 @@
 // When a GC occurs, the GC will precisely scan the stack of frames and
 // relocate any pointers that are protected by the frame. Using an unprotected
 // variable in a non-GC-safe environment is a bug waiting to happen!
+//
+// Frames live on the native stack themselves and link to the frame of
+// their caller. The locations that a frame protects are pushed onto the
+// root stack, and popped when the frame is destroyed, so neither pushing a
+// frame nor protecting a pointer touches the native heap.
 class Frame {
 private:
   const char *name;
-  std::vector<std::tuple<const char *, Sexp **>> roots;
-  std::vector<std::tuple<const char *, std::vector<Sexp *> *>> vector_roots;
   Frame *parent;
+  size_t base;
 
-public:
-  Frame(const char *name, Frame *parent)
-      : name(name), roots(), parent(parent) {}
-  void Root(Sexp **pointer, const char *var_name) {
-    roots.push_back(std::make_tuple(var_name, pointer));
-  }
-  void Root(std::vector<Sexp *> *vec, const char *var_name) {
-    vector_roots.push_back(std::make_tuple(var_name, vec));
-  }
-
-  void
-  TracePointers(std::function<void(std::tuple<const char *, Sexp **>)> func) {
-    for (auto &it : roots) {
-      func(it);
+  void Push(uintptr_t root, const char *var_name) {
+    if (g_root_stack_top == GC_ROOT_STACK_SIZE) {
+      PANIC("root stack overflow");
     }
 
-    for (auto &vec : vector_roots) {
-      for (auto &root : *std::get<1>(vec)) {
-        Sexp **loc = &root;
-        func(std::make_tuple(std::get<0>(vec), loc));
-      }
-    }
+#ifdef DEBUG
+    g_root_names[g_root_stack_top] = var_name;
+#else
+    UNUSED_PARAMETER(var_name);
+#endif
+    g_root_stack[g_root_stack_top++] = root;
   }
 
-  Frame *GetParent() { return parent; }
-  const char *GetName() const { return name; }
-};
-
-extern Frame *g_frames;
-extern Frame *g_current_frame;
-
-// A FrameProtector is placed on the stack of a native function.
-// It will insert a new frame onto the global list of frames upon construction
-// and remove the frame from the list on destruction.
-class FrameProtector {
-private:
-  Frame *protected_frame;
-
 public:
-  FrameProtector(const char *name) {
-    assert(g_frames != nullptr);
-    assert(g_current_frame != nullptr);
-    Frame *frame = new Frame(name, g_current_frame);
-    g_current_frame = frame;
-    protected_frame = frame;
+  // Creates a frame and makes it the current frame. It stops being the
+  // current frame when it's destroyed.
+  explicit Frame(const char *name)
+      : name(name), parent(g_current_frame), base(g_root_stack_top) {
+    g_current_frame = this;
   }
 
-  ~FrameProtector() {
-    assert(g_current_frame != nullptr);
-    g_current_frame = g_current_frame->GetParent();
-    assert(g_current_frame != nullptr);
-    delete protected_frame;
+  ~Frame() {
+    assert(g_current_frame == this);
+    g_current_frame = parent;
+    g_root_stack_top = base;
   }
 
-  void ProtectValue(Sexp **value, const char *name) {
-    assert(protected_frame != nullptr);
-    protected_frame->Root(value, name);
+  void Root(Value *pointer, const char *var_name) {
+    assert(g_current_frame == this);
+    Push(reinterpret_cast<uintptr_t>(pointer), var_name);
   }
 
-  void ProtectVector(std::vector<Sexp *> *vec, const char *name) {
-    assert(protected_frame != nullptr);
-    protected_frame->Root(vec, name);
+  void Root(std::vector<Value> *vec, const char *var_name) {
+    assert(g_current_frame == this);
+    Push(reinterpret_cast<uintptr_t>(vec) | 1, var_name);
+  }
+
+  // Calls func with the name and location of every pointer protected by the
+  // entries [start, end) of the root stack. Names are only kept by debug
+  // builds.
+  template <typename F>
+  static void TraceRoots(size_t start, size_t end, F func) {
+    for (size_t i = start; i < end; i++) {
+#ifdef DEBUG
+      const char *root_name = g_root_names[i];
+#else
+      const char *root_name = "";
+#endif
+      if ((g_root_stack[i] & 1) == 0) {
+        func(root_name, reinterpret_cast<Value *>(g_root_stack[i]));
+        continue;
+      }
+
+      uintptr_t vec_bits = g_root_stack[i] & ~uintptr_t(1);
+      auto *vec = reinterpret_cast<std::vector<Value> *>(vec_bits);
+      for (auto &root : *vec) {
+        func(root_name, &root);
+      }
+    }
   }
 
-  FrameProtector(const FrameProtector &) = delete;
-  FrameProtector &operator=(const FrameProtector &) = delete;
+  Frame *GetParent() { return parent; }
+  const char *GetName() const { return name; }
+
+  // The index of the first root stack entry owned by this frame. A frame
+  // owns every entry up to the base of the frame pushed after it.
+  size_t GetBase() const { return base; }
+
+  Frame(const Frame &) = delete;
+  Frame &operator=(const Frame &) = delete;
 };
 
 // These three macros are the means by which the interpreter should interact
 // with
-// the above two classes.
-
-// GC_HELPER_FRAME introduces a new frame protector for the current stack frame.
+// the above class.
+//
+// In a conservative build (CONSERVATIVE_GC), the collector finds pointers
+// on the native stack by itself, so protecting a value only keeps the
+// compiler from optimizing it off of the stack while it's in scope. Vectors
+// keep their elements on the native heap, so they're still protected by a
+// frame.
+#ifndef CONSERVATIVE_GC
+
+// GC_HELPER_FRAME introduces a new frame for the current stack frame.
 // It pushes a new stack frame onto the stack that will get disposed upon the
 // destruction of the native stack frame.
 //
 // It's important to note that it is not strictly necessary to introduce a GC
 // helper frame if there are no pointers to protect, or if one can be sure that
 // a GC will not occur.
-#define GC_HELPER_FRAME FrameProtector __frame_prot(__func__)
+#define GC_HELPER_FRAME Frame __frame_prot(__func__)
 
 // GC_PROTECT protects an lvalue from garbage collector and ensures that it will
 // be relocated correctly upon garbage collection.
 // The value MUST be an lvalue - in order
 // for the GC to be able to relocate the pointer, the pointer must have a
 // location in memory.
-#define GC_PROTECT(value) __frame_prot.ProtectValue(&value, #value);
+#define GC_PROTECT(value) __frame_prot.Root(&value, #value);
 
 // GC_PROTECT_VECTOR does what GC_PROTECT does, but for a vector.
-#define GC_PROTECT_VECTOR(value) __frame_prot.ProtectVector(&value, #value);
+#define GC_PROTECT_VECTOR(value) __frame_prot.Root(&value, #value);
 
 // GC_PROTECTED_LOCAL declares a new local that is protected. It will be
 // automatically relocated upon a GC.
 #define GC_PROTECTED_LOCAL(value)                                              \
-  Sexp *value = nullptr;                                                       \
-  __frame_prot.ProtectValue(&value, #value);
+  Value value = nullptr;                                                       \
+  __frame_prot.Root(&value, #value);
 
 // GC_PROTECTED_LOCAL_VECTOR declares a new vector of locals that is protected.
 #define GC_PROTECTED_LOCAL_VECTOR(value)                                       \
-  std::vector<Sexp *> value;                                                   \
-  __frame_prot.ProtectVector(&value, #value)
+  std::vector<Value> value;                                                    \
+  __frame_prot.Root(&value, #value)
+
+#else
 
-// The GC does not currently require the use of a write barrier,
-// but the VM has support for it anyway. When (if) we switch to
-// a generationala collector, we'll need it.
-#define GC_WRITE_BARRIER(ref, value)
+// Tells the compiler that something might read the given location at any
+// point after this, so that the value stored there stays on the native
+// stack where the conservative GC can see it.
+inline void GcKeepAlive(void *location) {
+  __asm__ __volatile__("" : : "r"(location) : "memory");
+}
+
+#define GC_CONCAT_IMPL(a, b) a##b
+#define GC_CONCAT(a, b) GC_CONCAT_IMPL(a, b)
+#define GC_VECTOR_FRAME GC_CONCAT(__vector_frame_, __LINE__)
+
+#define GC_HELPER_FRAME (void)0
+
+#define GC_PROTECT(value) GcKeepAlive(&value);
+
+#define GC_PROTECT_VECTOR(value)                                               \
+  Frame GC_VECTOR_FRAME(__func__);                                             \
+  GC_VECTOR_FRAME.Root(&value, #value);
+
+#define GC_PROTECTED_LOCAL(value)                                              \
+  Value value = nullptr;                                                       \
+  GcKeepAlive(&value);
+
+#define GC_PROTECTED_LOCAL_VECTOR(value)                                       \
+  std::vector<Value> value;                                                    \
+  GC_PROTECT_VECTOR(value)
+
+#endif
+
+// GC_WRITE_BARRIER must be used whenever a pointer to a heap object
+// is stored into an object that already exists, before the store is done.
+// The generational collector uses it to find old objects that point
+// into the nursery, and every collector uses it to find the parts of the
+// code space that point into the rest of the heap. It can't trigger a GC.
+#define GC_WRITE_BARRIER(ref, value) GcHeap::WriteBarrier(ref, value)
 
 class GcHeap;
 extern GcHeap *g_heap;
-extern Sexp g_the_empty_sexp;
+
+// The page that new objects of each kind are bump-allocated on. This is
+// the interpreter's allocation buffer, which the GC hands out and takes
+// back: an entry is null whenever an allocation of that kind has to go
+// through the GC, because there's no page yet or because the allocation
+// might have to do part of a collection. Only the interpreter thread
+// allocates, so there's only the one buffer.
+extern HeapPage *g_alloc_pages[Sexp::kind_count];
+// The free list that objects of each kind are taken off of once there's
+// no room on their page, for a collector that keeps free lists: cells
+// that are free are threaded through their first word, and hold objects
+// of the kind's size. An entry is null whenever the one in g_alloc_pages
+// would be, and when the collector doesn't have a list for the kind.
+extern uint8_t **g_free_lists[Sexp::kind_count];
+#ifdef CONSERVATIVE_GC
+extern uint8_t *g_stack_base;
+#endif
+
+// Called when a collection finds more live data than the soft limit
+// (--heap-soft-limit), with the number of live bytes and the limit. It's
+// called again only once the heap has been back under the limit.
+typedef void (*SoftLimitHook)(size_t live, size_t limit);
+
+class Collector;
 
 // The GC heap. The two entry points, Allocate and Collect, are used
 // to allocate and force collections respectively. ToggleStress is used
 // to toggle the stress mode of the GC.
 class GcHeap {
 private:
-  class GcHeapImpl;
-  std::unique_ptr<GcHeapImpl> pimpl;
+  // the collector that was picked with --gc.
+  std::unique_ptr<Collector> collector;
+  // the bounds of the nursery, copied out of the collector so that the
+  // write barrier can be inlined. both are null if the heap isn't
+  // generational.
+  uint8_t *nursery_start;
+  uint8_t *nursery_end;
+  // the bounds of the code space, copied out for the same reason.
+  uint8_t *code_start;
+  uint8_t *code_end;
   GcHeap();
   ~GcHeap();
 
-  Sexp *Allocate(bool should_finalize);
+  // Fills in a newly allocated string. storage is the size of its inline
+  // storage, or zero if its characters go on the native heap.
+  static void InitializeString(Sexp *s, jet_string str, size_t length,
+                               size_t storage) {
+    char *chars;
+    if (storage != 0) {
+      chars = reinterpret_cast<char *>(s->InlineStorage());
+    } else {
+      chars = (char *)malloc(length + 1);
+    }
+
+    memcpy(chars, str, length + 1);
+    s->string.chars = chars;
+    s->string.length = length;
+  }
+
+  // Allocates the global activation, whose only slot holds a growable
+  // table of globals with room for at least slot_count of them.
+  static Value AllocateGlobalActivation(size_t slot_count) {
+    GC_HELPER_FRAME;
+    GC_PROTECTED_LOCAL(globals);
+
+    globals = AllocateSlots(std::max(slot_count, size_t(64)));
+    size_t size = ObjectSize(Sexp::Kind::ACTIVATION) + sizeof(Value);
+    Sexp *s = (Sexp *)AllocateRaw(Sexp::Kind::ACTIVATION, size, false);
+    assert(s != nullptr);
+    s->activation.parent = nullptr;
+    s->activation.count = 1;
+    s->activation.Slots()[0] = globals;
+    return s;
+  }
+
+  // Bumps size bytes for an object of the given kind off the current page
+  // for its kind, or takes a cell for it off of its free list, or returns
+  // nullptr if neither has room. This is the fast path of every
+  // allocation; it never collects, so callers only need to protect their
+  // locals when it fails. Memory that is bumped off of a page is already
+  // zero, since the pages that are published for this are zeroed when
+  // they're started.
+  static uint8_t *TryAllocate(Sexp::Kind kind, size_t size) {
+    CONTRACT_VIOLATIONS { PERFORMS_GC; }
+
+    HeapPage *page = g_alloc_pages[kind];
+    if (page == nullptr || page->end + size > PAGE_SIZE) {
+      return TryAllocateFreeCell(kind, size);
+    }
+
+    uint8_t *result = page->End();
+    page->end += size;
+    return result;
+  }
+
+  // Takes a cell off of the free list for the given kind, if it has one
+  // and the object is the size that the list holds. A free cell still has
+  // the list's link in it, along with whatever was in it before, so it's
+  // zeroed here.
+  static uint8_t *TryAllocateFreeCell(Sexp::Kind kind, size_t size) {
+    uint8_t **list = g_free_lists[kind];
+    if (list == nullptr || *list == nullptr || size != ObjectSize(kind)) {
+      return nullptr;
+    }
+
+    uint8_t *result = *list;
+    *list = *reinterpret_cast<uint8_t **>(result);
+    memset(result, 0x0, size);
+    return result;
+  }
+
+  // Allocates size bytes for an object of the given kind, calling out to
+  // the GC if the fast path fails or the object needs to be finalized.
+  static uint8_t *AllocateRaw(Sexp::Kind kind, size_t size,
+                              bool should_finalize) {
+    if (!should_finalize) {
+      uint8_t *result = TryAllocate(kind, size);
+      if (result != nullptr) {
+        return result;
+      }
+    }
+
+    assert(g_heap != nullptr);
+    return g_heap->Allocate(kind, size, should_finalize);
+  }
+
+  uint8_t *Allocate(Sexp::Kind kind, size_t size, bool should_finalize);
+  uint8_t *AllocateCode(Sexp::Kind kind, size_t size);
+  Value CopyToCodeSpace(Value constant);
+  void RecordCodeObject(Value ref);
+  void *AllocateArena(size_t size);
+  void BeginUnit();
+  void EndUnit();
+  void MarkCode(Value ref);
   void Collect();
+  void Remember(Value ref);
+  void RememberCode(Value ref, Value value);
+  friend Value GcForwardField(Value *field);
+  friend class Collector;
   void ToggleStress();
   void ToggleHeapVerify();
+  void DumpStatistics(std::ostream &out);
+
+  void SetSoftLimit(SoftLimitHook hook);
 
 public:
   // Initializes the GC.
   static void Initialize() {
     assert(g_heap == nullptr);
     g_heap = new GcHeap();
-    // initialize the singleton empty sexp
-    g_the_empty_sexp.kind = Sexp::Kind::EMPTY;
   }
 
+#ifdef CONSERVATIVE_GC
+  // Sets the address that the conservative GC stops scanning the native
+  // stack at. Anything in a native frame above it isn't seen. This has to
+  // be called before anything is allocated.
+  static void SetStackBase(void *base) {
+    g_stack_base = reinterpret_cast<uint8_t *>(base);
+  }
+#endif
+
   // Allocates a Cons on the managed heap, given a car
   // and a cdr.
-  static Sexp *AllocateCons(Sexp *car, Sexp *cdr) {
+  static Value AllocateCons(Value car, Value cdr) {
+#ifdef COMPRESSED_REFS
+    if (car.IsFixnum() || cdr.IsFixnum()) {
+      return AllocateConsOfBoxes(car, cdr);
+    }
+#endif
+
+    Cons *c = (Cons *)TryAllocate(Sexp::Kind::CONS, sizeof(Cons));
+    if (c == nullptr) {
+      GC_HELPER_FRAME;
+      GC_PROTECT(car);
+      GC_PROTECT(cdr);
+      c = (Cons *)AllocateRaw(Sexp::Kind::CONS, sizeof(Cons), false);
+    }
+
+    assert(c != nullptr);
+    c->car = car;
+    c->cdr = cdr;
+    MarkIfCode(car);
+    MarkIfCode(cdr);
+    return c;
+  }
+
+  // Returns what has to be stored in a cons field to hold the given
+  // value. In a build with compressed references, a number doesn't fit in
+  // one, so it's boxed (see ConsField), which can trigger a GC. Anything
+  // else is stored as it is.
+  static Value BoxNumber(Value value) {
+#ifdef COMPRESSED_REFS
+    if (value.IsFixnum()) {
+      jet_fixnum number = value.AsFixnum();
+      Sexp *box = (Sexp *)AllocateRaw(Sexp::Kind::BOX,
+                                      ObjectSize(Sexp::Kind::BOX), false);
+      box->number = number;
+      return box;
+    }
+#endif
+
+    return value;
+  }
+
+#ifdef COMPRESSED_REFS
+  static Value AllocateConsOfBoxes(Value car, Value cdr) {
     GC_HELPER_FRAME;
     GC_PROTECT(car);
     GC_PROTECT(cdr);
-
-    assert(g_heap != nullptr);
-    Sexp *s = g_heap->Allocate(false);
-    assert(s != nullptr);
-    s->kind = Sexp::Kind::CONS;
-    s->cons.car = car;
-    s->cons.cdr = cdr;
-    return s;
+    car = BoxNumber(car);
+    cdr = BoxNumber(cdr);
+    return AllocateCons(car, cdr);
   }
+#endif
 
-  // Since there's only one possible value for the empty
-  // s-expression, the same value is re-used.
-  static Sexp *AllocateEmpty() { return &g_the_empty_sexp; }
-
-  // Allocates a fixnum on the heap.
-  static Sexp *AllocateFixnum(jet_fixnum num) {
-    assert(g_heap != nullptr);
-    Sexp *s = g_heap->Allocate(false);
-    assert(s != nullptr);
-    s->kind = Sexp::Kind::FIXNUM;
-    s->fixnum_value = num;
-    return s;
+  // The most objects of the given kind that AllocateBatch can allocate
+  // at once.
+  static size_t MaxBatchSize(Sexp::Kind kind) {
+    return (PAGE_SIZE - sizeof(HeapPage)) / ObjectSize(kind);
   }
 
-  // Allocates a symbol on the heap.
-  static Sexp *AllocateSymbol(size_t sym) {
-    assert(g_heap != nullptr);
-    Sexp *s = g_heap->Allocate(false);
-    assert(s != nullptr);
-    s->kind = Sexp::Kind::SYMBOL;
-    s->symbol_value = sym;
-    return s;
+  // Allocates count objects of the given kind next to each other on the
+  // same page, with a single check for room. Their kind must be one whose
+  // objects have a fixed size and don't need to be finalized. The objects
+  // are zeroed, and have to be filled in before anything else is
+  // allocated.
+  static uint8_t *AllocateBatch(Sexp::Kind kind, size_t count) {
+    assert(count > 0 && count <= MaxBatchSize(kind));
+    assert(kind == Sexp::Kind::CONS || kind == Sexp::Kind::FUNCTION ||
+           kind == Sexp::Kind::MACRO);
+    return AllocateRaw(kind, count * ObjectSize(kind), false);
   }
 
-  // Allocates a string on the heap.
-  static Sexp *AllocateString(jet_string str) {
-    assert(g_heap != nullptr);
-    Sexp *s = g_heap->Allocate(true);
-    assert(s != nullptr);
-    s->kind = Sexp::Kind::STRING;
-    s->string_value = strdup(str);
-    return s;
+  // Allocates a list of the given elements, in order, ending in tail
+  // instead of the empty list if one is given. Its cells are laid out
+  // next to each other, a page's worth at a time, so a list of n
+  // elements only checks for room about once per page. The caller has to
+  // protect the elements vector, since this can trigger a GC.
+  static Value AllocateList(const std::vector<Value> &elements,
+                            Value tail = Value::Empty()) {
+    GC_HELPER_FRAME;
+    GC_PROTECT(tail);
+#ifdef COMPRESSED_REFS
+    // numbers are boxed up front, since nothing can be allocated while a
+    // batch of cells is being filled in.
+    if (tail.IsFixnum() ||
+        std::any_of(elements.begin(), elements.end(),
+                    [](Value element) { return element.IsFixnum(); })) {
+      GC_PROTECTED_LOCAL_VECTOR(boxed);
+      boxed = elements;
+      for (size_t i = 0; i < boxed.size(); i++) {
+        boxed[i] = BoxNumber(boxed[i]);
+      }
+
+      tail = BoxNumber(tail);
+      return AllocateList(boxed, tail);
+    }
+#endif
+
+    // the list is built a page at a time from the back, so that every
+    // new cell points at cells that already exist. That way, linking them
+    // up never needs a write barrier.
+    size_t max_batch = MaxBatchSize(Sexp::Kind::CONS);
+    size_t end = elements.size();
+    while (end > 0) {
+      size_t count = (end - 1) % max_batch + 1;
+      size_t start = end - count;
+      Cons *cells = (Cons *)AllocateBatch(Sexp::Kind::CONS, count);
+      for (size_t i = 0; i < count; i++) {
+        cells[i].car = elements[start + i];
+        cells[i].cdr = i + 1 < count ? Value(&cells[i + 1]) : tail;
+        MarkIfCode(cells[i].car);
+      }
+
+      MarkIfCode(tail);
+      tail = &cells[0];
+      end = start;
+    }
+
+    return tail;
   }
 
-  // Allocates a boolean on the heap.
-  static Sexp *AllocateBool(jet_bool b) {
+  // The empty list, fixnums, symbols, bools and the EOF object are all
+  // immediates, so these don't actually touch the heap. They can't
+  // trigger a GC.
+  static Value AllocateEmpty() { return Value::Empty(); }
+
+  static Value AllocateFixnum(jet_fixnum num) { return Value::Fixnum(num); }
+
+  static Value AllocateSymbol(size_t sym) { return Value::Symbol(sym); }
+
+  static Value AllocateBool(jet_bool b) { return Value::Bool(b); }
+
+  static Value AllocateEof() { return Value::Eof(); }
+
+  // Allocates a string on the heap, copying the given characters into it.
+  // They can't be the characters of another string, since a GC could move
+  // them.
+  static Value AllocateString(jet_string str) {
     assert(g_heap != nullptr);
-    Sexp *s = g_heap->Allocate(false);
+    size_t length = strlen(str);
+    size_t storage = InlineSize(length + 1);
+    Sexp *s = (Sexp *)AllocateRaw(Sexp::Kind::STRING,
+                                  sizeof(Sexp) + storage, storage == 0);
     assert(s != nullptr);
-    s->kind = Sexp::Kind::BOOL;
-    s->bool_value = b;
+    InitializeString(s, str, length, storage);
     return s;
   }
 
-  static Sexp *AllocateEof() {
+  // Allocates an array of count slots for an activation, all of them
+  // null.
+  static Value AllocateSlots(size_t count) {
     assert(g_heap != nullptr);
-    Sexp *s = g_heap->Allocate(false);
+    size_t storage = InlineSize(count * sizeof(Value));
+    Sexp *s = (Sexp *)AllocateRaw(Sexp::Kind::SLOTS,
+                                  sizeof(Sexp) + storage, storage == 0);
     assert(s != nullptr);
-    s->kind = Sexp::Kind::END_OF_FILE;
+    if (storage != 0) {
+      // inline storage comes zeroed.
+      s->slots.values = reinterpret_cast<Value *>(s->InlineStorage());
+    } else {
+      s->slots.values = (Value *)calloc(count, sizeof(Value));
+    }
+
+    s->slots.count = count;
     return s;
   }
 
-  static Sexp *AllocateActivation(Sexp *parent) {
-    GC_HELPER_FRAME;
-    GC_PROTECT(parent);
+  // Allocates an activation with slot_count slots, all of them null. An
+  // activation without a parent is the global activation, which keeps its
+  // variables in a slot array that can grow, so slot_count is only a hint
+  // for it.
+  static Value AllocateActivation(Value parent, size_t slot_count) {
+    if (parent == nullptr) {
+      return AllocateGlobalActivation(slot_count);
+    }
+
+    assert(slot_count <= max_activation_slots);
+    size_t size =
+        ObjectSize(Sexp::Kind::ACTIVATION) + slot_count * sizeof(Value);
+    Sexp *s = (Sexp *)TryAllocate(Sexp::Kind::ACTIVATION, size);
+    if (s == nullptr) {
+      GC_HELPER_FRAME;
+      GC_PROTECT(parent);
+      s = (Sexp *)AllocateRaw(Sexp::Kind::ACTIVATION, size, false);
+    }
 
-    assert(g_heap != nullptr);
-    Sexp *s = g_heap->Allocate(true);
     assert(s != nullptr);
-    s->kind = Sexp::Kind::ACTIVATION;
-    s->activation = new Activation(parent);
+    s->activation.parent = parent;
+    s->activation.count = slot_count;
     return s;
   }
 
-  static Sexp *AllocateFunction(LambdaMeaning *func, Sexp *activation) {
-    GC_HELPER_FRAME;
-    GC_PROTECT(activation);
+  // Allocates a function, given the MEANING cell of its lambda and the
+  // activation that it closes over.
+  static Value AllocateFunction(Value func_meaning, Value activation) {
+    assert(func_meaning->IsMeaning());
+    size_t size = ObjectSize(Sexp::Kind::FUNCTION);
+    Sexp *s = (Sexp *)TryAllocate(Sexp::Kind::FUNCTION, size);
+    if (s == nullptr) {
+      GC_HELPER_FRAME;
+      GC_PROTECT(func_meaning);
+      GC_PROTECT(activation);
+      s = (Sexp *)AllocateRaw(Sexp::Kind::FUNCTION, size, false);
+    }
 
-    assert(g_heap != nullptr);
-    assert(func != nullptr);
-    // TODO(segilles) fix the leak
-    Sexp *s = g_heap->Allocate(false);
     assert(s != nullptr);
-    s->kind = Sexp::Kind::FUNCTION;
-    s->function.func_meaning = func;
+    s->function.func_meaning = func_meaning;
     s->function.activation = activation;
+    MarkIfCode(func_meaning);
     return s;
   }
 
-  static Sexp *AllocateNativeFunction(NativeFunction func) {
+  static Value AllocateNativeFunction(NativeFunction func) {
     assert(g_heap != nullptr);
-    Sexp *s = g_heap->Allocate(true);
+    Sexp *s = (Sexp *)AllocateRaw(Sexp::Kind::NATIVE_FUNCTION,
+                                  sizeof(Sexp), true);
     assert(s != nullptr);
-    s->kind = Sexp::Kind::NATIVE_FUNCTION;
     s->native_function = func;
     return s;
   }
 
-  static Sexp *AllocateMeaning(Meaning *meaning) {
+  // Allocates a meaning in the code space, as part of the compilation
+  // unit that is being analyzed. Meanings never move, so this can't
+  // trigger a GC.
+  static Value AllocateMeaning(Meaning *meaning) {
     assert(g_heap != nullptr);
     assert(meaning != nullptr);
-    // TODO(segilles) fix the leak
-    Sexp *s = g_heap->Allocate(false);
+    Sexp *s =
+        (Sexp *)g_heap->AllocateCode(Sexp::Kind::MEANING, sizeof(Sexp));
     assert(s != nullptr);
-    s->kind = Sexp::Kind::MEANING;
     s->meaning = meaning;
+    // the meaning might hold on to objects outside of the code space,
+    // which the GC will have to know about.
+    g_heap->RecordCodeObject(s);
     return s;
   }
 
+  // Copies a constant that is about to be quoted by a meaning into the
+  // code space, so that it doesn't have to be traced by every collection.
+  // Only conses and strings are copied; anything else is returned as-is.
+  // This can't trigger a GC.
+  static Value AllocateConstant(Value constant) {
+    assert(g_heap != nullptr);
+    return g_heap->CopyToCodeSpace(constant);
+  }
+
+  // Allocates memory for a Meaning from the arena of the compilation unit
+  // that is being analyzed.
+  static void *AllocateMeaningStorage(size_t size) {
+    assert(g_heap != nullptr);
+    return g_heap->AllocateArena(size);
+  }
+
+  // Starts and ends a compilation unit. Units nest, since analysis can
+  // run macros that call eval. See CodeUnitScope.
+  static void BeginCodeUnit() {
+    assert(g_heap != nullptr);
+    g_heap->BeginUnit();
+  }
+
+  static void EndCodeUnit() {
+    assert(g_heap != nullptr);
+    g_heap->EndUnit();
+  }
+  // Returns true if this value is an object that was allocated since the
+  // last collection. Immediates are never young.
+  static bool IsYoung(Value value) {
+    assert(g_heap != nullptr);
+    return value.Bits() >= (uintptr_t)g_heap->nursery_start &&
+           value.Bits() < (uintptr_t)g_heap->nursery_end;
+  }
+
+  // Returns true if this value is an object in the code space.
+  static bool IsCode(Value value) {
+    assert(g_heap != nullptr);
+    return value.Bits() >= (uintptr_t)g_heap->code_start &&
+           value.Bits() < (uintptr_t)g_heap->code_end;
+  }
+
+  // Records that value is about to be stored into ref. Only stores that
+  // make an old object point to a young one, or that make the code space
+  // point to the rest of the heap, have to be remembered.
+  static void WriteBarrier(Value ref, Value value) {
+    if (IsYoung(value) && !IsYoung(ref)) {
+      g_heap->Remember(ref);
+    } else if (IsCode(ref) && value.IsObject()) {
+      g_heap->RememberCode(ref, value);
+    }
+
+    MarkIfCode(value);
+  }
+
+  // While an incremental collection is running, objects that have already
+  // been scanned (and objects allocated since it started) aren't looked at
+  // again, so a pointer into the code space that gets stored into one has
+  // to mark its compilation unit as live right away.
+  static void MarkIfCode(Value value) {
+    if (g_condemned_start != nullptr && IsCode(value)) {
+      g_heap->MarkCode(value);
+    }
+  }
+
   // Forces a collection.
   static void ForceCollect() {
     assert(g_heap != nullptr);
@@ -312,4 +733,32 @@ public:
     assert(g_heap != nullptr);
     g_heap->ToggleHeapVerify();
   }
+
+  // Sets the function that is told when the heap goes over its soft
+  // limit. It's called the next time that something is allocated, rather
+  // than during the collection, so it can allocate itself.
+  static void SetSoftLimitHook(SoftLimitHook hook) {
+    assert(g_heap != nullptr);
+    g_heap->SetSoftLimit(hook);
+  }
+
+  // Prints statistics about the collections that have been done so far.
+  static void DumpHeapStatistics(std::ostream &out) {
+    assert(g_heap != nullptr);
+    g_heap->DumpStatistics(out);
+  }
+};
+
+// A CodeUnitScope is placed on the stack of a function that analyzes a
+// whole form. The meanings that are created while it's alive, and the
+// constants that they quote, make up a compilation unit, which the GC frees
+// all at once when none of its meanings are reachable anymore. A unit is
+// never freed while it is still being analyzed.
+class CodeUnitScope {
+public:
+  CodeUnitScope() { GcHeap::BeginCodeUnit(); }
+  ~CodeUnitScope() { GcHeap::EndCodeUnit(); }
+
+  CodeUnitScope(const CodeUnitScope &) = delete;
+  CodeUnitScope &operator=(const CodeUnitScope &) = delete;
 };
@@ -36,7 +36,7 @@ const char path_sep =
     '/';
 #endif
 
-int EvalFile(std::ifstream &input, Sexp *activation) {
+int EvalFile(std::ifstream &input, Value activation) {
   GC_HELPER_FRAME;
   GC_PROTECTED_LOCAL(read);
   GC_PROTECTED_LOCAL(meaning);
@@ -66,7 +66,7 @@ int ActualMain(char *filename) {
   GC_HELPER_FRAME;
   GC_PROTECTED_LOCAL(activation);
 
-  activation = GcHeap::AllocateActivation(nullptr);
+  activation = GcHeap::AllocateActivation(nullptr, 0);
   g_global_activation = activation;
   GC_PROTECT(g_global_activation);
   LoadBuiltins(activation);
@@ -93,11 +93,22 @@ int ActualMain(char *filename) {
   return EvalFile(input, activation);
 }
 
+// Warns that a collection found more live data than the soft limit.
+static void WarnSoftLimit(size_t live, size_t limit) {
+  std::cerr << "warning: " << live / 1024 << " kb of the heap is live, "
+            << "over its soft limit of " << limit / 1024 << " kb" << std::endl;
+}
+
 void InitializeRuntime() {
   GcHeap::Initialize();
+  if (g_options.emit_warnings) {
+    GcHeap::SetSoftLimitHook(WarnSoftLimit);
+  }
+
   SymbolInterner::Initialize();
-  g_frames = new Frame("<global>", nullptr);
-  g_current_frame = g_frames;
+  // the global frame is never destroyed, so it's the one frame that
+  // doesn't live on the native stack.
+  g_frames = new Frame("<global>");
 #ifdef DEBUG
   if (g_options.gc_stress) {
     GcHeap::ToggleStressMode();
@@ -114,8 +125,18 @@ void InitializeRuntime() {
 }
 
 int main(int argc, char **argv) {
+#ifdef CONSERVATIVE_GC
+  // every native frame that can hold a pointer into the heap is below
+  // this one.
+  GcHeap::SetStackBase(__builtin_frame_address(0));
+#endif
   ParseOptions(argc, argv);
   ValidateOptions();
   InitializeRuntime();
-  return ActualMain(argv[1]);
+  int exit_code = ActualMain(argv[1]);
+  if (g_options.gc_stats) {
+    GcHeap::DumpHeapStatistics(std::cerr);
+  }
+
+  return exit_code;
 }
@@ -22,108 +22,110 @@
 #include "contract.h"
 #include "gc.h"
 
-Trampoline QuotedMeaning::Eval(Sexp *act) {
+void *Meaning::operator new(size_t size) {
+  return GcHeap::AllocateMeaningStorage(size);
+}
+
+void Meaning::operator delete(void *ptr) { UNUSED_PARAMETER(ptr); }
+
+void Meaning::Compile(Compiler &compiler, bool tail) {
+  UNUSED_PARAMETER(compiler);
+  UNUSED_PARAMETER(tail);
+  UNREACHABLE();
+}
+
+const Closure *Meaning::CompileClosure(ClosureCompiler &compiler) {
+  UNUSED_PARAMETER(compiler);
+  UNREACHABLE();
+}
+
+LambdaMeaning *Function::Lambda() const {
+  assert(func_meaning->IsMeaning());
+  return static_cast<LambdaMeaning *>(func_meaning->AsObject()->meaning);
+}
+
+Trampoline QuotedMeaning::Eval(Value act) {
   CONTRACT {
     FORBID_GC;
     PRECONDITION(act->IsActivation());
   }
 
   UNUSED_PARAMETER(act);
-  return Trampoline(quoted);
+  return Trampoline(GC_READ_BARRIER(quoted));
 }
 
-Trampoline ReferenceMeaning::Eval(Sexp *act) {
+Trampoline ReferenceMeaning::Eval(Value act) {
   CONTRACT {
     FORBID_GC;
     PRECONDITION(act->IsActivation());
   }
 
-  return Trampoline(act->activation->Get(up_index, right_index));
+  return Trampoline(act->AsObject()->activation.Get(up_index, right_index));
 }
 
-Trampoline DefinitionMeaning::Eval(Sexp *act) {
+Trampoline DefinitionMeaning::Eval(Value act) {
   CONTRACT { PRECONDITION(act->IsActivation()); }
 
   GC_HELPER_FRAME;
   GC_PROTECT(act);
   GC_PROTECTED_LOCAL(value);
-  value = Evaluate(binding_value, act);
+  value = Evaluate(GC_READ_BARRIER(binding_value), act);
 
-  GC_WRITE_BARRIER(act, value);
-  act->activation->Set(up_index, right_index, value);
+  Activation::Set(act, up_index, right_index, value);
   return Trampoline(GcHeap::AllocateEmpty());
 }
 
-Trampoline SetMeaning::Eval(Sexp *act) {
+Trampoline SetMeaning::Eval(Value act) {
   CONTRACT { PRECONDITION(act->IsActivation()); }
 
   GC_HELPER_FRAME;
   GC_PROTECT(act);
   GC_PROTECTED_LOCAL(value);
 
-  value = Evaluate(binding_value, act);
+  value = Evaluate(GC_READ_BARRIER(binding_value), act);
 
-  GC_WRITE_BARRIER(act, value);
-  act->activation->Set(up_index, right_index, value);
+  Activation::Set(act, up_index, right_index, value);
   return Trampoline(GcHeap::AllocateEmpty());
 }
 
-Trampoline ConditionalMeaning::Eval(Sexp *act) {
+Trampoline ConditionalMeaning::Eval(Value act) {
   CONTRACT { PRECONDITION(act->IsActivation()); }
 
   GC_HELPER_FRAME;
   GC_PROTECT(act);
   GC_PROTECTED_LOCAL(cond);
 
-  cond = Evaluate(condition, act);
+  cond = Evaluate(GC_READ_BARRIER(condition), act);
   if (cond->IsTruthy()) {
-    return Trampoline(act, true_branch);
+    return Trampoline(act, GC_READ_BARRIER(true_branch));
   } else {
-    return Trampoline(act, false_branch);
+    return Trampoline(act, GC_READ_BARRIER(false_branch));
   }
 }
 
-Trampoline SequenceMeaning::Eval(Sexp *act) {
+Trampoline SequenceMeaning::Eval(Value act) {
   CONTRACT { PRECONDITION(act->IsActivation()); }
 
   GC_HELPER_FRAME;
   GC_PROTECT(act);
 
   for (auto &entry : body) {
-    Evaluate(entry, act);
+    Evaluate(GC_READ_BARRIER(entry), act);
   }
 
-  return Trampoline(act, final_form);
+  return Trampoline(act, GC_READ_BARRIER(final_form));
 }
 
-Trampoline LambdaMeaning::Eval(Sexp *act) {
+Trampoline LambdaMeaning::Eval(Value act) {
   CONTRACT { PRECONDITION(act->IsActivation()); }
 
   GC_HELPER_FRAME;
   GC_PROTECT(act);
 
-  return GcHeap::AllocateFunction(this, act);
-}
-
-// Reverse an s-expression in place, classic interview question style.
-static void ReverseSexp(Sexp **head) {
-  CONTRACT { FORBID_GC; }
-
-  Sexp *prev = GcHeap::AllocateEmpty();
-  Sexp *cursor = *head;
-  Sexp *next = GcHeap::AllocateEmpty();
-  while (!cursor->IsEmpty()) {
-    assert(cursor->IsCons());
-    next = cursor->cons.cdr;
-    cursor->cons.cdr = prev;
-    prev = cursor;
-    cursor = next;
-  }
-
-  *head = prev;
+  return GcHeap::AllocateFunction(cell, act);
 }
 
-Trampoline InvocationMeaning::Eval(Sexp *act) {
+Trampoline InvocationMeaning::Eval(Value act) {
   CONTRACT { PRECONDITION(act->IsActivation()); }
 
   GC_HELPER_FRAME;
@@ -132,22 +134,25 @@ Trampoline InvocationMeaning::Eval(Sexp *act) {
   GC_PROTECTED_LOCAL(called_expr);
   GC_PROTECTED_LOCAL(eval_arg)
 
-  called_expr = Evaluate(base, act);
+  called_expr = Evaluate(GC_READ_BARRIER(base), act);
   if (!called_expr->IsFunction() && !called_expr->IsNativeFunction() &&
       !called_expr->IsMacro()) {
     throw JetRuntimeException("called a non-callable value");
   }
 
   if (called_expr->IsFunction() || called_expr->IsMacro()) {
-    if (called_expr->function.func_meaning->IsVariadic()) {
+    // the lambda meaning itself isn't on the heap, so it's safe to hold
+    // on to across a GC. called_expr keeps its compilation unit alive.
+    LambdaMeaning *func_meaning = called_expr->AsObject()->function.Lambda();
+    if (func_meaning->IsVariadic()) {
       // if this is a variadic function, all we need to do is
       // ensure we called this with at least the number of required args.
-      if (arguments.size() < called_expr->function.func_meaning->Arity()) {
+      if (arguments.size() < func_meaning->Arity()) {
         throw JetRuntimeException("arity mismatch");
       }
     } else {
       // otherwise, we need an exact match.
-      if (arguments.size() != called_expr->function.func_meaning->Arity()) {
+      if (arguments.size() != func_meaning->Arity()) {
         throw JetRuntimeException("arity mismatch");
       }
     }
@@ -159,62 +164,49 @@ Trampoline InvocationMeaning::Eval(Sexp *act) {
     // if this function is variadic, we need all "rest" arguments
     // to be bound to the final arg (arity + 1)
     size_t right_index = 0;
-    child_act = GcHeap::AllocateActivation(called_expr->function.activation);
+    child_act = GcHeap::AllocateActivation(
+        GC_READ_BARRIER(called_expr->AsObject()->function.activation),
+        func_meaning->SlotCount());
     auto it = arguments.begin();
-    for (size_t i = 0; i < called_expr->function.func_meaning->Arity();
-         it++, i++) {
-      eval_arg = Evaluate(*it, act);
-      GC_WRITE_BARRIER(child_act, eval_arg);
-      child_act->activation->Set(0, right_index++, eval_arg);
+    for (size_t i = 0; i < func_meaning->Arity(); it++, i++) {
+      eval_arg = Evaluate(GC_READ_BARRIER(*it), act);
+      Activation::Set(child_act, 0, right_index++, eval_arg);
     }
 
     // if there are still arguments left, this function is variadic
     // and we have more work to do.
     if (it != arguments.end()) {
-      assert(called_expr->function.func_meaning->IsVariadic());
-      GC_PROTECTED_LOCAL(args_list);
-      args_list = GcHeap::AllocateEmpty();
+      assert(func_meaning->IsVariadic());
+      GC_PROTECTED_LOCAL_VECTOR(rest_args);
       for (; it != arguments.end(); it++) {
-        eval_arg = Evaluate(*it, act);
-
-        // we're building up this list in reverse, because it's
-        // much more efficient to append to the front of linked
-        // lists than to the back.
-        args_list = GcHeap::AllocateCons(eval_arg, args_list);
+        eval_arg = Evaluate(GC_READ_BARRIER(*it), act);
+        rest_args.push_back(eval_arg);
       }
 
-      // now, we have to reverse the list we just made.
-      // this is the first time I've ever had to do this algorithm
-      // outside of a job interview. nice!
-      ReverseSexp(&args_list);
-      GC_WRITE_BARRIER(child_act, args_list);
-      child_act->activation->Set(0, right_index, args_list);
-    }
-
-    if (arguments.size() == 0 &&
-        called_expr->function.func_meaning->IsVariadic()) {
+      // the rest list is allocated all at once, in order, once all of
+      // its elements have been evaluated.
+      eval_arg = GcHeap::AllocateList(rest_args);
+      Activation::Set(child_act, 0, right_index, eval_arg);
+    } else if (func_meaning->IsVariadic()) {
       // we have to give the called function an empty list if it's not called
-      // with any arguments.
-      //
-      // no need to to call the write barrier here, empty lists
-      // arenpt tracked by the GC.
-      child_act->activation->Set(0, 0, GcHeap::AllocateEmpty());
+      // with any rest arguments.
+      Activation::Set(child_act, 0, right_index, GcHeap::AllocateEmpty());
     }
 
     // tail call the function
-    return Trampoline(child_act, called_expr->function.func_meaning->Body());
+    return Trampoline(child_act, GC_READ_BARRIER(func_meaning->Body()));
   }
 
   // this is a native function call.
   // arity check, first up.
-  if (arguments.size() != called_expr->native_function.arity) {
+  if (arguments.size() != called_expr->AsObject()->native_function.arity) {
     throw JetRuntimeException("arity mismatch");
   }
 
   // second, eval all our arguments and store them in a vector.
   GC_PROTECTED_LOCAL_VECTOR(args);
   for (auto &argument : arguments) {
-    eval_arg = Evaluate(argument, act);
+    eval_arg = Evaluate(GC_READ_BARRIER(argument), act);
     args.push_back(eval_arg);
   }
 
@@ -224,19 +216,19 @@ Trampoline InvocationMeaning::Eval(Sexp *act) {
   // invoke our native function, passing the vector's data pointer
   // as an argument.
   GC_PROTECTED_LOCAL(ret);
-  ret = (*called_expr->native_function.func)(args.data());
+  ret = (*called_expr->AsObject()->native_function.func)(args.data());
 
   // we can't tail call native functions.
   return Trampoline(ret);
 }
 
-Trampoline AndMeaning::Eval(Sexp *act) {
+Trampoline AndMeaning::Eval(Value act) {
   GC_HELPER_FRAME;
   GC_PROTECT(act);
   GC_PROTECTED_LOCAL(eval);
 
   for (auto &arg : arguments) {
-    eval = Evaluate(arg, act);
+    eval = Evaluate(GC_READ_BARRIER(arg), act);
     if (!eval->IsTruthy()) {
       return GcHeap::AllocateBool(false);
     }
@@ -245,13 +237,13 @@ Trampoline AndMeaning::Eval(Sexp *act) {
   return GcHeap::AllocateBool(true);
 }
 
-Trampoline OrMeaning::Eval(Sexp *act) {
+Trampoline OrMeaning::Eval(Value act) {
   GC_HELPER_FRAME;
   GC_PROTECT(act);
   GC_PROTECTED_LOCAL(eval);
 
   for (auto &arg : arguments) {
-    eval = Evaluate(arg, act);
+    eval = Evaluate(GC_READ_BARRIER(arg), act);
     if (eval->IsTruthy()) {
       return GcHeap::AllocateBool(true);
     }
@@ -260,7 +252,7 @@ Trampoline OrMeaning::Eval(Sexp *act) {
   return GcHeap::AllocateBool(false);
 }
 
-Sexp *Evaluate(Sexp *meaning, Sexp *act) {
+Value Evaluate(Value meaning, Value act) {
   GC_HELPER_FRAME;
 
   Trampoline result(act, meaning);
@@ -274,7 +266,7 @@ Sexp *Evaluate(Sexp *meaning, Sexp *act) {
   while (result.IsThunk()) {
     assert(result.activation->IsActivation());
     assert(result.meaning->IsMeaning());
-    result = result.meaning->meaning->Eval(result.activation);
+    result = result.meaning->AsObject()->meaning->Eval(result.activation);
   }
 
   return result.value;
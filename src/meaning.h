@@ -27,31 +27,55 @@
 #include <functional>
 #include <iostream>
 #include <memory>
+#include <vector>
+
+class Compiler;
+class ClosureCompiler;
+struct Closure;
 
 // A trampoline is the result of evaluating a meaning. The result
 // will either be a concrete value or a thunk representing the
 // next thing to evaluate.
 struct Trampoline {
-  enum Kind { Value, Thunk };
+  enum Kind { Result, Thunk };
 
   Kind kind;
   union {
-    Sexp *value;
-    Sexp *activation;
+    Value value;
+    Value activation;
   };
-  Sexp *meaning;
-
-  Trampoline(Sexp *value) : kind(Trampoline::Kind::Value), value(value) {}
-  Trampoline(Sexp *act, Sexp *meaning)
-      : kind(Trampoline::Kind::Thunk), activation(act), meaning(meaning) {}
+  Value meaning;
+  // The closure to run next, for a thunk returned by a closure (see
+  // closure.h). Its meaning is then the MEANING cell that keeps the
+  // closure's compilation unit alive, or null if it's the same unit as
+  // the closure that returned it.
+  const Closure *closure;
+
+  Trampoline(Value value)
+      : kind(Trampoline::Kind::Result), value(value), meaning(nullptr),
+        closure(nullptr) {}
+  Trampoline(Value act, Value meaning)
+      : kind(Trampoline::Kind::Thunk), activation(act), meaning(meaning),
+        closure(nullptr) {}
+  Trampoline(Value act, const Closure *closure, Value meaning)
+      : kind(Trampoline::Kind::Thunk), activation(act), meaning(meaning),
+        closure(closure) {}
 
   // Returns true if this trampoline is a value.
-  inline bool IsValue() { return kind == Trampoline::Kind::Value; }
+  inline bool IsValue() { return kind == Trampoline::Kind::Result; }
 
   // Returns true if this trampoline is a thunk.
   inline bool IsThunk() { return kind == Trampoline::Kind::Thunk; }
 };
 
+// The locations of the managed pointers that a meaning holds: up to three
+// fields, followed by the elements of a vector, if it has one.
+struct MeaningPointers {
+  Value *fields[3];
+  size_t field_count;
+  std::vector<Value> *vector;
+};
+
 // A Meaning is an analyzed form of an s-expression. Meanings
 // are eventually interpreted and executed directly. The result
 // of semantic analysis is a meaning.
@@ -62,33 +86,62 @@ struct Trampoline {
 class Meaning {
 public:
   // Evals this meaning using the given activation.
-  virtual Trampoline Eval(Sexp *act) = 0;
+  virtual Trampoline Eval(Value act) = 0;
+  // Compiles this meaning into the code that the given compiler is
+  // building. A meaning in tail position leaves the function that it's
+  // in, either by returning its value or by tail calling. Meanings that
+  // are themselves the output of a compiler can't be compiled again, and
+  // don't override this.
+  virtual void Compile(Compiler &compiler, bool tail);
+  // Compiles this meaning into a closure, along with the meanings that it
+  // contains. Like Compile, only meanings produced by analysis override it.
+  virtual const Closure *CompileClosure(ClosureCompiler &compiler);
   virtual void Dump(std::ostream &out) = 0;
   void Dump() { Dump(std::cout); }
 
   virtual ~Meaning() {}
 
-  // Traces the managed pointers contained within this meaning.
-  // Meanings that contain managed pointers must override this.
-  virtual void TracePointers(std::function<void(Sexp **)> func) {
-    UNUSED_PARAMETER(func);
-  };
+  // Meanings are allocated in the arena of the compilation unit that is
+  // being analyzed, and are freed along with it by the GC. They can't be
+  // deleted on their own.
+  static void *operator new(size_t size);
+  static void operator delete(void *ptr);
+
+  // Returns the locations of the managed pointers contained within this
+  // meaning. Meanings that contain managed pointers must override this.
+  virtual MeaningPointers Pointers() { return {{}, 0, nullptr}; }
+
+  // Traces the managed pointers contained within this meaning. Only
+  // looking up their locations needs a virtual call, so the visitor
+  // can be inlined.
+  template <typename F> void TracePointers(F func) {
+    MeaningPointers pointers = Pointers();
+    for (size_t i = 0; i < pointers.field_count; i++) {
+      func(pointers.fields[i]);
+    }
+
+    if (pointers.vector != nullptr) {
+      for (auto &value : *pointers.vector) {
+        func(&value);
+      }
+    }
+  }
 };
 
 // A QuotedMeaning is a meaning for a quoted s-expression.
 // A quoted s-expression, when evaluated, returns itself.
 class QuotedMeaning : public Meaning {
 private:
-  Sexp *quoted;
+  Value quoted;
 
 public:
-  QuotedMeaning(Sexp *quoted_value) : quoted(quoted_value) {}
+  QuotedMeaning(Value quoted_value) : quoted(quoted_value) {}
 
-  Trampoline Eval(Sexp *act) override;
+  Trampoline Eval(Value act) override;
+  void Compile(Compiler &compiler, bool tail) override;
+  const Closure *CompileClosure(ClosureCompiler &compiler) override;
 
-  void TracePointers(std::function<void(Sexp **)> func) override {
-    func(&quoted);
-  }
+  MeaningPointers Pointers() override { return {{&quoted}, 1, nullptr}; }
 
   void Dump(std::ostream &out) override {
     out << "(meaning-quote ";
@@ -96,7 +149,7 @@ public:
     out << ")";
   }
 
-  Sexp *&Quoted() { return quoted; }
+  Value &Quoted() { return quoted; }
 };
 
 // A ReferenceMeaning is a meaning for a variable reference. When
@@ -111,7 +164,9 @@ public:
   ReferenceMeaning(size_t up, size_t right)
       : up_index(up), right_index(right) {}
 
-  Trampoline Eval(Sexp *act) override;
+  Trampoline Eval(Value act) override;
+  void Compile(Compiler &compiler, bool tail) override;
+  const Closure *CompileClosure(ClosureCompiler &compiler) override;
 
   void Dump(std::ostream &out) override {
     out << "(meaning-ref " << up_index << " " << right_index << ")";
@@ -124,25 +179,27 @@ class DefinitionMeaning : public Meaning {
 private:
   size_t up_index;
   size_t right_index;
-  Sexp *binding_value;
+  Value binding_value;
 
 public:
-  DefinitionMeaning(size_t up, size_t right, Sexp *value)
+  DefinitionMeaning(size_t up, size_t right, Value value)
       : up_index(up), right_index(right), binding_value(value) {}
 
-  Trampoline Eval(Sexp *act) override;
-  void TracePointers(std::function<void(Sexp **)> func) override {
-    func(&binding_value);
+  Trampoline Eval(Value act) override;
+  void Compile(Compiler &compiler, bool tail) override;
+  const Closure *CompileClosure(ClosureCompiler &compiler) override;
+  MeaningPointers Pointers() override {
+    return {{&binding_value}, 1, nullptr};
   }
 
   void Dump(std::ostream &out) override {
     assert(binding_value->IsMeaning());
     out << "(meaning-define " << up_index << " " << right_index << " ";
-    binding_value->meaning->Dump(out);
+    binding_value->AsObject()->meaning->Dump(out);
     out << ")";
   }
 
-  Sexp *&BindingValue() { return binding_value; }
+  Value &BindingValue() { return binding_value; }
 };
 
 // A SetMeaning is a meaning for the `set!` form, which sets a value
@@ -151,25 +208,27 @@ class SetMeaning : public Meaning {
 private:
   size_t up_index;
   size_t right_index;
-  Sexp *binding_value;
+  Value binding_value;
 
 public:
-  SetMeaning(size_t up, size_t right, Sexp *binding)
+  SetMeaning(size_t up, size_t right, Value binding)
       : up_index(up), right_index(right), binding_value(binding) {}
 
-  Trampoline Eval(Sexp *act) override;
-  void TracePointers(std::function<void(Sexp **)> func) override {
-    func(&binding_value);
+  Trampoline Eval(Value act) override;
+  void Compile(Compiler &compiler, bool tail) override;
+  const Closure *CompileClosure(ClosureCompiler &compiler) override;
+  MeaningPointers Pointers() override {
+    return {{&binding_value}, 1, nullptr};
   }
 
   void Dump(std::ostream &out) override {
     assert(binding_value->IsMeaning());
     out << "(meaning-set " << up_index << " " << right_index << " ";
-    binding_value->meaning->Dump(out);
+    binding_value->AsObject()->meaning->Dump(out);
     out << ")";
   }
 
-  Sexp *&BindingValue() { return binding_value; }
+  Value &BindingValue() { return binding_value; }
 };
 
 // A ConditionaMeaning is a meaning for the `if` form, which evaluates
@@ -177,19 +236,19 @@ public:
 // result of the condition.
 class ConditionalMeaning : public Meaning {
 private:
-  Sexp *condition;
-  Sexp *true_branch;
-  Sexp *false_branch;
+  Value condition;
+  Value true_branch;
+  Value false_branch;
 
 public:
-  ConditionalMeaning(Sexp *cond, Sexp *tb, Sexp *fb)
+  ConditionalMeaning(Value cond, Value tb, Value fb)
       : condition(cond), true_branch(tb), false_branch(fb) {}
 
-  Trampoline Eval(Sexp *act) override;
-  void TracePointers(std::function<void(Sexp **)> func) override {
-    func(&condition);
-    func(&true_branch);
-    func(&false_branch);
+  Trampoline Eval(Value act) override;
+  void Compile(Compiler &compiler, bool tail) override;
+  const Closure *CompileClosure(ClosureCompiler &compiler) override;
+  MeaningPointers Pointers() override {
+    return {{&condition, &true_branch, &false_branch}, 3, nullptr};
   }
 
   void Dump(std::ostream &out) override {
@@ -197,17 +256,17 @@ public:
     assert(true_branch->IsMeaning());
     assert(false_branch->IsMeaning());
     out << "(meaning-if ";
-    condition->meaning->Dump(out);
+    condition->AsObject()->meaning->Dump(out);
     out << " ";
-    true_branch->meaning->Dump(out);
+    true_branch->AsObject()->meaning->Dump(out);
     out << " ";
-    false_branch->meaning->Dump(out);
+    false_branch->AsObject()->meaning->Dump(out);
     out << ")";
   }
 
-  Sexp *&Condition() { return condition; }
-  Sexp *&TrueBranch() { return true_branch; }
-  Sexp *&FalseBranch() { return false_branch; }
+  Value &Condition() { return condition; }
+  Value &TrueBranch() { return true_branch; }
+  Value &FalseBranch() { return false_branch; }
 };
 
 // A SequenceMeaning is a meaning for the `begin` form, which
@@ -215,28 +274,26 @@ public:
 // returning the value of the final form.
 class SequenceMeaning : public Meaning {
 private:
-  std::vector<Sexp *> body;
-  Sexp *final_form;
+  std::vector<Value> body;
+  Value final_form;
 
 public:
-  SequenceMeaning(std::vector<Sexp *> body, Sexp * final)
+  SequenceMeaning(std::vector<Value> body, Value final)
       : body(std::move(body)), final_form(final) {}
 
-  Trampoline Eval(Sexp *act) override;
-  void TracePointers(std::function<void(Sexp **)> func) override {
-    for (auto &form : body) {
-      func(&form);
-    }
-
-    func(&final_form);
+  Trampoline Eval(Value act) override;
+  void Compile(Compiler &compiler, bool tail) override;
+  const Closure *CompileClosure(ClosureCompiler &compiler) override;
+  MeaningPointers Pointers() override {
+    return {{&final_form}, 1, &body};
   }
 
   void Dump(std::ostream &out) override {
     assert(final_form->IsMeaning());
     out << "(meaning-sequence ";
-    for (Sexp *b : body) {
+    for (Value b : body) {
       assert(b->IsMeaning());
-      b->meaning->Dump(out);
+      b->AsObject()->meaning->Dump(out);
       out << " ";
     }
 
@@ -247,8 +304,8 @@ public:
     out << ")";
   }
 
-  std::vector<Sexp *> &Body() { return body; }
-  Sexp *&FinalForm() { return final_form; }
+  std::vector<Value> &Body() { return body; }
+  Value &FinalForm() { return final_form; }
 };
 
 // A LambdaMeaning is a meaning for the `lambda` form, which
@@ -257,48 +314,71 @@ class LambdaMeaning : public Meaning {
 private:
   size_t arity;
   bool is_variadic;
-  Sexp *body;
+  // The number of slots that the activations of this lambda have, which
+  // is one for each parameter.
+  size_t slot_count;
+  // Whether there are scopes nested inside of this lambda's, whose closures
+  // can capture its activations.
+  bool has_inner_scopes;
+  Value body;
+  // The MEANING cell that holds this meaning, which the functions that
+  // this lambda creates point to.
+  Value cell;
+  // The MEANING cell of the bytecode that the body was compiled to, or
+  // null if it hasn't been compiled.
+  Value code;
+  // The closure that the body was compiled to, if it was.
+  const Closure *body_closure;
 
 public:
-  LambdaMeaning(size_t arity, bool is_variadic, Sexp *body)
-      : arity(arity), is_variadic(is_variadic), body(body) {}
-
-  Trampoline Eval(Sexp *act) override;
-  void TracePointers(std::function<void(Sexp **)> func) override {
-    func(&body);
+  LambdaMeaning(size_t arity, bool is_variadic, size_t slot_count,
+                bool has_inner_scopes, Value body)
+      : arity(arity), is_variadic(is_variadic), slot_count(slot_count),
+        has_inner_scopes(has_inner_scopes), body(body), cell(nullptr),
+        code(nullptr), body_closure(nullptr) {}
+
+  Trampoline Eval(Value act) override;
+  void Compile(Compiler &compiler, bool tail) override;
+  const Closure *CompileClosure(ClosureCompiler &compiler) override;
+  MeaningPointers Pointers() override {
+    // the tree walker never compiles lambdas.
+    size_t count = code == nullptr ? 1 : 2;
+    return {{&body, &code}, count, nullptr};
   }
 
   void Dump(std::ostream &out) override {
     assert(body->IsMeaning());
     out << "(meaning-lambda " << arity << " ";
-    body->meaning->Dump(out);
+    body->AsObject()->meaning->Dump(out);
     out << ")";
   }
 
   size_t Arity() const { return arity; }
   bool IsVariadic() const { return is_variadic; }
-  Sexp *&Body() { return body; }
+  size_t SlotCount() const { return slot_count; }
+  bool HasInnerScopes() const { return has_inner_scopes; }
+  Value &Body() { return body; }
+  Value Code() const { return code; }
+  const Closure *BodyClosure() const { return body_closure; }
+  void SetCell(Value meaning_cell) { cell = meaning_cell; }
 };
 
 // An InvocationMeaning is a meaning for function calls, which
 // is the normal cause of action when evaluating a list.
 class InvocationMeaning : public Meaning {
 private:
-  Sexp *base;
-  std::vector<Sexp *> arguments;
+  Value base;
+  std::vector<Value> arguments;
 
 public:
-  InvocationMeaning(Sexp *base, std::vector<Sexp *> args)
+  InvocationMeaning(Value base, std::vector<Value> args)
       : base(base), arguments(std::move(args)) {}
 
-  Trampoline Eval(Sexp *act) override;
+  Trampoline Eval(Value act) override;
+  void Compile(Compiler &compiler, bool tail) override;
+  const Closure *CompileClosure(ClosureCompiler &compiler) override;
 
-  void TracePointers(std::function<void(Sexp **)> func) override {
-    func(&base);
-    for (auto &arg : arguments) {
-      func(&arg);
-    }
-  }
+  MeaningPointers Pointers() override { return {{&base}, 1, &arguments}; }
 
   void Dump(std::ostream &out) override {
     assert(base->IsMeaning());
@@ -307,81 +387,77 @@ public:
     base->Dump(out);
     out << " ";
 
-    for (Sexp *b : arguments) {
+    for (Value b : arguments) {
       assert(b->IsMeaning());
-      b->meaning->Dump(out);
+      b->AsObject()->meaning->Dump(out);
       out << " ";
     }
 
     out << ")";
   }
 
-  Sexp *&Base() { return base; }
-  std::vector<Sexp *> &Arguments() { return arguments; }
+  Value &Base() { return base; }
+  std::vector<Value> &Arguments() { return arguments; }
 };
 
 // An AndMeaning is a meaning for the special "and" function
 // call, which will short-circuit on a false argument.
 class AndMeaning : public Meaning {
 private:
-  std::vector<Sexp *> arguments;
+  std::vector<Value> arguments;
 
 public:
-  AndMeaning(std::vector<Sexp *> args) : arguments(std::move(args)) {}
+  AndMeaning(std::vector<Value> args) : arguments(std::move(args)) {}
 
-  Trampoline Eval(Sexp *act) override;
+  Trampoline Eval(Value act) override;
+  void Compile(Compiler &compiler, bool tail) override;
+  const Closure *CompileClosure(ClosureCompiler &compiler) override;
 
-  void TracePointers(std::function<void(Sexp **)> func) override {
-    for (auto &arg : arguments) {
-      func(&arg);
-    }
-  }
+  MeaningPointers Pointers() override { return {{}, 0, &arguments}; }
 
   void Dump(std::ostream &out) override {
     out << "(meaning-and ";
-    for (Sexp *b : arguments) {
+    for (Value b : arguments) {
       assert(b->IsMeaning());
-      b->meaning->Dump(out);
+      b->AsObject()->meaning->Dump(out);
       out << " ";
     }
 
     out << ")";
   }
 
-  std::vector<Sexp *> &Arguments() { return arguments; }
+  std::vector<Value> &Arguments() { return arguments; }
 };
 
 // An OrMeaning is a meaning for the special "and" function
 // call, which will short-circuit on a true argument.
 class OrMeaning : public Meaning {
 private:
-  std::vector<Sexp *> arguments;
+  std::vector<Value> arguments;
 
 public:
-  OrMeaning(std::vector<Sexp *> args) : arguments(std::move(args)) {}
+  OrMeaning(std::vector<Value> args) : arguments(std::move(args)) {}
 
-  Trampoline Eval(Sexp *act) override;
+  Trampoline Eval(Value act) override;
+  void Compile(Compiler &compiler, bool tail) override;
+  const Closure *CompileClosure(ClosureCompiler &compiler) override;
 
-  void TracePointers(std::function<void(Sexp **)> func) override {
-    for (auto &arg : arguments) {
-      func(&arg);
-    }
-  }
+  MeaningPointers Pointers() override { return {{}, 0, &arguments}; }
 
   void Dump(std::ostream &out) override {
     out << "(meaning-or ";
-    for (Sexp *b : arguments) {
+    for (Value b : arguments) {
       assert(b->IsMeaning());
-      b->meaning->Dump(out);
+      b->AsObject()->meaning->Dump(out);
       out << " ";
     }
 
     out << ")";
   }
 
-  std::vector<Sexp *> &Arguments() { return arguments; }
+  std::vector<Value> &Arguments() { return arguments; }
 };
 
 // Completely evaluate a meaning, calling thunks repeatedly
 // until a value is returned.
-Sexp *Evaluate(Sexp *meaning, Sexp *act);
\ No newline at end of file
+Value Evaluate(Value meaning, Value act);
\ No newline at end of file
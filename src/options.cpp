@@ -20,32 +20,138 @@
 // SOFTWARE.
 #include "options.h"
 #include "util.h"
-#include <iostream>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
 #include <cstring>
+#include <iostream>
 
 Options g_options;
 
+// Default semispace sizes. The minimum is the size of the heap
+// before it was growable.
+const size_t default_heap_initial_size = 64 * 1024;
+const size_t default_heap_min_size = 16 * 1024;
+const size_t default_heap_max_size = 512 * 1024 * 1024;
+const size_t default_nursery_size = 256 * 1024;
+const size_t max_gc_threads = 256;
+const size_t default_gc_max_pause_us = 1000;
+
 const char *usage =
     "Jet interpreter, by Sean Gillespie\n"
     "\n"
     "usage: jet <file.jet> [-h|--help] [-s|--stdlib-path] [--gc-stress]\n"
-    "                      [-w|--warnings] [--heap-verify]"
+    "                      [-w|--warnings] [--heap-verify] [--gc-stats]\n"
+    "                      [--heap-initial-size] [--heap-min-size]\n"
+    "                      [--heap-max-size] [--heap-soft-limit] [--gc]\n"
+    "                      [--gc-nursery-size] [--gc-threads]\n"
+    "                      [--gc-max-pause-us] [--gc-copy-order]\n"
+    "                      [--gc-rss-target] [--gc-huge-pages]\n"
+    "                      [--gc-no-helper-thread] [--interpreter]"
     "\n"
     "options:\n"
-    "   -h|--help         Displays this message.\n"
-    "   -s|--stdlib-path  Sets the path to the Jet standard library.\n"
-    "   -w|--warnings     Emits warnings for possibly unbound variables.\n"
-    "   --gc-stress       Enables GC stress. Debug builds only.\n"
-    "   --heap-verify     Verify the heap before and after a GC. Debug builds "
-    "only.";
+    "   -h|--help           Displays this message.\n"
+    "   -s|--stdlib-path    Sets the path to the Jet standard library.\n"
+    "   -w|--warnings       Emits warnings for possibly unbound variables, "
+    "and when\n"
+    "                       the heap goes over its soft limit.\n"
+    "   --gc-stress         Enables GC stress. Debug builds only.\n"
+    "   --heap-verify       Verify the heap before and after a GC. Debug "
+    "builds only.\n"
+    "   --gc-stats          Prints GC statistics to stderr on exit.\n"
+    "   --heap-initial-size Sets the initial size of a semispace, e.g. 64k.\n"
+    "   --heap-min-size     Sets the size below which a semispace will not "
+    "shrink.\n"
+    "   --heap-max-size     Sets the size above which a semispace will not "
+    "grow.\n"
+    "                       Allocating past it is a runtime error.\n"
+    "   --heap-soft-limit   Sets a size past which the heap collects more "
+    "often.\n"
+    "   --gc                Selects the garbage collector: semispace, "
+    "generational,\n"
+    "                       incremental, marksweep or markregion.\n"
+    "   --gc-nursery-size   Sets the size of the generational GC's nursery.\n"
+    "   --gc-threads        Sets the number of threads used by a full "
+    "copying\n"
+    "                       collection.\n"
+    "   --gc-max-pause-us   Sets the pause time that the incremental GC aims "
+    "for.\n"
+    "   --gc-copy-order     Sets the order in which live objects are copied, "
+    "depth-first\n"
+    "                       (the default) or list.\n"
+    "   --gc-rss-target     Sets a footprint that the heap is kept under "
+    "when it can.\n"
+    "   --gc-huge-pages     Backs the heap with transparent huge pages.\n"
+    "   --gc-no-helper-thread\n"
+    "                       Runs finalizers during collections instead of on "
+    "a\n"
+    "                       thread of their own.\n"
+    "   --interpreter       Selects how programs are run: bytecode, closure\n"
+    "                       or tree.";
 
 [[noreturn]] static void ParseError(const char *msg) {
   std::cout << "command line parse error: " << msg << std::endl;
   std::exit(1);
 }
 
+// Parses a size given on the command line. Sizes are a number of bytes,
+// optionally followed by a k, m, or g suffix, and are rounded up to
+// a multiple of the page size.
+static size_t ParseSize(const char *str) {
+  char *end;
+  errno = 0;
+  unsigned long long size = strtoull(str, &end, 10);
+  if (end == str) {
+    ParseError("expected a size");
+  }
+
+  size_t multiplier = 1;
+  switch (*end) {
+  case 'k':
+  case 'K':
+    multiplier = 1024;
+    end++;
+    break;
+  case 'm':
+  case 'M':
+    multiplier = 1024 * 1024;
+    end++;
+    break;
+  case 'g':
+  case 'G':
+    multiplier = 1024 * 1024 * 1024;
+    end++;
+    break;
+  default:
+    break;
+  }
+
+  // a size too big to represent would otherwise wrap around silently, or
+  // saturate, and be taken for some unrelated size.
+  if (*end != '\0' || size == 0 || errno == ERANGE ||
+      size > (SIZE_MAX - (PAGE_SIZE - 1)) / multiplier) {
+    ParseError("invalid size");
+  }
+
+  size *= multiplier;
+  return (size_t)((size + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE);
+}
+
 void ParseOptions(int argc, char **argv) {
   g_options = Options();
+  g_options.heap_initial_size = default_heap_initial_size;
+  g_options.heap_min_size = default_heap_min_size;
+  g_options.heap_max_size = default_heap_max_size;
+  g_options.heap_soft_limit = 0;
+  g_options.gc_kind = GcKind::Semispace;
+  g_options.nursery_size = default_nursery_size;
+  g_options.gc_threads = 1;
+  g_options.gc_max_pause_us = default_gc_max_pause_us;
+  g_options.gc_copy_order = CopyOrder::DepthFirst;
+  g_options.gc_rss_target = 0;
+  g_options.gc_huge_pages = false;
+  g_options.gc_helper_thread = true;
+  g_options.interpreter = Interpreter::Bytecode;
   int i = 1;
   bool seen_input_file = false;
   while (i < argc) {
@@ -82,6 +188,180 @@ void ParseOptions(int argc, char **argv) {
       continue;
     }
 
+    if (strcmp("--gc-stats", argv[i]) == 0) {
+      i++;
+      g_options.gc_stats = true;
+      continue;
+    }
+
+    if (strcmp("--heap-initial-size", argv[i]) == 0) {
+      i++;
+      if (i >= argc) {
+        ParseError("expected argument for initial heap size");
+      }
+
+      g_options.heap_initial_size = ParseSize(argv[i++]);
+      continue;
+    }
+
+    if (strcmp("--heap-min-size", argv[i]) == 0) {
+      i++;
+      if (i >= argc) {
+        ParseError("expected argument for minimum heap size");
+      }
+
+      g_options.heap_min_size = ParseSize(argv[i++]);
+      continue;
+    }
+
+    if (strcmp("--heap-max-size", argv[i]) == 0) {
+      i++;
+      if (i >= argc) {
+        ParseError("expected argument for maximum heap size");
+      }
+
+      g_options.heap_max_size = ParseSize(argv[i++]);
+      continue;
+    }
+
+    if (strcmp("--heap-soft-limit", argv[i]) == 0) {
+      i++;
+      if (i >= argc) {
+        ParseError("expected argument for soft heap limit");
+      }
+
+      g_options.heap_soft_limit = ParseSize(argv[i++]);
+      continue;
+    }
+
+    if (strcmp("--gc", argv[i]) == 0) {
+      i++;
+      if (i >= argc) {
+        ParseError("expected argument for garbage collector");
+      }
+
+      if (strcmp("semispace", argv[i]) == 0) {
+        g_options.gc_kind = GcKind::Semispace;
+      } else if (strcmp("generational", argv[i]) == 0) {
+        g_options.gc_kind = GcKind::Generational;
+      } else if (strcmp("incremental", argv[i]) == 0) {
+        g_options.gc_kind = GcKind::Incremental;
+      } else if (strcmp("marksweep", argv[i]) == 0) {
+        g_options.gc_kind = GcKind::MarkSweep;
+      } else if (strcmp("markregion", argv[i]) == 0) {
+        g_options.gc_kind = GcKind::MarkRegion;
+      } else {
+        ParseError("unknown garbage collector");
+      }
+
+      i++;
+      continue;
+    }
+
+    if (strcmp("--gc-nursery-size", argv[i]) == 0) {
+      i++;
+      if (i >= argc) {
+        ParseError("expected argument for nursery size");
+      }
+
+      g_options.nursery_size = ParseSize(argv[i++]);
+      continue;
+    }
+
+    if (strcmp("--gc-threads", argv[i]) == 0) {
+      i++;
+      if (i >= argc) {
+        ParseError("expected argument for number of GC threads");
+      }
+
+      char *end;
+      unsigned long threads = strtoul(argv[i], &end, 10);
+      if (*end != '\0' || threads == 0 || threads > max_gc_threads) {
+        ParseError("invalid number of GC threads");
+      }
+
+      g_options.gc_threads = threads;
+      i++;
+      continue;
+    }
+
+    if (strcmp("--gc-max-pause-us", argv[i]) == 0) {
+      i++;
+      if (i >= argc) {
+        ParseError("expected argument for maximum pause time");
+      }
+
+      char *end;
+      unsigned long pause = strtoul(argv[i], &end, 10);
+      if (*end != '\0' || pause == 0) {
+        ParseError("invalid maximum pause time");
+      }
+
+      g_options.gc_max_pause_us = pause;
+      i++;
+      continue;
+    }
+
+    if (strcmp("--gc-copy-order", argv[i]) == 0) {
+      i++;
+      if (i >= argc) {
+        ParseError("expected argument for copy order");
+      }
+
+      if (strcmp("list", argv[i]) == 0) {
+        g_options.gc_copy_order = CopyOrder::List;
+      } else if (strcmp("depth-first", argv[i]) == 0) {
+        g_options.gc_copy_order = CopyOrder::DepthFirst;
+      } else {
+        ParseError("unknown copy order");
+      }
+
+      i++;
+      continue;
+    }
+
+    if (strcmp("--gc-rss-target", argv[i]) == 0) {
+      i++;
+      if (i >= argc) {
+        ParseError("expected argument for RSS target");
+      }
+
+      g_options.gc_rss_target = ParseSize(argv[i++]);
+      continue;
+    }
+
+    if (strcmp("--gc-huge-pages", argv[i]) == 0) {
+      i++;
+      g_options.gc_huge_pages = true;
+      continue;
+    }
+
+    if (strcmp("--gc-no-helper-thread", argv[i]) == 0) {
+      i++;
+      g_options.gc_helper_thread = false;
+      continue;
+    }
+
+    if (strcmp("--interpreter", argv[i]) == 0) {
+      i++;
+      if (i >= argc) {
+        ParseError("expected argument for interpreter");
+      }
+
+      if (strcmp("bytecode", argv[i]) == 0) {
+        g_options.interpreter = Interpreter::Bytecode;
+      } else if (strcmp("closure", argv[i]) == 0) {
+        g_options.interpreter = Interpreter::Closure;
+      } else if (strcmp("tree", argv[i]) == 0) {
+        g_options.interpreter = Interpreter::Tree;
+      } else {
+        ParseError("unknown interpreter");
+      }
+
+      i++;
+      continue;
+    }
+
     if (!seen_input_file) {
       seen_input_file = true;
       g_options.input_file = argv[i++];
@@ -105,4 +385,38 @@ void ValidateOptions() {
     std::cout << usage << std::endl;
     std::exit(1);
   }
+
+  if (g_options.heap_min_size > g_options.heap_max_size) {
+    std::cout << "error: minimum heap size is larger than the maximum heap "
+                 "size"
+              << std::endl;
+    std::exit(1);
+  }
+
+  if (g_options.gc_kind == GcKind::Generational &&
+      g_options.nursery_size > g_options.heap_max_size) {
+    std::cout << "error: nursery size is larger than the maximum heap size"
+              << std::endl;
+    std::exit(1);
+  }
+
+#ifdef CONSERVATIVE_GC
+  // pinned pages are only handled by the plain semispace collector.
+  if (g_options.gc_kind != GcKind::Semispace || g_options.gc_threads != 1) {
+    std::cout << "error: a conservative build only supports the semispace "
+                 "collector with one GC thread"
+              << std::endl;
+    std::exit(1);
+  }
+#endif
+
+  // the initial size is only a hint, so it's clamped to the valid range
+  // instead of being rejected.
+  if (g_options.heap_initial_size < g_options.heap_min_size) {
+    g_options.heap_initial_size = g_options.heap_min_size;
+  }
+
+  if (g_options.heap_initial_size > g_options.heap_max_size) {
+    g_options.heap_initial_size = g_options.heap_max_size;
+  }
 }
@@ -20,14 +20,90 @@
 // SOFTWARE.
 #pragma once
 
+#include <cstddef>
 #include <string>
 
+// The garbage collectors that Jet can use.
+enum class GcKind {
+  // A plain semispace copying collector.
+  Semispace,
+  // A nursery in front of the semispaces, which are used
+  // as the old generation.
+  Generational,
+  // A semispace collector that copies a little at a time
+  // while the program runs.
+  Incremental,
+  // A non-moving collector that marks live objects in place and
+  // sweeps dead ones onto free lists.
+  MarkSweep,
+  // An Immix-style collector that marks live objects in place along
+  // with the lines of the pages they're on, allocates into the lines
+  // that aren't in use, and evacuates the objects on sparse pages.
+  MarkRegion
+};
+
+// The order in which a stop-the-world collection copies objects.
+enum class CopyOrder {
+  // Each object's children are copied as soon as it is scanned, and
+  // scanning is depth first.
+  DepthFirst,
+  // The spine of a list is copied in one go, followed by the lists
+  // hanging off of it in order, so that a list's cells end up next to
+  // each other in the order that they're traversed. bench/gc_locality.jet
+  // hasn't shown it to make traversing lists any faster, so it isn't the
+  // default.
+  List
+};
+
+// The ways that Jet can run a program.
+enum class Interpreter {
+  // Meanings are compiled to bytecode, which is run by a VM.
+  Bytecode,
+  // Meanings are compiled to a tree of specialized C++ closures.
+  Closure,
+  // Meanings are evaluated directly, by walking them.
+  Tree
+};
+
 struct Options {
   std::string stdlib_path;
   std::string input_file;
   bool gc_stress;
   bool heap_verify;
   bool emit_warnings;
+  bool gc_stats;
+  // Sizes of a single semispace, in bytes. The heap starts out at
+  // heap_initial_size and is resized by the GC, but never outside
+  // of the range [heap_min_size, heap_max_size].
+  // The mark-sweep and mark-region collectors don't have semispaces, so
+  // for them these are the sizes of the whole heap. heap_max_size is a
+  // hard limit: an allocation that doesn't fit under it throws a
+  // JetRuntimeException.
+  size_t heap_initial_size;
+  size_t heap_min_size;
+  size_t heap_max_size;
+  // The size, on the same terms, past which the heap is only grown when
+  // it's nearly full and the soft limit hook is called. Zero if there
+  // isn't one.
+  size_t heap_soft_limit;
+  GcKind gc_kind;
+  // Size of the nursery, in bytes. Only used by the generational GC.
+  size_t nursery_size;
+  // Number of threads that do the copying in a full collection.
+  size_t gc_threads;
+  // The longest that a slice of an incremental collection should take,
+  // in microseconds.
+  size_t gc_max_pause_us;
+  CopyOrder gc_copy_order;
+  // The footprint, in bytes, that the heap is sized to stay under when it
+  // can. Zero if there isn't one.
+  size_t gc_rss_target;
+  // Whether the heap asks for transparent huge pages.
+  bool gc_huge_pages;
+  // Whether finalizers are run, and evacuated memory is decommitted, on
+  // a thread of their own instead of during a collection.
+  bool gc_helper_thread;
+  Interpreter interpreter;
 };
 
 extern Options g_options;
@@ -29,9 +29,9 @@
 using namespace std::literals;
 
 // Prototypes for our mutually-recursive read functions
-static Sexp *ReadSublist(std::istream &);
-static Sexp *ReadAtom(std::istream &);
-static Sexp *ReadToplevel(std::istream &);
+static Value ReadSublist(std::istream &);
+static Value ReadAtom(std::istream &);
+static Value ReadToplevel(std::istream &);
 
 static char list_delimiter_stack[PAREN_NESTING_DEPTH_MAX];
 static size_t list_delimiter_stack_index;
@@ -119,38 +119,35 @@ static bool IsIdentStart(char c) {
 
 static bool IsIdentBody(char c) { return IsIdentStart(c) || isdigit(c); }
 
-static Sexp *ReadSublist(std::istream &input) {
+static Value ReadSublist(std::istream &input) {
   // at this point, we are reading a list and we've already read
   // the opening paren.
   //   (call 1 2 3)
   //    ^--- we are here
+  //
+  // the elements are all read before any of the list is allocated, so
+  // that it can be allocated in one go.
   GC_HELPER_FRAME;
-  GC_PROTECTED_LOCAL(car);
-  GC_PROTECTED_LOCAL(cdr);
+  GC_PROTECTED_LOCAL(tail);
+  GC_PROTECTED_LOCAL_VECTOR(elements);
 
-  if (IsAtListEnd(input)) {
-    return GcHeap::AllocateEmpty();
-  }
-
-  SkipWhitespace(input);
-  car = ReadAtom(input);
-  SkipWhitespace(input);
-  if (!IsAtListEnd(input)) {
-    if (Peek(input) == '.') {
+  tail = GcHeap::AllocateEmpty();
+  while (!IsAtListEnd(input)) {
+    SkipWhitespace(input);
+    elements.push_back(ReadAtom(input));
+    SkipWhitespace(input);
+    if (!IsAtListEnd(input) && Peek(input) == '.') {
       // this is an improper list.
       Expect(input, '.');
-      cdr = ReadAtom(input);
-      return GcHeap::AllocateCons(car, cdr);
+      tail = ReadAtom(input);
+      break;
     }
-
-    cdr = ReadSublist(input);
-    return GcHeap::AllocateCons(car, cdr);
   }
 
-  return GcHeap::AllocateCons(car, GcHeap::AllocateEmpty());
+  return GcHeap::AllocateList(elements, tail);
 }
 
-static Sexp *ReadSymbol(std::istream &input) {
+static Value ReadSymbol(std::istream &input) {
   std::ostringstream buf;
   buf << (char)input.get();
 
@@ -169,7 +166,7 @@ static Sexp *ReadSymbol(std::istream &input) {
   return GcHeap::AllocateSymbol(intern_index);
 }
 
-static Sexp *ReadFixnum(std::istream &input) {
+static Value ReadFixnum(std::istream &input) {
   std::ostringstream buf;
   buf << (char)input.get();
   while (true) {
@@ -189,7 +186,7 @@ static Sexp *ReadFixnum(std::istream &input) {
   return GcHeap::AllocateFixnum(num);
 }
 
-static Sexp *ReadHash(std::istream &input) {
+static Value ReadHash(std::istream &input) {
   assert(Peek(input) == '#');
   Expect(input, '#');
   char peeked = Peek(input);
@@ -211,7 +208,7 @@ static Sexp *ReadHash(std::istream &input) {
   return GcHeap::AllocateEof();
 }
 
-static Sexp *ReadString(std::istream &input) {
+static Value ReadString(std::istream &input) {
   assert(Peek(input) == '"');
   Expect(input, '"');
   std::ostringstream buf;
@@ -229,31 +226,41 @@ static Sexp *ReadString(std::istream &input) {
   return GcHeap::AllocateString(buf.str().c_str());
 }
 
-static Sexp *ReadQuote(std::istream &input) {
+// Builds the two-element list (symbol quoted). The order of evaluation
+// of function arguments is unspecified, so each allocation has to be
+// stored into a protected local before the next one can trigger a GC.
+static Value MakeQuoteForm(size_t symbol, Value quoted) {
+  GC_HELPER_FRAME;
+  GC_PROTECT(quoted);
+  GC_PROTECTED_LOCAL(tail);
+  GC_PROTECTED_LOCAL(sym);
+
+  tail = GcHeap::AllocateCons(quoted, GcHeap::AllocateEmpty());
+  sym = GcHeap::AllocateSymbol(symbol);
+  return GcHeap::AllocateCons(sym, tail);
+}
+
+static Value ReadQuote(std::istream &input) {
   GC_HELPER_FRAME;
   GC_PROTECTED_LOCAL(quoted);
 
   assert(Peek(input) == '\'');
   Expect(input, '\'');
   quoted = ReadToplevel(input);
-  return GcHeap::AllocateCons(
-      GcHeap::AllocateSymbol(SymbolInterner::Quote),
-      GcHeap::AllocateCons(quoted, GcHeap::AllocateEmpty()));
+  return MakeQuoteForm(SymbolInterner::Quote, quoted);
 }
 
-static Sexp *ReadQuasiquote(std::istream &input) {
+static Value ReadQuasiquote(std::istream &input) {
   GC_HELPER_FRAME;
   GC_PROTECTED_LOCAL(quoted);
 
   assert(Peek(input) == '`');
   Expect(input, '`');
   quoted = ReadToplevel(input);
-  return GcHeap::AllocateCons(
-      GcHeap::AllocateSymbol(SymbolInterner::Quasiquote),
-      GcHeap::AllocateCons(quoted, GcHeap::AllocateEmpty()));
+  return MakeQuoteForm(SymbolInterner::Quasiquote, quoted);
 }
 
-static Sexp *ReadUnquote(std::istream &input) {
+static Value ReadUnquote(std::istream &input) {
   GC_HELPER_FRAME;
   GC_PROTECTED_LOCAL(quoted);
 
@@ -262,18 +269,14 @@ static Sexp *ReadUnquote(std::istream &input) {
   if (Peek(input) == '@') {
     Expect(input, '@');
     quoted = ReadToplevel(input);
-    return GcHeap::AllocateCons(
-        GcHeap::AllocateSymbol(SymbolInterner::UnquoteSplicing),
-        GcHeap::AllocateCons(quoted, GcHeap::AllocateEmpty()));
+    return MakeQuoteForm(SymbolInterner::UnquoteSplicing, quoted);
   }
 
   quoted = ReadToplevel(input);
-  return GcHeap::AllocateCons(
-      GcHeap::AllocateSymbol(SymbolInterner::Unquote),
-      GcHeap::AllocateCons(quoted, GcHeap::AllocateEmpty()));
+  return MakeQuoteForm(SymbolInterner::Unquote, quoted);
 }
 
-static Sexp *ReadAtom(std::istream &input) {
+static Value ReadAtom(std::istream &input) {
   GC_HELPER_FRAME;
   GC_PROTECTED_LOCAL(result);
 
@@ -318,7 +321,7 @@ static Sexp *ReadAtom(std::istream &input) {
   throw ReadException("unexpected char when scanning atom: "s + peeked);
 }
 
-static Sexp *ReadToplevel(std::istream &input) {
+static Value ReadToplevel(std::istream &input) {
   SkipWhitespace(input);
   if (!IsAtListStart(input)) {
     return ReadAtom(input);
@@ -331,13 +334,13 @@ static Sexp *ReadToplevel(std::istream &input) {
     return GcHeap::AllocateEmpty();
   }
 
-  Sexp *sublist = ReadSublist(input);
+  Value sublist = ReadSublist(input);
   SkipWhitespace(input);
   ReadListEnd(input);
   return sublist;
 }
 
-Sexp *Read(std::istream &input) {
+Value Read(std::istream &input) {
   SkipWhitespace(input);
   if (Peek(input) == EOF) {
     return GcHeap::AllocateEof();
@@ -40,4 +40,4 @@ public:
 
 // Reads an s-expression from the given input stream, throwing a
 // ReadException if a parse error occurs.
-Sexp *Read(std::istream &input);
\ No newline at end of file
+Value Read(std::istream &input);
\ No newline at end of file
@@ -26,58 +26,76 @@
 
 #include <iostream>
 
-void Sexp::Finalize() {
-  if (IsString()) {
-    free(const_cast<char *>(this->string_value));
-    return;
-  }
+void Sexp::Finalize() { DetachFinalizer().Run(); }
 
-  if (IsActivation()) {
-    delete this->activation;
-    return;
-  }
+Finalizer Sexp::DetachFinalizer() {
+  Sexp::Kind kind = HeapPage::Of((uint64_t)this)->kind;
+  switch (kind) {
+  case Sexp::Kind::STRING:
+    // only strings that are too long to be stored inline have anything
+    // to free. the code space finalizes all of its strings.
+    if (this->string.chars != (jet_string)InlineStorage()) {
+      return Finalizer{kind, const_cast<char *>(this->string.chars)};
+    }
 
-  if (IsNativeFunction()) {
-    delete this->native_function.func;
-    return;
-  }
+    return Finalizer{kind, nullptr};
+  case Sexp::Kind::SLOTS:
+    if (this->slots.values != (Value *)InlineStorage()) {
+      return Finalizer{kind, this->slots.values};
+    }
 
-  if (IsFunction()) {
-    // TODO this also screws up everything.
-    // delete this->function.func_meaning;
-    return;
+    return Finalizer{kind, nullptr};
+  case Sexp::Kind::NATIVE_FUNCTION:
+    return Finalizer{kind, this->native_function.func};
+  case Sexp::Kind::MEANING:
+    // meanings live in the arena of their compilation unit, which frees
+    // the memory once all of its meanings are dead, so a meaning has to
+    // be finalized before its unit is swept.
+    return Finalizer{kind, this->meaning};
+  default:
+    break;
   }
 
-  if (IsMeaning()) {
-    // TODO this screws up everything.
-    // I'm choosing to leak meanings for now
-    // until I figure out how to address this correctly.
-    // delete this->meaning;
+  PANIC("finalized something that's not finalizable!");
+}
 
+void Finalizer::Run() {
+  switch (kind) {
+  case Sexp::Kind::STRING:
+  case Sexp::Kind::SLOTS:
+    free(resource);
+    return;
+  case Sexp::Kind::NATIVE_FUNCTION:
+    delete static_cast<std::function<Value(Value *)> *>(resource);
     return;
+  case Sexp::Kind::MEANING:
+    static_cast<Meaning *>(resource)->~Meaning();
+    return;
+  default:
+    break;
   }
 
-  PANIC("finalized something that's not finalizable!");
+  PANIC("ran a finalizer for something that's not finalizable!");
 }
 
-void Sexp::DumpAtom(std::ostream &stream) const {
+void Value::DumpAtom(std::ostream &stream) const {
   if (IsString()) {
-    stream << "\"" << this->string_value << "\"";
+    stream << "\"" << AsObject()->string.chars << "\"";
     return;
   }
 
   if (IsSymbol()) {
-    stream << SymbolInterner::GetSymbol(this->symbol_value);
+    stream << SymbolInterner::GetSymbol(AsSymbol());
     return;
   }
 
   if (IsFixnum()) {
-    stream << this->fixnum_value;
+    stream << AsFixnum();
     return;
   }
 
   if (IsBool()) {
-    if (this->bool_value) {
+    if (AsBool()) {
       stream << "#t";
     } else {
       stream << "#f";
@@ -86,6 +104,11 @@ void Sexp::DumpAtom(std::ostream &stream) const {
     return;
   }
 
+  if (IsChar()) {
+    stream << "#\\" << (char)AsChar();
+    return;
+  }
+
   if (IsEof()) {
     stream << "#eof";
     return;
@@ -101,6 +124,11 @@ void Sexp::DumpAtom(std::ostream &stream) const {
     return;
   }
 
+  if (IsSlots()) {
+    stream << "#<slots>";
+    return;
+  }
+
   if (IsFunction()) {
     stream << "#<function>";
     return;
@@ -112,18 +140,18 @@ void Sexp::DumpAtom(std::ostream &stream) const {
   }
 
   if (IsMeaning()) {
-    this->meaning->Dump(stream);
+    AsObject()->meaning->Dump(stream);
     return;
   }
 
-  if (padding == 0xabababababababab) {
+  if (IsObject() && HeapPage::Of(bits)->kind == (Sexp::Kind)0xabababab) {
     PANIC("probable heap corruption detected!");
   }
 
   PANIC("unknown s-expression!");
 }
 
-void Sexp::Dump(std::ostream &stream) const {
+void Value::Dump(std::ostream &stream) const {
   // Simple algorithm for pretty-printing an S-expression.
   // The algorithm goes like this:
   // 1) If self isn't a list, print it and return.
@@ -139,8 +167,8 @@ void Sexp::Dump(std::ostream &stream) const {
   }
 
   stream << "(";
-  Sexp *car = this->cons.car;
-  Sexp *cdr = this->cons.cdr;
+  Value car = Car();
+  Value cdr = Cdr();
   while (1) {
     assert(car != nullptr);
     assert(cdr != nullptr);
@@ -150,8 +178,8 @@ void Sexp::Dump(std::ostream &stream) const {
     }
 
     if (cdr->IsCons()) {
-      car = cdr->cons.car;
-      cdr = cdr->cons.cdr;
+      car = cdr->Car();
+      cdr = cdr->Cdr();
       stream << " ";
       continue;
     }
@@ -164,35 +192,14 @@ void Sexp::Dump(std::ostream &stream) const {
   stream << ")";
 }
 
-void Sexp::TracePointers(std::function<void(Sexp **)> func) {
-  switch (kind) {
-  case Sexp::Kind::CONS:
-    func(&this->cons.car);
-    func(&this->cons.cdr);
-    break;
-  case Sexp::Kind::MACRO:
-  case Sexp::Kind::FUNCTION:
-    this->function.func_meaning->TracePointers(func);
-    func(&this->function.activation);
-    break;
-  case Sexp::Kind::ACTIVATION:
-    this->activation->TracePointers(func);
-    break;
-  case Sexp::Kind::MEANING:
-    this->meaning->TracePointers(func);
-  default:
-    break;
-  }
-}
-
-void Sexp::ForEach(std::function<void(Sexp *)> func) {
+void Value::ForEach(std::function<void(Value)> func) const {
   // The helper frame is crucial here because we do not know
   // whether or not the passed-in lambda will trigger a GC.
   GC_HELPER_FRAME;
   GC_PROTECTED_LOCAL(cursor);
 
   assert(IsProperList());
-  cursor = this;
+  cursor = *this;
   while (!cursor->IsEmpty()) {
     func(cursor->Car());
     cursor = cursor->Cdr();
@@ -21,26 +21,516 @@
 #pragma once
 
 #include "util.h"
+#include <cstring>
 #include <functional>
 #include <iostream>
+#include <limits>
 #include <sstream>
+#include <tuple>
 #include <utility>
 
 typedef bool jet_bool;
 typedef double jet_fixnum;
 typedef const char *jet_string;
-typedef wchar_t *jet_char;
+typedef uint32_t jet_char;
 typedef FILE *jet_port;
 
 struct Sexp;
+struct Cons;
+struct Finalizer;
+
+// A value at runtime. Numbers, booleans, characters, symbols, the empty
+// list and the EOF object are immediates, stored directly in the value.
+// Everything else is a pointer to an object on the managed heap, which
+// is either a Cons or an Sexp.
+//
+// Values are NaN-boxed. Heap pointers are stored as-is, with the high
+// 16 bits clear, so that they can be used without any masking. Doubles
+// have 2^49 added to their bit pattern, which moves every double that
+// isn't a NaN out of the range that pointers use. NaNs are canonicalized
+// so that they do the same. The other immediates have bit 48 set and
+// keep their kind in the bits just under it.
+//
+// Values are used like pointers: operator-> returns the value itself,
+// so that `value->IsFixnum()` works whether or not there's an object
+// behind it.
+class Value {
+public:
+  Value() = default;
+  Value(std::nullptr_t) : bits(0) {}
+  Value(Sexp *object) : bits(reinterpret_cast<uint64_t>(object)) {
+    assert(bits < immediate_tag && "heap pointer out of range");
+  }
+  Value(Cons *cons) : bits(reinterpret_cast<uint64_t>(cons)) {
+    assert(bits < immediate_tag && "heap pointer out of range");
+  }
+
+  static Value Fixnum(jet_fixnum num) {
+    // NaNs can have any payload, so they all get the same one.
+    if (num != num) {
+      num = std::numeric_limits<jet_fixnum>::quiet_NaN();
+    }
+
+    uint64_t num_bits;
+    memcpy(&num_bits, &num, sizeof(num_bits));
+    return FromBits(num_bits + double_offset);
+  }
+
+  static Value Bool(jet_bool b) { return Immediate(BOOL, b ? 1 : 0); }
+  static Value Symbol(size_t sym) { return Immediate(SYMBOL, sym); }
+  static Value Char(jet_char c) { return Immediate(CHARACTER, c); }
+  static Value Empty() { return Immediate(EMPTY, 0); }
+  static Value Eof() { return Immediate(END_OF_FILE, 0); }
+
+  const Value *operator->() const { return this; }
+
+  bool operator==(Value other) const { return bits == other.bits; }
+  bool operator!=(Value other) const { return bits != other.bits; }
+
+  // Returns the raw bits of this value. Only the GC should need this.
+  uint64_t Bits() const { return bits; }
+
+  // Returns a value that points to the object at the given address,
+  // whatever its kind. Only the GC should need this.
+  static Value FromAddress(uint8_t *address) {
+    return FromBits(reinterpret_cast<uint64_t>(address));
+  }
+
+  // Returns true if this value is a pointer to an object on the heap.
+  // Null is not an object.
+  inline bool IsObject() const { return bits != 0 && bits < immediate_tag; }
+
+  // Returns the object that this value points to, which must not be
+  // a cons. Cons cells are accessed through AsCons.
+  inline Sexp *AsObject() const;
+
+  inline Cons *AsCons() const;
+
+  // Returns true if this is the empty list.
+  inline bool IsEmpty() const { return bits == Empty().bits; }
+
+  // Returns true if this is a fixnum.
+  inline bool IsFixnum() const { return bits >= double_offset; }
+
+  // Returns true if this is a bool.
+  inline bool IsBool() const { return IsImmediate(BOOL); }
+
+  // Returns true if this is a symbol.
+  inline bool IsSymbol() const { return IsImmediate(SYMBOL); }
+
+  // Returns true if this is a char.
+  inline bool IsChar() const { return IsImmediate(CHARACTER); }
+
+  // Returns true if this is the EOF object.
+  inline bool IsEof() const { return bits == Eof().bits; }
+
+  inline jet_fixnum AsFixnum() const {
+    assert(IsFixnum());
+    uint64_t num_bits = bits - double_offset;
+    jet_fixnum num;
+    memcpy(&num, &num_bits, sizeof(num));
+    return num;
+  }
+
+  inline jet_bool AsBool() const {
+    assert(IsBool());
+    return Payload() != 0;
+  }
+
+  inline size_t AsSymbol() const {
+    assert(IsSymbol());
+    return Payload();
+  }
+
+  inline jet_char AsChar() const {
+    assert(IsChar());
+    return (jet_char)Payload();
+  }
+
+  // Predicates for values that live on the heap, defined after Sexp.
+  inline bool IsCons() const;
+  inline bool IsString() const;
+  inline bool IsPort() const;
+  inline bool IsActivation() const;
+  inline bool IsNativeFunction() const;
+  inline bool IsFunction() const;
+  inline bool IsMeaning() const;
+  inline bool IsMacro() const;
+  inline bool IsSlots() const;
+
+  // Returns true if this value evaluates to itself when evaluated.
+  // This includes most primitives.
+  inline bool IsAlreadyQuoted() const {
+    return !(IsEmpty() || IsCons() || IsSymbol());
+  }
+
+  // Returns true of this value is "truthy", or evaluates to true
+  // when used as the condition of the `if` special form.
+  inline bool IsTruthy() const { return bits != Bool(false).bits; }
+
+  inline Value Car() const;
+  inline Value Cdr() const;
+  inline Value Cadr() const;
+  inline Value Caddr() const;
+
+  // Returns a tuple of whether or not the list is proper and the list's
+  // length. A length of 0 on an improper list indicates it's not a list,
+  // while an improper list may have a nonzero length as well.
+  inline std::tuple<bool, size_t> Length() const;
+
+  // Returns true if this is a proper list, false otherwise.
+  // A list is proper if every car is a Cons or Empty.
+  inline bool IsProperList() const {
+    if (IsEmpty())
+      return true;
+    bool is_proper;
+    std::tie(is_proper, std::ignore) = Length();
+    return is_proper;
+  }
+
+  // Iterates through a proper list.
+  void ForEach(std::function<void(Value)> func) const;
+
+  // Traces all of the values contained in the object that this value
+  // points to, calling func with the location of each one. This is a
+  // template so that the collector's visitor gets inlined; it's defined
+  // in gc.h, where activations and meanings are complete types.
+  template <typename F> void TracePointers(F func) const;
+
+  // Dumps a debug representation of this value to the given ostream.
+  void Dump(std::ostream &stream) const;
+
+  // Dumps a debug representation of this value to standard out.
+  void Dump() const { Dump(std::cout); }
+
+  // Dumps a debug representation of this value to a string.
+  std::string DumpString() const {
+    std::ostringstream stream;
+    Dump(stream);
+    return stream.str();
+  }
+
+private:
+  enum ImmediateKind : uint64_t { EMPTY, BOOL, SYMBOL, CHARACTER, END_OF_FILE };
+
+  static const uint64_t double_offset = 1ull << 49;
+  static const uint64_t immediate_tag = 1ull << 48;
+  static const int kind_shift = 40;
+  static const uint64_t payload_mask = (1ull << kind_shift) - 1;
+
+  uint64_t bits;
+
+  static Value FromBits(uint64_t bits) {
+    Value value;
+    value.bits = bits;
+    return value;
+  }
+
+  static Value Immediate(ImmediateKind kind, uint64_t payload) {
+    assert(payload <= payload_mask && "immediate payload out of range");
+    return FromBits(immediate_tag | (kind << kind_shift) | payload);
+  }
+
+  inline bool IsImmediate(ImmediateKind kind) const {
+    return (bits & ~payload_mask) == (immediate_tag | (kind << kind_shift));
+  }
+
+  inline uint64_t Payload() const { return bits & payload_mask; }
+
+  void DumpAtom(std::ostream &stream) const;
+
+#ifdef COMPRESSED_REFS
+  friend class ConsField;
+#endif
+};
+
+static_assert(sizeof(Value) == sizeof(uint64_t),
+              "values must fit in a single word");
+
+#ifdef COMPRESSED_REFS
+// The start of the range of memory that every heap object lives in.
+// Maintained by the GC.
+extern uint8_t *g_heap_base;
+
+// A field that only ever holds a pointer to a heap object, or null. Most
+// fields can hold any value, numbers included, so they have to be a whole
+// Value, but in a build with compressed references (COMPRESSED_REFS) these
+// are stored as 32-bit offsets from g_heap_base instead. Objects are
+// word-aligned, so the offset is in words, and can reach 32 GB of heap.
+class HeapRef {
+public:
+  HeapRef() = default;
+  HeapRef(std::nullptr_t) : offset(0) {}
+  HeapRef(Value value) { *this = value; }
+
+  HeapRef &operator=(std::nullptr_t) {
+    offset = 0;
+    return *this;
+  }
+
+  HeapRef &operator=(Value value) {
+    if (value == nullptr) {
+      offset = 0;
+      return *this;
+    }
+
+    assert(value.IsObject() && "only heap objects can be compressed");
+    uint64_t words = (value.Bits() - (uintptr_t)g_heap_base) >> 3;
+    assert(words != 0 && words <= UINT32_MAX && "heap pointer out of range");
+    offset = (uint32_t)words;
+    return *this;
+  }
+
+  operator Value() const {
+    if (offset == 0) {
+      return nullptr;
+    }
+
+    return Value::FromAddress(g_heap_base + ((uint64_t)offset << 3));
+  }
+
+  Value operator->() const { return *this; }
+
+  bool operator==(std::nullptr_t) const { return offset == 0; }
+  bool operator!=(std::nullptr_t) const { return offset != 0; }
+
+private:
+  uint32_t offset;
+};
+
+// Calls func with the location of the value in a compressed field. The
+// GC's visitors work on Values, so they're handed a copy, and whatever
+// they leave in it is compressed again.
+template <typename F> void TraceRef(HeapRef *ref, F func) {
+  Value value = *ref;
+  Value old = value;
+  func(&value);
+  if (value != old) {
+    *ref = value;
+  }
+}
+
+// A field of a cons cell. Conses are the most common objects by far, so in
+// a build with compressed references they're only two of these, and each
+// one is 32 bits. That's enough for any value but a number: a heap
+// reference is stored as an even offset (in words) from g_heap_base, which
+// can reach 16 GB, and the other immediates as 01 in the low bits, with
+// their kind and payload above that. Numbers are boxed into a BOX object
+// (see GcHeap::BoxNumber) before they're stored, and Car and Cdr unbox
+// them again. Nothing is ever stored with both low bits set, which the GC
+// uses to tell that a cons has been copied.
+class ConsField {
+public:
+  ConsField() = default;
+  ConsField(std::nullptr_t) : bits(0) {}
+  ConsField(Value value) { *this = value; }
+
+  ConsField &operator=(Value value) {
+    if (value.IsObject()) {
+      uint64_t words = (value.Bits() - (uintptr_t)g_heap_base) >> 3;
+      assert(words != 0 && words <= max_words && "heap pointer out of range");
+      bits = (uint32_t)words << 1;
+    } else if (value == nullptr) {
+      bits = 0;
+    } else {
+      assert(!value.IsFixnum() && "numbers have to be boxed");
+      uint64_t kind = (value.Bits() >> Value::kind_shift) & kind_mask;
+      assert(value.Payload() <= max_payload && "immediate out of range");
+      bits = (uint32_t)((value.Payload() << payload_shift) |
+                        (kind << kind_shift) | immediate_tag);
+    }
+
+    return *this;
+  }
+
+  operator Value() const {
+    if ((bits & immediate_tag) == 0) {
+      if (bits == 0) {
+        return nullptr;
+      }
+
+      return Value::FromAddress(g_heap_base + ((uint64_t)(bits >> 1) << 3));
+    }
+
+    auto kind = (Value::ImmediateKind)((bits >> kind_shift) & kind_mask);
+    return Value::Immediate(kind, bits >> payload_shift);
+  }
+
+private:
+  static const uint32_t immediate_tag = 1;
+  static const int kind_shift = 2;
+  static const uint64_t kind_mask = 7;
+  static const int payload_shift = 5;
+  static const uint64_t max_payload = UINT32_MAX >> payload_shift;
+  static const uint64_t max_words = UINT32_MAX >> 1;
+
+  uint32_t bits;
+};
+
+template <typename F> void TraceRef(ConsField *field, F func) {
+  Value value = *field;
+  Value old = value;
+  func(&value);
+  if (value != old) {
+    *field = value;
+  }
+}
+#else
+typedef Value HeapRef;
+typedef Value ConsField;
+
+template <typename F> void TraceRef(HeapRef *ref, F func) { func(ref); }
+#endif
+
+// The range of memory that an incremental collection is evacuating, or
+// an empty range if there isn't one in progress. Maintained by the GC.
+extern uint8_t *g_condemned_start;
+extern uint8_t *g_condemned_end;
+
+// Copies the object that a field points to out of the condemned range,
+// updates the field, and returns the new value. Defined in gc.cpp.
+Value GcForwardField(Value *field);
+
+// GC_READ_BARRIER must be used to load a value out of a heap object, or
+// out of a structure owned by one (activations and meanings), whenever
+// the value is going to be used by the interpreter. While an incremental
+// collection is in progress, this makes sure that the interpreter only
+// ever sees objects that have already been copied. It never triggers a GC.
+//
+// This lives here rather than in gc.h because the accessors on Value
+// need it.
+#define GC_READ_BARRIER(field) GcReadBarrier(&(field))
+
+inline Value GcReadBarrier(const Value *field) {
+  Value value = *field;
+  // immediates are never in the condemned range.
+  if (value.Bits() >= (uintptr_t)g_condemned_start &&
+      value.Bits() < (uintptr_t)g_condemned_end) {
+    value = GcForwardField(const_cast<Value *>(field));
+  }
+
+  return value;
+}
+
+#ifdef COMPRESSED_REFS
+inline Value GcReadBarrier(const HeapRef *field) {
+  Value value = *field;
+  if (value.Bits() >= (uintptr_t)g_condemned_start &&
+      value.Bits() < (uintptr_t)g_condemned_end) {
+    value = GcForwardField(&value);
+    *const_cast<HeapRef *>(field) = value;
+  }
+
+  return value;
+}
+
+inline Value GcReadBarrier(const ConsField *field) {
+  Value value = *field;
+  if (value.Bits() >= (uintptr_t)g_condemned_start &&
+      value.Bits() < (uintptr_t)g_condemned_end) {
+    value = GcForwardField(&value);
+    *const_cast<ConsField *>(field) = value;
+  }
+
+  return value;
+}
+#endif
+
+// A cons cell. Cons cells are the most common objects by far, so they
+// don't have any header or padding of their own: the GC finds out that
+// they're conses from the page that they live on.
 struct Cons {
-  Sexp *car;
-  Sexp *cdr;
+  ConsField car;
+  ConsField cdr;
+};
+
+// An activation is the runtime variable storage for a scope.
+// A new activation is introduced for every new syntactic scope.
+// Its slots are stored inline, right after its heap object, and there
+// are exactly as many of them as the analysis phase assigned to the
+// scope.
+//
+// Things are only ever defined into the global activation, which is the
+// one activation without a parent, so it's the only one that has to grow.
+// It has a single slot, which holds a slot array (a SLOTS object) with its
+// variables in it, and that slot array is replaced by a bigger one when it
+// fills up.
+class Activation {
+private:
+  HeapRef parent;
+  // the number of slots stored inline.
+#ifdef COMPRESSED_REFS
+  uint32_t count;
+#else
+  size_t count;
+#endif
+
+  inline Value *Slots();
+
+  // Replaces the slot array of the global activation with a bigger one
+  // that has room for at least min_count variables. This can trigger a GC.
+  static void Grow(Value act, size_t min_count);
+
+public:
+  // Activation retrievals are encoded as a tuple of two
+  // numbers: an "up" index and a "right" index. The "up"
+  // index is the distance from the use of the variable
+  // to the def of the variable - we have to go "up"
+  // some number of activations to get to the activation
+  // that contains the variable's location. The "right"
+  // index is the slot number of that variable in the
+  // target activation.
+  //
+  // This method panics if the up_index is not valid.
+  // It is up to the semantic analysis stage to generate
+  // correct coordinates for all activations except the
+  // global activation. The global activation will permit
+  // invalid right_indexes.
+  Value Get(size_t up_index, size_t right_index);
+
+  // Returns the value in the given slot of this activation, which can't be
+  // the global activation, or null if it hasn't been initialized. This is
+  // Get for the innermost scope, without walking any parents.
+  inline Value GetLocal(size_t right_index);
+
+  // Sets an activation slot to the given value. Generally
+  // only possible through the `set!` special form. This
+  // does the write barrier for the store, and can trigger
+  // a GC if the global activation has to grow.
+  static void Set(Value act, size_t up_index, size_t right_index,
+                  Value value);
+
+  // Returns the number of slots stored inline in this activation.
+  size_t SlotCount() const { return count; }
+
+  // Traces all of the pointers held live by this activation,
+  // as required by the GC. The parent is an object of its own,
+  // so it's only traced through its pointer.
+  template <typename F> void TracePointers(F func) {
+    Value *slots = Slots();
+    for (size_t i = 0; i < count; i++) {
+      if (slots[i] != nullptr) {
+        func(&slots[i]);
+      }
+    }
+
+    if (parent != nullptr) {
+      TraceRef(&parent, func);
+    }
+  }
+
+  friend class GcHeap;
+  // the VM reads locals and fills in the arguments of a call directly.
+  friend Value Execute(Value code, Value act);
 };
 
 struct Function {
-  class LambdaMeaning *func_meaning;
-  Sexp *activation;
+  // the MEANING cell that holds the function's LambdaMeaning. the GC uses
+  // it to tell that the compilation unit the function came from is in use.
+  HeapRef func_meaning;
+  HeapRef activation;
+
+  class LambdaMeaning *Lambda() const;
 };
 
 // This excessive use of templates is to ensure that we always safely
@@ -48,10 +538,10 @@ struct Function {
 // that the compiler do it for us.
 //
 // This helper ultimately calls the native function by indexing the
-// argument double-pointer given here, which is a pointer into a vector
+// argument pointer given here, which is a pointer into a vector
 // maintained by the runtime.
 template <typename Ret, typename... Args, size_t... Index>
-Ret NativeFunctionHelper(std::function<Ret(Args...)> wrapped, Sexp **args,
+Ret NativeFunctionHelper(std::function<Ret(Args...)> wrapped, Value *args,
                          std::index_sequence<Index...>) {
 // both GCC and MSVC are silly and don't think that args is being used here,
 // despite it obviously being used by the parameter pack below.
@@ -64,16 +554,16 @@ Ret NativeFunctionHelper(std::function<Ret(Args...)> wrapped, Sexp **args,
 // A wrapper around a native function that can be finalized by the runtime
 // when it goes out of scope.
 struct NativeFunction {
-  std::function<Sexp *(Sexp **)> *func;
+  std::function<Value(Value *)> *func;
   size_t arity;
 
-  NativeFunction(std::function<Sexp *(Sexp **)> *func, size_t arity)
+  NativeFunction(std::function<Value(Value *)> *func, size_t arity)
       : func(func), arity(arity) {}
 
   template <typename Ret, typename... Args>
   NativeFunction(std::function<Ret(Args...)> wrapped) {
     arity = sizeof...(Args);
-    func = new std::function<Sexp *(Sexp **)>([=](Sexp **args) {
+    func = new std::function<Value(Value *)>([=](Value *args) {
       return NativeFunctionHelper(wrapped, args,
                                   std::make_index_sequence<sizeof...(Args)>{});
     });
@@ -83,44 +573,57 @@ struct NativeFunction {
   ~NativeFunction() = default;
 };
 
-// An s-expression. All values at runtime are represented
-// by this structure.
+// Strings and slot arrays are variable-length objects. Their contents are
+// stored inline, right after the object, unless they're too big to fit on
+// a page with it. Those keep their contents on the native heap, and are
+// the only objects other than native functions that need to be finalized.
+// Activations are variable-length too, but always fit on a page.
+struct String {
+  jet_string chars;
+  // the length of the string, not counting the terminating null.
+  size_t length;
+};
+
+struct Slots {
+  Value *values;
+  size_t count;
+};
+
+// An object on the managed heap, for every kind of object other than
+// cons cells. Values that aren't immediates point to either one of
+// these or to a Cons. The kind of an object is recorded in the header
+// of the page it lives on (see HeapPage), not in the object itself.
+// Objects whose contents are smaller than the union (see ObjectSize)
+// only take up as much of it as they need.
 struct Sexp {
   enum Kind {
-    EMPTY,
     CONS,
-    SYMBOL,
     STRING,
-    FIXNUM,
-    BOOL,
-    END_OF_FILE,
     ACTIVATION,
     FUNCTION,
     NATIVE_FUNCTION,
     MEANING,
-    CHARACTER,
     PORT,
-    MACRO
+    MACRO,
+    SLOTS,
+    BOX
   };
 
-  Kind kind;
+  static const size_t kind_count = BOX + 1;
+
+  // The padding is zero for every live object, which serves as a useful
+  // checksum. When the GC copies an object, it stores the address of the
+  // copy here. It comes first so that it's in the same place for objects
+  // of every size.
+  uint64_t padding;
+
   union {
-    // Cons, a linked list of values.
-    Cons cons;
-    // Symbol, an interned string value.
-    size_t symbol_value;
     // String, a string value.
-    jet_string string_value;
-    // Fixnum, a fixed-sized integer value.
-    jet_fixnum fixnum_value;
-    // Bool, a boolean value.
-    jet_bool bool_value;
-    // Char, a char value.
-    jet_char char_value;
+    String string;
     // Port, an input or output port.
     jet_port port_value;
     // An activation.
-    class Activation *activation;
+    Activation activation;
     // A native function to be called.
     NativeFunction native_function;
     // A Jet function to be called.
@@ -128,166 +631,233 @@ struct Sexp {
     // A meaning. Generally not exposed to the user,
     // but it's here so that it can be GC'd.
     class Meaning *meaning;
+    // The variables of an activation.
+    Slots slots;
+    // A number stored in a cons, in a build with compressed references.
+    jet_fixnum number;
   };
 
-  // Padding to ensure that the size of this structure evenly
-  // divides a page. Also serves as a useful checksum.
-  uint64_t padding;
-
-#ifdef _MSC_VER
-  // MSVC lays out this class differently enough to alter its
-  // alignment. We still need to align to a page, so we need more padding.
-  uint64_t padding_2;
-#endif
-
-#ifdef __arm__
-  // same with 32-bit arm, but only because of the decrease in pointer
-  // size.
-  uint64_t padding_2;
-#endif
+  // Finalizes this object. Should only be called by the garbage collector.
+  void Finalize();
 
-  // Returns true if this sexp is the empty sexp.
-  inline bool IsEmpty() const { return kind == Sexp::Kind::EMPTY; }
+  // Detaches what this object owns outside of the managed heap, so that
+  // it can be released later. Should only be called by the garbage
+  // collector, on an object that is dead.
+  Finalizer DetachFinalizer();
 
-  // Returns true if this sexp is a cons sexp.
-  inline bool IsCons() const { return kind == Sexp::Kind::CONS; }
+  // The address right after this object, where the contents of a
+  // variable-length object are stored if they're inline.
+  uint8_t *InlineStorage() { return reinterpret_cast<uint8_t *>(this + 1); }
+};
 
-  // Returns true if this sexp is a symbol.
-  inline bool IsSymbol() const { return kind == Sexp::Kind::SYMBOL; }
+// What a dead object owned outside of the managed heap. The GC detaches
+// this from the object while it still has the object's memory to look at,
+// and then releases it whenever is convenient, possibly on another thread.
+struct Finalizer {
+  Sexp::Kind kind;
+  void *resource;
 
-  // Returns true if this sexp is a fixnum.
-  inline bool IsFixnum() const { return kind == Sexp::Kind::FIXNUM; }
+  // Releases the resource.
+  void Run();
+};
 
-  // Returns true if this sexp is a bool.
-  inline bool IsBool() const { return kind == Sexp::Kind::BOOL; }
+// The heap is split into pages that each hold objects of a single kind,
+// a "big bag of pages". Every page starts with one of these headers,
+// which is where the kind of the objects on it comes from. This is what
+// lets a cons cell be just a car and a cdr.
+struct HeapPage {
+  Sexp::Kind kind;
+  // Set by the GC if an object on this page might point into the nursery.
+  uint16_t remembered;
+  // Set by the conservative GC if this page can't be moved, because
+  // something on the native stack might point into it.
+  uint16_t pinned;
+  // The offset of the end of the last object on this page.
+  uint32_t end;
+  // The compilation unit that owns this page, if it's in the code space.
+  uint32_t unit;
+
+  // Returns the page that the object at the given address lives on.
+  static HeapPage *Of(uint64_t address) {
+    return reinterpret_cast<HeapPage *>(address & ~(uint64_t)(PAGE_SIZE - 1));
+  }
 
-  // Returns true if this sexp is a char.
-  inline bool IsChar() const { return kind == Sexp::Kind::CHARACTER; }
+  uint8_t *Begin() { return reinterpret_cast<uint8_t *>(this + 1); }
+  uint8_t *End() { return reinterpret_cast<uint8_t *>(this) + end; }
+};
 
-  // Returns true if this sexp is a port.
-  inline bool IsPort() const { return kind == Sexp::Kind::PORT; }
+static_assert(sizeof(HeapPage) % sizeof(uint64_t) == 0,
+              "page headers must keep objects aligned");
+static_assert(sizeof(Activation) % sizeof(uint64_t) == 0 &&
+                  sizeof(Function) % sizeof(uint64_t) == 0,
+              "activations and functions must keep objects aligned");
+static_assert(sizeof(HeapPage) + sizeof(Sexp) <= PAGE_SIZE,
+              "an s-expression must fit on a page");
+
+// The most that can be stored inline after a variable-length object.
+const size_t max_inline_size = PAGE_SIZE - sizeof(HeapPage) - sizeof(Sexp);
+
+// Returns the size of an object of the given kind, not counting the inline
+// contents of a variable-length object.
+inline size_t ObjectSize(Sexp::Kind kind) {
+  switch (kind) {
+  case Sexp::Kind::CONS:
+    return sizeof(Cons);
+  case Sexp::Kind::ACTIVATION:
+    return sizeof(uint64_t) + sizeof(Activation);
+  case Sexp::Kind::FUNCTION:
+  case Sexp::Kind::MACRO:
+    return sizeof(uint64_t) + sizeof(Function);
+  case Sexp::Kind::BOX:
+    return sizeof(uint64_t) + sizeof(jet_fixnum);
+  default:
+    return sizeof(Sexp);
+  }
+}
 
-  // Returns true if this sexp is a string.
-  inline bool IsString() const { return kind == Sexp::Kind::STRING; }
+// Returns the size of the inline storage needed for contents of the given
+// size, or zero if they're too big to be stored inline.
+inline size_t InlineSize(size_t size) {
+  size = (size + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+  return size <= max_inline_size ? size : 0;
+}
 
-  // Returns true if this sexp is the EOF object.
-  inline bool IsEof() const { return kind == Sexp::Kind::END_OF_FILE; }
+// Returns the size of the object at the given address, which is on a page
+// of objects of the given kind.
+inline size_t ObjectSize(Sexp::Kind kind, uint8_t *address) {
+  Sexp *obj = reinterpret_cast<Sexp *>(address);
+  switch (kind) {
+  case Sexp::Kind::STRING:
+    if (obj->string.chars == (jet_string)obj->InlineStorage()) {
+      return sizeof(Sexp) + InlineSize(obj->string.length + 1);
+    }
 
-  // Returns true if this sexp is an activation.
-  inline bool IsActivation() const { return kind == Sexp::Kind::ACTIVATION; }
+    return sizeof(Sexp);
+  case Sexp::Kind::SLOTS:
+    if (obj->slots.values == (Value *)obj->InlineStorage()) {
+      return sizeof(Sexp) + obj->slots.count * sizeof(Value);
+    }
 
-  // Returns true if this sexp is a native function.
-  inline bool IsNativeFunction() const {
-    return kind == Sexp::Kind::NATIVE_FUNCTION;
+    return sizeof(Sexp);
+  case Sexp::Kind::ACTIVATION:
+    return ObjectSize(kind) + obj->activation.SlotCount() * sizeof(Value);
+  default:
+    return ObjectSize(kind);
   }
+}
+
+inline Value *Activation::Slots() {
+  return reinterpret_cast<Value *>(this + 1);
+}
 
-  // Returns true if this sexp is a function.
-  inline bool IsFunction() const { return kind == Sexp::Kind::FUNCTION; }
+inline Value Activation::GetLocal(size_t right_index) {
+  assert(parent != nullptr);
+  assert(right_index < count);
+  return GC_READ_BARRIER(Slots()[right_index]);
+}
 
-  // Returns true if this sexp is a meaning.
-  inline bool IsMeaning() const { return kind == Sexp::Kind::MEANING; }
+// The most slots that an activation can have.
+const size_t max_activation_slots = max_inline_size / sizeof(Value);
 
-  // Returns true if this sexp is a macro.
-  inline bool IsMacro() const { return kind == Sexp::Kind::MACRO; }
+inline Sexp *Value::AsObject() const {
+  assert(IsObject() && !IsCons());
+  return reinterpret_cast<Sexp *>(bits);
+}
 
-  // Returns true if this sexp evaluates to itself when evaluated.
-  // This includes most primitives.
-  inline bool IsAlreadyQuoted() const {
-    return !(IsEmpty() || IsCons() || IsSymbol());
-  }
+inline Cons *Value::AsCons() const {
+  assert(IsCons());
+  return reinterpret_cast<Cons *>(bits);
+}
 
-  inline Sexp *Car() const {
-    assert(IsCons());
-    return cons.car;
-  }
+inline bool Value::IsCons() const {
+  return IsObject() && HeapPage::Of(bits)->kind == Sexp::Kind::CONS;
+}
 
-  inline Sexp *Cdr() const {
-    assert(IsCons());
-    return cons.cdr;
-  }
+inline bool Value::IsString() const {
+  return IsObject() && HeapPage::Of(bits)->kind == Sexp::Kind::STRING;
+}
 
-  inline Sexp *Cadr() const {
-    assert(IsCons());
-    assert(cons.cdr->IsCons());
-    return cons.cdr->cons.car;
-  }
+inline bool Value::IsPort() const {
+  return IsObject() && HeapPage::Of(bits)->kind == Sexp::Kind::PORT;
+}
 
-  inline Sexp *Caddr() const {
-    assert(IsCons());
-    assert(cons.cdr->IsCons());
-    assert(cons.cdr->cons.cdr->IsCons());
-    return cons.cdr->cons.cdr->cons.car;
-  }
+inline bool Value::IsActivation() const {
+  return IsObject() && HeapPage::Of(bits)->kind == Sexp::Kind::ACTIVATION;
+}
 
-  // Iterates through a proper list.
-  void ForEach(std::function<void(Sexp *)> func);
-
-  // Returns a tuple of whether or not the list is proper and the list's length.
-  // A length of 0 on an improper list indicates it's not a list, while an
-  // improper
-  // list may have a nonzero length as well.
-  inline std::tuple<bool, size_t> Length() const {
-    if (!IsCons()) {
-      // if it's not a list, it has length 0.
-      return std::make_tuple(false, 0);
-    }
+inline bool Value::IsNativeFunction() const {
+  return IsObject() &&
+         HeapPage::Of(bits)->kind == Sexp::Kind::NATIVE_FUNCTION;
+}
 
-    const Sexp *cursor = this;
-    size_t count = 0;
-    while (true) {
-      if (cursor->IsEmpty()) {
-        break;
-      }
+inline bool Value::IsFunction() const {
+  return IsObject() && HeapPage::Of(bits)->kind == Sexp::Kind::FUNCTION;
+}
 
-      if (!cursor->IsCons()) {
-        return std::make_tuple(false, count);
-      }
+inline bool Value::IsMeaning() const {
+  return IsObject() && HeapPage::Of(bits)->kind == Sexp::Kind::MEANING;
+}
 
-      count++;
-      cursor = cursor->cons.cdr;
-    }
+inline bool Value::IsMacro() const {
+  return IsObject() && HeapPage::Of(bits)->kind == Sexp::Kind::MACRO;
+}
 
-    return std::make_tuple(true, count);
-  }
+inline bool Value::IsSlots() const {
+  return IsObject() && HeapPage::Of(bits)->kind == Sexp::Kind::SLOTS;
+}
 
-  // Returns true if this is a proper list, false otherwise.
-  // A list is proper if every car is a Cons or Empty.
-  inline bool IsProperList() const {
-    if (IsEmpty())
-      return true;
-    bool is_proper;
-    std::tie(is_proper, std::ignore) = Length();
-    return is_proper;
+// Returns the value that a cons field holds, unboxing it if it's a number.
+inline Value Unbox(Value field) {
+#ifdef COMPRESSED_REFS
+  if (field.IsObject() && HeapPage::Of(field.Bits())->kind == Sexp::Kind::BOX) {
+    return Value::Fixnum(field.AsObject()->number);
   }
+#endif
 
-  // Returns true of this sexp is "truthy", or evaluates to true
-  // when used as the condition of the `if` special form.
-  inline bool IsTruthy() const { return !(IsBool() && !this->bool_value); }
+  return field;
+}
 
-  // Trace all of the pointers contained in this sexp.
-  void TracePointers(std::function<void(Sexp **)> func);
+inline Value Value::Car() const {
+  return Unbox(GC_READ_BARRIER(AsCons()->car));
+}
 
-  // Finalizes this sexp. Should only be called by the garbage collector.
-  void Finalize();
+inline Value Value::Cdr() const {
+  return Unbox(GC_READ_BARRIER(AsCons()->cdr));
+}
 
-  // Dumps a debug representation of this sexp to the given ostream.
-  void Dump(std::ostream &stream) const;
+inline Value Value::Cadr() const {
+  assert(IsCons());
+  assert(Cdr()->IsCons());
+  return Cdr()->Car();
+}
 
-  // Dumps a debug representation of this sexp to standard out.
-  void Dump() const { Dump(std::cout); }
+inline Value Value::Caddr() const {
+  assert(IsCons());
+  assert(Cdr()->IsCons());
+  assert(Cdr()->Cdr()->IsCons());
+  return Cdr()->Cdr()->Car();
+}
 
-  // Dumps a debug representation of this sexp to a string.
-  std::string DumpString() const {
-    std::ostringstream stream;
-    Dump(stream);
-    return stream.str();
+inline std::tuple<bool, size_t> Value::Length() const {
+  if (!IsCons()) {
+    // if it's not a list, it has length 0.
+    return std::make_tuple(false, 0);
   }
 
-private:
-  void DumpAtom(std::ostream &stream) const;
-};
+  Value cursor = *this;
+  size_t count = 0;
+  while (true) {
+    if (cursor->IsEmpty()) {
+      break;
+    }
+
+    if (!cursor->IsCons()) {
+      return std::make_tuple(false, count);
+    }
 
-static_assert(PAGE_SIZE % sizeof(Sexp) == 0,
-              "the size of sexp must evenly divide a page");
-static_assert(sizeof(Sexp) < PAGE_SIZE,
-              "the size of an s-expression must be less than a page");
+    count++;
+    cursor = cursor->Cdr();
+  }
+
+  return std::make_tuple(true, count);
+}
@@ -0,0 +1,391 @@
+// Copyright (c) 2016 Sean Gillespie
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// afurnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#include "vm.h"
+#include "bytecode.h"
+#include "contract.h"
+#include "gc.h"
+
+Value g_vm_stack[VM_STACK_SIZE];
+Value *g_vm_sp = g_vm_stack;
+VmFrame g_vm_frames[VM_FRAME_COUNT];
+VmFrame *g_vm_fp = g_vm_frames;
+
+// GCC and Clang can jump straight to the code for the next instruction
+// through a table of label addresses, which predicts much better than a
+// switch does. Anything else uses the switch.
+#if defined(__GNUC__)
+#define VM_COMPUTED_GOTO
+#endif
+
+[[noreturn]] static void UninitializedRead() {
+  throw JetRuntimeException("invalid read of uninitialized variable. Run "
+                            "with --warnings for more details.");
+}
+
+static BytecodeMeaning *BytecodeOf(Value code) {
+  assert(code->IsMeaning());
+  return static_cast<BytecodeMeaning *>(code->AsObject()->meaning);
+}
+
+// Makes sure that there is room for a frame that runs the given code
+// starting at base, along with the value that a call pushes on top of it.
+static void CheckStackRoom(Value *base, BytecodeMeaning *code) {
+  if (base + code->MaxStack() + 1 > g_vm_stack + VM_STACK_SIZE) {
+    throw JetRuntimeException("stack overflow");
+  }
+}
+
+// Allocates the list of the rest arguments of a variadic call.
+static Value RestList(Value *args, size_t count) {
+  GC_HELPER_FRAME;
+  GC_PROTECTED_LOCAL_VECTOR(rest);
+
+  rest.assign(args, args + count);
+  return GcHeap::AllocateList(rest);
+}
+
+// Puts the VM's stacks back the way they were when a run of the VM started,
+// whether it returns or throws.
+class VmStackRestorer {
+private:
+  Value *sp;
+  VmFrame *fp;
+
+public:
+  VmStackRestorer() : sp(g_vm_sp), fp(g_vm_fp) {}
+  ~VmStackRestorer() {
+    g_vm_sp = sp;
+    g_vm_fp = fp;
+  }
+
+  VmStackRestorer(const VmStackRestorer &) = delete;
+  VmStackRestorer &operator=(const VmStackRestorer &) = delete;
+};
+
+Value Execute(Value code, Value act) {
+  VmStackRestorer restorer;
+  VmFrame *entry_fp = g_vm_fp;
+
+  BytecodeMeaning *meaning = BytecodeOf(code);
+  Value *base = g_vm_sp;
+  CheckStackRoom(base, meaning);
+  base[0] = code;
+  base[1] = act;
+
+  // the top of the stack is kept in a local, and written back to g_vm_sp
+  // before anything that might collect or call back into the VM.
+  Value *sp = base + 2;
+  const uint32_t *pc = meaning->Code();
+  const Value *constants = meaning->Constants();
+
+  size_t count;
+  bool tail;
+  Value result;
+
+#ifdef VM_COMPUTED_GOTO
+// label addresses and computed gotos are extensions, which -pedantic would
+// reject. The warning is only turned off for the table and the jumps.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+  static void *dispatch_table[] = {
+#define DISPATCH_LABEL(name, operands) &&op_##name,
+      OPCODES(DISPATCH_LABEL)
+#undef DISPATCH_LABEL
+  };
+#pragma GCC diagnostic pop
+
+#define DISPATCH()                                                             \
+  _Pragma("GCC diagnostic push")                                               \
+  _Pragma("GCC diagnostic ignored \"-Wpedantic\"")                             \
+  goto *dispatch_table[*pc++];                                                 \
+  _Pragma("GCC diagnostic pop")
+#define CASE(name) op_##name
+  DISPATCH();
+#else
+#define DISPATCH() continue
+#define CASE(name) case Opcode::name
+  for (;;) {
+    switch (static_cast<Opcode>(*pc++)) {
+#endif
+
+  CASE(Constant) : {
+    *sp++ = GC_READ_BARRIER(constants[*pc++]);
+    DISPATCH();
+  }
+
+  CASE(LoadLocal) : {
+    Activation &activation = base[1]->AsObject()->activation;
+    assert(*pc < activation.count);
+    Value value = GC_READ_BARRIER(activation.Slots()[*pc++]);
+    if (value == nullptr) {
+      UninitializedRead();
+    }
+
+    *sp++ = value;
+    DISPATCH();
+  }
+
+  CASE(LoadFree) : {
+    *sp++ = base[1]->AsObject()->activation.Get(pc[0], pc[1]);
+    pc += 2;
+    DISPATCH();
+  }
+
+  CASE(LoadArgument) : {
+    *sp++ = base[*pc++ + 1];
+    DISPATCH();
+  }
+
+  CASE(LoadCaptured) : {
+    Value closed = GC_READ_BARRIER(base[0]->AsObject()->function.activation);
+    *sp++ = closed->AsObject()->activation.Get(pc[0], pc[1]);
+    pc += 2;
+    DISPATCH();
+  }
+
+  CASE(LoadGlobal) : {
+    Activation &global = g_global_activation->AsObject()->activation;
+    Value globals = GC_READ_BARRIER(global.Slots()[0]);
+    Slots &slots = globals->AsObject()->slots;
+    if (*pc >= slots.count) {
+      UninitializedRead();
+    }
+
+    Value value = GC_READ_BARRIER(slots.values[*pc++]);
+    if (value == nullptr) {
+      UninitializedRead();
+    }
+
+    *sp++ = value;
+    DISPATCH();
+  }
+
+  CASE(StoreLocal) : {
+    g_vm_sp = sp;
+    Activation::Set(base[1], 0, *pc++, sp[-1]);
+    sp[-1] = GcHeap::AllocateEmpty();
+    DISPATCH();
+  }
+
+  CASE(StoreFree) : {
+    g_vm_sp = sp;
+    Activation::Set(base[1], pc[0], pc[1], sp[-1]);
+    pc += 2;
+    sp[-1] = GcHeap::AllocateEmpty();
+    DISPATCH();
+  }
+
+  CASE(StoreArgument) : {
+    base[*pc++ + 1] = sp[-1];
+    sp[-1] = GcHeap::AllocateEmpty();
+    DISPATCH();
+  }
+
+  CASE(StoreCaptured) : {
+    g_vm_sp = sp;
+    Value closed = GC_READ_BARRIER(base[0]->AsObject()->function.activation);
+    Activation::Set(closed, pc[0], pc[1], sp[-1]);
+    pc += 2;
+    sp[-1] = GcHeap::AllocateEmpty();
+    DISPATCH();
+  }
+
+  CASE(StoreGlobal) : {
+    // defining a global can grow the table that they're kept in.
+    g_vm_sp = sp;
+    Activation::Set(g_global_activation, 0, *pc++, sp[-1]);
+    sp[-1] = GcHeap::AllocateEmpty();
+    DISPATCH();
+  }
+
+  CASE(Pop) : {
+    sp--;
+    DISPATCH();
+  }
+
+  CASE(Jump) : {
+    pc += *pc + 1;
+    DISPATCH();
+  }
+
+  CASE(JumpIfFalse) : {
+    uint32_t offset = *pc++;
+    if (!(*--sp)->IsTruthy()) {
+      pc += offset;
+    }
+
+    DISPATCH();
+  }
+
+  CASE(JumpIfTrue) : {
+    uint32_t offset = *pc++;
+    if ((*--sp)->IsTruthy()) {
+      pc += offset;
+    }
+
+    DISPATCH();
+  }
+
+  CASE(Closure) : {
+    g_vm_sp = sp;
+    Value lambda = GC_READ_BARRIER(constants[*pc++]);
+    *sp++ = GcHeap::AllocateFunction(lambda, base[1]);
+    DISPATCH();
+  }
+
+  CASE(Call) : {
+    count = *pc++;
+    tail = false;
+    goto call;
+  }
+
+  CASE(TailCall) : {
+    count = *pc++;
+    tail = true;
+    goto call;
+  }
+
+  CASE(Return) : {
+    result = sp[-1];
+    goto leave;
+  }
+
+  call : {
+    Value *callee = sp - count - 1;
+    Value func = *callee;
+    if (func->IsFunction() || func->IsMacro()) {
+      // the lambda meaning itself isn't on the heap, so it's safe to hold
+      // on to across a GC. the function stays on the stack, at the start
+      // of the new frame, which keeps its compilation unit alive.
+      LambdaMeaning *lambda = func->AsObject()->function.Lambda();
+      size_t arity = lambda->Arity();
+      if (lambda->IsVariadic() ? count < arity : count != arity) {
+        throw JetRuntimeException("arity mismatch");
+      }
+
+      Value *new_base = tail ? base : callee;
+      BytecodeMeaning *callee_code = BytecodeOf(lambda->Code());
+      CheckStackRoom(new_base, callee_code);
+      if (!tail && g_vm_fp == g_vm_frames + VM_FRAME_COUNT) {
+        throw JetRuntimeException("stack overflow");
+      }
+
+      g_vm_sp = sp;
+      if (callee_code->ArgumentsOnStack()) {
+        if (lambda->IsVariadic()) {
+          // the rest arguments are replaced by a list of them, which is
+          // empty if there aren't any.
+          Value rest = RestList(callee + arity + 1, count - arity);
+          callee[arity + 1] = rest;
+          sp = callee + arity + 2;
+        }
+
+        if (tail) {
+          // the function and its arguments take the place of the frame
+          // that's making the call.
+          size_t size = sp - callee;
+          std::copy(callee, sp, base);
+          sp = base + size;
+        }
+      } else {
+        Value child = GcHeap::AllocateActivation(
+            GC_READ_BARRIER(func->AsObject()->function.activation),
+            lambda->SlotCount());
+
+        Value *slots = child->AsObject()->activation.Slots();
+        for (size_t i = 0; i < arity; i++) {
+          GC_WRITE_BARRIER(child, callee[i + 1]);
+          slots[i] = callee[i + 1];
+        }
+
+        if (lambda->IsVariadic()) {
+          // the rest arguments go in a list in the last slot, which is
+          // empty if there aren't any. the activation has to stay on the
+          // stack while the list is allocated.
+          *sp++ = child;
+          g_vm_sp = sp;
+          Value rest = RestList(callee + arity + 1, count - arity);
+          child = *--sp;
+          GC_WRITE_BARRIER(child, rest);
+          child->AsObject()->activation.Slots()[arity] = rest;
+        }
+
+        // a GC can have moved the function.
+        new_base[0] = *callee;
+        new_base[1] = child;
+        sp = new_base + 2;
+      }
+
+      if (!tail) {
+        *g_vm_fp++ = VmFrame{pc, base, constants};
+      }
+
+      base = new_base;
+      pc = callee_code->Code();
+      constants = callee_code->Constants();
+      DISPATCH();
+    }
+
+    if (func->IsNativeFunction()) {
+      NativeFunction &native = func->AsObject()->native_function;
+      if (count != native.arity) {
+        throw JetRuntimeException("arity mismatch");
+      }
+
+      // the arguments are passed straight off of the stack, which keeps
+      // them alive while the function runs.
+      std::function<Value(Value *)> *target = native.func;
+      g_vm_sp = sp;
+      result = (*target)(callee + 1);
+      sp = callee;
+      if (tail) {
+        goto leave;
+      }
+
+      *sp++ = result;
+      DISPATCH();
+    }
+
+    throw JetRuntimeException("called a non-callable value");
+  }
+
+  leave : {
+    if (g_vm_fp == entry_fp) {
+      return result;
+    }
+
+    sp = base;
+    VmFrame frame = *--g_vm_fp;
+    pc = frame.pc;
+    base = frame.base;
+    constants = frame.constants;
+    *sp++ = result;
+    DISPATCH();
+  }
+
+#ifndef VM_COMPUTED_GOTO
+    }
+  }
+#endif
+
+#undef DISPATCH
+#undef CASE
+}
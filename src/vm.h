@@ -0,0 +1,58 @@
+// Copyright (c) 2016 Sean Gillespie
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// afurnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// The VM runs the bytecode that meanings are compiled to (see bytecode.h).
+// Calls between compiled functions don't recurse on the native stack:
+// every call pushes a frame onto the VM's own stacks instead, and only
+// native functions that call back into the interpreter nest one run of
+// the VM inside another.
+#pragma once
+
+#include "sexp.h"
+#include <cstdint>
+
+// The number of values that the VM's stack can hold.
+#define VM_STACK_SIZE (1 << 20)
+
+// The number of calls that can be in progress at once.
+#define VM_FRAME_COUNT (1 << 18)
+
+// The values in use by the VM. Every frame starts with the function that
+// it's running and its activation or arguments (see BytecodeMeaning),
+// followed by the values that the code is working with. The GC scans all
+// of it, up to g_vm_sp, precisely.
+extern Value g_vm_stack[VM_STACK_SIZE];
+extern Value *g_vm_sp;
+
+// Where a call returns to: the instruction after the call, the start of
+// the caller's frame on the value stack and the constants of its code.
+struct VmFrame {
+  const uint32_t *pc;
+  Value *base;
+  const Value *constants;
+};
+
+extern VmFrame g_vm_frames[VM_FRAME_COUNT];
+extern VmFrame *g_vm_fp;
+
+// Runs the bytecode in the given MEANING cell with the given activation,
+// returning its value.
+Value Execute(Value code, Value act);
@@ -1,13 +1,18 @@
 require 'test/unit'
 
 TEST_COMMAND_EXE = ENV["JET_TEST_EXE"] || "jet"
-TEST_COMMAND = TEST_COMMAND_EXE + " -s " + (ENV["JET_TEST_STDLIB"] || ".")
+TEST_COMMAND = TEST_COMMAND_EXE + " -s " + (ENV["JET_TEST_STDLIB"] || ".") +
+    " " + (ENV["JET_TEST_FLAGS"] || "")
+
+# tests named in JET_TEST_SKIP, separated by commas, aren't run.
+TEST_SKIP = (ENV["JET_TEST_SKIP"] || "").split(",")
 
 SchemeTest = Struct.new(:name, :filename, :output)
 
 def create_test_cases(folder)
     tests = []
     Dir.glob(File.join folder, '*.jet').each do |file|
+        next if TEST_SKIP.include? File.basename(file, '.jet')
         tests << create_test_case(file)
     end
 
@@ -49,7 +54,15 @@ module Test::Unit::Assertions
   end
 end
 
-Atoms = create_test_class "atoms"
-Let = create_test_class "let"
-Functions = create_test_class "functions"
-Forms = create_test_class "forms"
\ No newline at end of file
+# the tests in limits run the heap out of room, so they're only run when
+# JET_TEST_LIMITS is set, along with a --heap-max-size small enough for
+# them to hit it.
+if ENV["JET_TEST_LIMITS"]
+    Limits = create_test_class "limits"
+else
+    Atoms = create_test_class "atoms"
+    Let = create_test_class "let"
+    Functions = create_test_class "functions"
+    Forms = create_test_class "forms"
+    Gc = create_test_class "gc"
+end